@@ -0,0 +1,65 @@
+// Times base64_decode_into against the decoder it replaced on one large payload, in GB/s of base64 input.
+//
+//   bench-base64 [MiB] [iterations]
+
+#include "common.h"
+#include "llama.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "utils.hpp"
+
+#include "base64-reference.hpp"
+
+bool server_verbose  = false;
+bool server_log_json = false;
+
+static double now_s()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char ** argv)
+{
+    const size_t mib    = argc > 1 ? (size_t) atoi(argv[1]) : 16;
+    const int    n_iter = argc > 2 ? atoi(argv[2]) : 20;
+
+    std::mt19937 rng(42);
+
+    std::vector<uint8_t> raw(mib << 20);
+    for (auto & b : raw)
+    {
+        b = (uint8_t) rng();
+    }
+    const std::string enc = base64_encode(raw.data(), raw.size());
+
+    // the old decoder is slow enough that one pass is plenty
+    double t0 = now_s();
+    const std::vector<uint8_t> want = reference_base64_decode(enc);
+    const double t_ref = now_s() - t0;
+
+    std::vector<uint8_t> out(enc.size() / 4 * 3 + 32);
+    size_t n = 0;
+    t0 = now_s();
+    for (int it = 0; it < n_iter; it++)
+    {
+        n = base64_decode_into(enc.data(), enc.size(), out.data());
+    }
+    const double t_new = (now_s() - t0) / n_iter;
+    out.resize(n);
+
+    printf("payload %zu MiB, %zu base64 characters\n", mib, enc.size());
+    printf("reference base64_decode  %8.2f GB/s\n", enc.size() / t_ref / 1e9);
+    printf("base64_decode_into       %8.2f GB/s\n", enc.size() / t_new / 1e9);
+
+    if (out != want || out != raw)
+    {
+        fprintf(stderr, "decoded payload differs\n");
+        return 1;
+    }
+
+    return 0;
+}
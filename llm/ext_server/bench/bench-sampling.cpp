@@ -0,0 +1,124 @@
+// Times greedy and top-k selection straight from the logits (logits_argmax, logits_top_k) against the
+// candidates array llama_sampling_sample builds before sampling, for common vocab sizes. The results of
+// both are compared on every run.
+//
+//   bench-sampling [iterations]
+
+#include "common.h"
+#include "llama.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "utils.hpp"
+
+bool server_verbose  = false;
+bool server_log_json = false;
+
+static double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// what the sampler does without the fast path: one llama_token_data per vocab entry, then the selection
+static void reference_candidates(const float *logits, int32_t n_vocab, std::vector<llama_token_data> &cur)
+{
+    cur.clear();
+    cur.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++)
+    {
+        cur.push_back(llama_token_data{id, logits[id], 0.0f});
+    }
+}
+
+static llama_token reference_greedy(const float *logits, int32_t n_vocab, std::vector<llama_token_data> &cur)
+{
+    reference_candidates(logits, n_vocab, cur);
+    llama_token best = 0;
+    for (size_t i = 1; i < cur.size(); i++)
+    {
+        if (cur[i].logit > cur[best].logit)
+        {
+            best = (llama_token) i;
+        }
+    }
+    return cur[best].id;
+}
+
+static void reference_top_k(const float *logits, int32_t n_vocab, int32_t k, std::vector<llama_token_data> &cur)
+{
+    reference_candidates(logits, n_vocab, cur);
+    std::partial_sort(cur.begin(), cur.begin() + k, cur.end(), [](const llama_token_data &a, const llama_token_data &b) {
+        return a.logit > b.logit;
+    });
+    cur.resize(k);
+}
+
+int main(int argc, char **argv)
+{
+    const int n_iter = argc > 1 ? std::max(1, atoi(argv[1])) : 200;
+    const int32_t n_vocabs[] = { 32000, 32064, 49152, 128256, 151936, 256000 };
+    const int32_t top_k = 40;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    printf("%8s %14s %14s %8s %14s %14s %8s\n", "n_vocab", "greedy ref us", "argmax us", "speedup", "top-k ref us", "top_k us", "speedup");
+
+    int n_mismatch = 0;
+    for (int32_t n_vocab : n_vocabs)
+    {
+        // a few logit vectors, so the timings don't measure one cache-resident array
+        std::vector<std::vector<float>> logits(8, std::vector<float>(n_vocab));
+        for (auto &l : logits)
+        {
+            for (float &x : l)
+            {
+                x = dist(rng);
+            }
+        }
+
+        std::vector<llama_token_data> cur;
+        std::vector<llama_token_data> top;
+
+        double t_ref_greedy = 0, t_argmax = 0, t_ref_top_k = 0, t_top_k = 0;
+        for (int it = 0; it < n_iter; it++)
+        {
+            const float *l = logits[it % logits.size()].data();
+
+            double t0 = now_us();
+            const llama_token ref = reference_greedy(l, n_vocab, cur);
+            double t1 = now_us();
+            const llama_token fast = logits_argmax(l, n_vocab);
+            double t2 = now_us();
+            t_ref_greedy += t1 - t0;
+            t_argmax     += t2 - t1;
+            n_mismatch   += ref != fast;
+
+            t0 = now_us();
+            reference_top_k(l, n_vocab, top_k, cur);
+            t1 = now_us();
+            logits_top_k(l, n_vocab, top_k, top);
+            t2 = now_us();
+            t_ref_top_k += t1 - t0;
+            t_top_k     += t2 - t1;
+            for (int32_t i = 0; i < top_k; i++)
+            {
+                n_mismatch += cur[i].id != top[i].id;
+            }
+        }
+
+        printf("%8d %14.2f %14.2f %7.1fx %14.2f %14.2f %7.1fx\n", n_vocab,
+               t_ref_greedy / n_iter, t_argmax / n_iter, t_ref_greedy / t_argmax,
+               t_ref_top_k / n_iter, t_top_k / n_iter, t_ref_top_k / t_top_k);
+    }
+
+    if (n_mismatch != 0)
+    {
+        fprintf(stderr, "%d results differ from the reference\n", n_mismatch);
+        return 1;
+    }
+    return 0;
+}
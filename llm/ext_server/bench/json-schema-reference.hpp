@@ -0,0 +1,317 @@
+#pragma once
+
+// A recursive descent reference for test-json-schema: a parser of compact JSON text and a validator of the schema
+// keywords json_schema_automaton supports, with the automaton's documented limits spelled out instead of built
+// into a grammar:
+// - no whitespace between tokens, string bytes are not checked for UTF-8 (the automaton works on bytes)
+// - numbers have at most 16 integral digits, 16 fraction digits and 3 exponent digits
+// - properties come in the order of the schema, each at most once, and no others
+// - const and enum compare the compact text of the value
+// - oneOf is anyOf, the automaton can't count matching alternatives
+// - untyped values only nest objects and arrays up to a fixed depth
+// - maxItems above the unrolled limit is ignored
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+namespace reference_json_schema {
+
+using ordered_json = nlohmann::ordered_json;
+
+static const int max_any_depth      = 3;
+static const int max_unrolled_items = 64;
+static const int max_number_digits  = 16;
+
+enum value_kind { STRING, NUMBER, INTEGER, BOOLEAN, NULL_VALUE, OBJECT, ARRAY };
+
+struct value {
+    value_kind  kind = NULL_VALUE;
+    std::string text; // the whole text of the value
+    std::vector<std::pair<std::string, value>> members; // object: the text of each key, with its quotes
+    std::vector<value> items;
+};
+
+struct parser {
+    const std::string & s;
+    size_t pos = 0;
+
+    explicit parser(const std::string & s) : s(s) {}
+
+    bool eat(const char * lit) {
+        const std::string l(lit);
+        if (s.compare(pos, l.size(), l) != 0) {
+            return false;
+        }
+        pos += l.size();
+        return true;
+    }
+
+    bool digit() const {
+        return pos < s.size() && s[pos] >= '0' && s[pos] <= '9';
+    }
+
+    int digits() {
+        int n = 0;
+        while (digit()) {
+            pos++;
+            n++;
+        }
+        return n;
+    }
+
+    bool string() {
+        if (!eat("\"")) {
+            return false;
+        }
+        while (pos < s.size()) {
+            const unsigned char c = s[pos++];
+            if (c == '"') {
+                return true;
+            }
+            if (c < 0x20) {
+                return false;
+            }
+            if (c != '\\') {
+                continue;
+            }
+            if (pos >= s.size()) {
+                return false;
+            }
+            const char e = s[pos++];
+            if (e == 'u') {
+                for (int i = 0; i < 4; i++) {
+                    if (pos >= s.size() || !isxdigit((unsigned char) s[pos])) {
+                        return false;
+                    }
+                    pos++;
+                }
+            } else if (std::string("\"\\/bfnrt").find(e) == std::string::npos) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool number(value & v) {
+        eat("-");
+        if (eat("0")) {
+            // no leading zeros
+        } else if (digit() && s[pos] != '0') {
+            if (digits() > max_number_digits) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        v.kind = INTEGER;
+        if (eat(".")) {
+            const int n = digits();
+            if (n < 1 || n > max_number_digits) {
+                return false;
+            }
+            v.kind = NUMBER;
+        }
+        if (eat("e") || eat("E")) {
+            if (!eat("+")) {
+                eat("-");
+            }
+            const int n = digits();
+            if (n < 1 || n > 3) {
+                return false;
+            }
+            v.kind = NUMBER;
+        }
+        return true;
+    }
+
+    bool parse(value & v) {
+        const size_t start = pos;
+        if (pos >= s.size()) {
+            return false;
+        }
+        bool ok = true;
+        if (s[pos] == '"') {
+            v.kind = STRING;
+            ok = string();
+        } else if (s[pos] == '{') {
+            v.kind = OBJECT;
+            pos++;
+            if (!eat("}")) {
+                do {
+                    const size_t key = pos;
+                    value member;
+                    if (!string() || !eat(":")) {
+                        return false;
+                    }
+                    const std::string key_text = s.substr(key, pos - 1 - key);
+                    if (!parse(member)) {
+                        return false;
+                    }
+                    v.members.emplace_back(key_text, std::move(member));
+                } while (eat(","));
+                ok = eat("}");
+            }
+        } else if (s[pos] == '[') {
+            v.kind = ARRAY;
+            pos++;
+            if (!eat("]")) {
+                do {
+                    v.items.emplace_back();
+                    if (!parse(v.items.back())) {
+                        return false;
+                    }
+                } while (eat(","));
+                ok = eat("]");
+            }
+        } else if (eat("true") || eat("false")) {
+            v.kind = BOOLEAN;
+        } else if (eat("null")) {
+            v.kind = NULL_VALUE;
+        } else {
+            ok = number(v);
+        }
+        v.text = s.substr(start, pos - start);
+        return ok;
+    }
+};
+
+static bool any(const value & v, int depth);
+
+static bool free_object(const value & v, int depth) {
+    if (v.kind != OBJECT) {
+        return false;
+    }
+    if (depth >= max_any_depth) {
+        return v.members.empty();
+    }
+    for (const auto & m : v.members) {
+        if (!any(m.second, depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool matches(const ordered_json & schema, const value & v, int depth);
+
+static bool array(const ordered_json & schema, const value & v, int depth) {
+    if (v.kind != ARRAY) {
+        return false;
+    }
+    const ordered_json items = schema.contains("items") ? schema.at("items") : ordered_json::object();
+    const int64_t n_min = schema.contains("minItems") ? schema.at("minItems").get<int64_t>() : 0;
+    int64_t n_max = schema.contains("maxItems") ? schema.at("maxItems").get<int64_t>() : -1;
+    if (n_max > max_unrolled_items) {
+        n_max = -1;
+    }
+    if ((int64_t) v.items.size() < n_min || (n_max >= 0 && (int64_t) v.items.size() > n_max)) {
+        return false;
+    }
+    for (const value & item : v.items) {
+        if (!matches(items, item, depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool any(const value & v, int depth) {
+    if (v.kind == OBJECT) {
+        return depth < max_any_depth && free_object(v, depth);
+    }
+    if (v.kind == ARRAY) {
+        return depth < max_any_depth && array(ordered_json::object(), v, depth);
+    }
+    return true;
+}
+
+static bool object(const ordered_json & schema, const value & v, int depth) {
+    if (!schema.contains("properties") || !schema.at("properties").is_object()) {
+        return free_object(v, depth);
+    }
+    if (v.kind != OBJECT) {
+        return false;
+    }
+    size_t next = 0; // the next member of v
+    for (const auto & prop : schema.at("properties").items()) {
+        bool required = false;
+        if (schema.contains("required") && schema.at("required").is_array()) {
+            for (const auto & r : schema.at("required")) {
+                required = required || (r.is_string() && r.get<std::string>() == prop.key());
+            }
+        }
+        if (next < v.members.size() && v.members[next].first == ordered_json(prop.key()).dump()) {
+            if (!matches(prop.value(), v.members[next].second, depth + 1)) {
+                return false;
+            }
+            next++;
+        } else if (required) {
+            return false;
+        }
+    }
+    return next == v.members.size();
+}
+
+static bool matches(const ordered_json & schema, const value & v, int depth) {
+    if (schema.is_boolean()) {
+        return schema.get<bool>() && any(v, depth);
+    }
+    if (schema.contains("const")) {
+        return v.text == schema.at("const").dump();
+    }
+    if (schema.contains("enum") && schema.at("enum").is_array()) {
+        for (const auto & e : schema.at("enum")) {
+            if (v.text == e.dump()) {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (const char * key : {"anyOf", "oneOf"}) {
+        if (schema.contains(key) && schema.at(key).is_array()) {
+            for (const auto & sub : schema.at(key)) {
+                if (matches(sub, v, depth)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+    if (!schema.contains("type")) {
+        return any(v, depth);
+    }
+
+    const ordered_json & type = schema.at("type");
+    if (type.is_array()) {
+        for (const auto & t : type) {
+            ordered_json sub = schema;
+            sub["type"] = t;
+            if (matches(sub, v, depth)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    const std::string name = type.get<std::string>();
+    if (name == "object")  { return object(schema, v, depth); }
+    if (name == "array")   { return array(schema, v, depth); }
+    if (name == "string")  { return v.kind == STRING; }
+    if (name == "number")  { return v.kind == NUMBER || v.kind == INTEGER; }
+    if (name == "integer") { return v.kind == INTEGER; }
+    if (name == "boolean") { return v.kind == BOOLEAN; }
+    if (name == "null")    { return v.kind == NULL_VALUE; }
+    return false;
+}
+
+// whether the whole of text is a value the schema accepts
+static bool accepts(const ordered_json & schema, const std::string & text) {
+    parser p(text);
+    value v;
+    return p.parse(v) && p.pos == text.size() && matches(schema, v, 0);
+}
+
+} // namespace reference_json_schema
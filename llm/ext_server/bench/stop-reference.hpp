@@ -0,0 +1,66 @@
+#pragma once
+
+// The stop string search stop_string_matcher replaced, kept as the reference for test-stop: every stop word
+// searched again in the text that was not sent yet, once for a full match and once for a partial one.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+static inline bool reference_ends_with(const std::string & str, const std::string & suffix)
+{
+    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+}
+
+static inline size_t reference_find_partial_stop_string(const std::string & stop, const std::string & text)
+{
+    if (!text.empty() && !stop.empty())
+    {
+        const char text_last_char = text.back();
+        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
+        {
+            if (stop[char_index] == text_last_char)
+            {
+                const std::string current_partial = stop.substr(0, char_index + 1);
+                if (reference_ends_with(text, current_partial))
+                {
+                    return text.size() - char_index - 1;
+                }
+            }
+        }
+    }
+    return std::string::npos;
+}
+
+// find_stopping_strings of the server, without the slot: word is set to the index of the stop word of a full match
+static inline size_t reference_find_stopping_strings(const std::vector<std::string> & words, const std::string & text,
+                                                     const size_t last_token_size, const bool full, int & word)
+{
+    size_t stop_pos = std::string::npos;
+
+    for (size_t w = 0; w < words.size(); ++w)
+    {
+        size_t pos;
+        if (full)
+        {
+            const size_t tmp = words[w].size() + last_token_size;
+            const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+            pos = text.find(words[w], from_pos);
+        }
+        else
+        {
+            pos = reference_find_partial_stop_string(words[w], text);
+        }
+        if (pos != std::string::npos &&
+            (stop_pos == std::string::npos || pos < stop_pos))
+        {
+            if (full)
+            {
+                word = (int) w;
+            }
+            stop_pos = pos;
+        }
+    }
+
+    return stop_pos;
+}
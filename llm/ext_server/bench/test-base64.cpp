@@ -0,0 +1,87 @@
+// Differential test of base64_decode / base64_decode_into against the decoder they replaced, over random
+// valid, unpadded, truncated and corrupted inputs. Lengths cover the scalar tail and several vector blocks.
+//
+//   test-base64 [cases] [seed]
+
+#include "common.h"
+#include "llama.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "utils.hpp"
+
+#include "base64-reference.hpp"
+
+bool server_verbose  = false;
+bool server_log_json = false;
+
+int main(int argc, char ** argv)
+{
+    const int      n_cases = argc > 1 ? atoi(argv[1]) : 200000;
+    const uint32_t seed    = argc > 2 ? (uint32_t) atoi(argv[2]) : 42;
+
+    std::mt19937 rng(seed);
+
+    // characters that end the decodable prefix
+    const char stoppers[] = { '=', '\n', '\r', ' ', '-', '_', '.', '\0', (char) 0x80, (char) 0xc3, (char) 0xff };
+
+    int failures = 0;
+    for (int c = 0; c < n_cases; c++)
+    {
+        const size_t n_bytes = rng() % 4 == 0 ? rng() % 1024 : rng() % 64;
+
+        std::vector<uint8_t> raw(n_bytes);
+        for (auto & b : raw)
+        {
+            b = (uint8_t) rng();
+        }
+
+        std::string enc = base64_encode(raw.data(), raw.size());
+
+        const bool valid = rng() % 2 == 0;
+        if (!valid)
+        {
+            switch (rng() % 3)
+            {
+                case 0:
+                    while (!enc.empty() && enc.back() == '=')
+                    {
+                        enc.pop_back();
+                    }
+                    break;
+                case 1:
+                    enc.resize(rng() % (enc.size() + 1));
+                    break;
+                default:
+                    if (!enc.empty())
+                    {
+                        enc[rng() % enc.size()] = stoppers[rng() % sizeof(stoppers)];
+                    }
+                    break;
+            }
+        }
+
+        const std::vector<uint8_t> want = reference_base64_decode(enc);
+        const std::vector<uint8_t> got  = base64_decode(enc);
+
+        // base64_decode_into from an unaligned input
+        std::string shifted = " " + enc;
+        std::vector<uint8_t> into(enc.size() / 4 * 3 + 32);
+        into.resize(base64_decode_into(shifted.data() + 1, enc.size(), into.data()));
+
+        if (got != want || into != want || (valid && got != raw))
+        {
+            if (failures++ < 10)
+            {
+                fprintf(stderr, "case %d: mismatch for \"%s\" (reference %zu bytes, decoded %zu bytes)\n",
+                        c, enc.c_str(), want.size(), got.size());
+            }
+        }
+    }
+
+    printf("%d cases, %d failures\n", n_cases, failures);
+
+    return failures == 0 ? 0 : 1;
+}
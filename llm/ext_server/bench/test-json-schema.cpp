@@ -0,0 +1,459 @@
+// Differential tests of json_schema_automaton against the recursive descent reference in json-schema-reference.hpp:
+// - for every schema, compact JSON texts built from it, arbitrary ones, and both cut short or with a byte changed,
+//   are accepted by the automaton exactly when the reference accepts them.
+// - on the way through each text, the token masks agree with walking the pieces, EOS is allowed in accepting
+//   states only, and every state reached can still reach an accepting one.
+// - schemas no value satisfies are rejected, and a vocab large enough that masks are built after compile and past
+//   max_mask_bytes gives the same masks.
+//
+//   test-json-schema [cases] [seed]
+
+#include "llama.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "json-schema.hpp"
+
+#include "json-schema-reference.hpp"
+
+static int failures = 0;
+
+static void fail(const std::string & schema, const std::string & text, const char * what)
+{
+    if (failures++ < 10)
+    {
+        fprintf(stderr, "%s: %s\n  text: %s\n", schema.c_str(), what, text.c_str());
+    }
+}
+
+static const char * schemas[] = {
+    R"({"type":"string"})",
+    R"({"type":"number"})",
+    R"({"type":"integer"})",
+    R"({"type":"boolean"})",
+    R"({"type":"null"})",
+    R"({})",
+    R"(true)",
+    R"({"enum":["a",1,null,[1,2],{"x":true}]})",
+    R"({"const":{"a":[1,"b"]}})",
+    R"({"anyOf":[{"type":"integer"},{"type":"string"}]})",
+    R"({"oneOf":[{"type":"null"},{"type":"array","items":{"type":"boolean"}}]})",
+    R"({"type":["string","null","integer"]})",
+    R"({"type":"object","properties":{"name":{"type":"string"},"age":{"type":"integer"},"tags":{"type":"array","items":{"type":"string"},"maxItems":3}},"required":["name"]})",
+    R"({"type":"object"})",
+    R"({"type":"array","items":{"type":"number"},"minItems":2,"maxItems":4})",
+    R"({"type":"array","minItems":1})",
+    R"({"type":"array","items":{"type":"integer"},"maxItems":100})",
+    R"({"type":"object","properties":{"a":{"type":"object","properties":{"b":{"type":"object"}}}},"required":["a"]})",
+    R"({"type":"array","items":{"type":"array","items":{}}})",
+    R"({"type":"object","properties":{"a":{"enum":[]},"b":{"type":"integer"}}})",
+    R"({"type":"object","properties":{"k\"ey":{"const":"v"},"é":{"type":"boolean"}},"required":["é"]})",
+};
+
+static const char * unsatisfiable[] = {
+    R"({"enum":[]})",
+    R"({"anyOf":[]})",
+    R"({"type":[]})",
+    R"({"oneOf":[{"enum":[]},{"anyOf":[]}]})",
+    R"({"type":"object","properties":{"a":{"enum":[]}},"required":["a"]})",
+    R"({"type":"array","items":{"anyOf":[]},"minItems":1})",
+};
+
+// unrolled arrays of objects, enough states for masks past max_mask_bytes with the large vocab
+static const char * large_schema =
+    R"({"type":"array","items":{"type":"object","properties":{"a":{"type":"number"},"b":{"type":"integer"},"c":{"enum":["x","y"]}}},"maxItems":64})";
+
+static size_t pick(std::mt19937 & rng, size_t n)
+{
+    return rng() % n;
+}
+
+static std::string random_digits(std::mt19937 & rng, int n)
+{
+    std::string s;
+    for (int i = 0; i < n; i++)
+    {
+        s += (char) ('0' + pick(rng, 10));
+    }
+    return s;
+}
+
+// numbers around the digit limits, sometimes past them or malformed
+static std::string random_number(std::mt19937 & rng, bool integer)
+{
+    std::string s = pick(rng, 3) == 0 ? "-" : "";
+    const int n_int = pick(rng, 8) == 0 ? 15 + (int) pick(rng, 3) : 1 + (int) pick(rng, 4);
+    s += pick(rng, 10) == 0 ? "0" : std::string(1, (char) ('1' + pick(rng, 9))) + random_digits(rng, n_int - 1);
+    if (!integer || pick(rng, 8) == 0)
+    {
+        if (pick(rng, 2) == 0)
+        {
+            s += "." + random_digits(rng, pick(rng, 8) == 0 ? 15 + (int) pick(rng, 3) : (int) pick(rng, 4));
+        }
+        if (pick(rng, 3) == 0)
+        {
+            static const char * signs[] = {"", "+", "-"};
+            s += pick(rng, 2) ? "e" : "E";
+            s += signs[pick(rng, 3)];
+            s += random_digits(rng, (int) pick(rng, 5));
+        }
+    }
+    return s;
+}
+
+static std::string random_string(std::mt19937 & rng)
+{
+    static const char * pieces[] = {"a", "b", " ", "\"", "\\", "\n", "\x01", "/", "\xc3\xa9", "x"};
+    std::string s;
+    for (size_t n = pick(rng, 6); n > 0; n--)
+    {
+        s += pieces[pick(rng, sizeof(pieces) / sizeof(pieces[0]))];
+    }
+    std::string text = ordered_json(s).dump();
+    if (pick(rng, 10) == 0)
+    {
+        text.insert(1, pick(rng, 2) ? "\\u00e9" : "\\/");
+    }
+    return text;
+}
+
+static std::string random_any(std::mt19937 & rng, int depth)
+{
+    switch (pick(rng, depth < 5 ? 8 : 6))
+    {
+        case 0: return random_string(rng);
+        case 1: return random_number(rng, false);
+        case 2: return random_number(rng, true);
+        case 3: return pick(rng, 2) ? "true" : "false";
+        case 4: return "null";
+        case 5: return pick(rng, 2) ? "{}" : "[]";
+        case 6:
+        {
+            std::string s = "{";
+            for (size_t n = 1 + pick(rng, 3); n > 0; n--)
+            {
+                s += random_string(rng) + ":" + random_any(rng, depth + 1) + (n > 1 ? "," : "");
+            }
+            return s + "}";
+        }
+        default:
+        {
+            std::string s = "[";
+            for (size_t n = 1 + pick(rng, 3); n > 0; n--)
+            {
+                s += random_any(rng, depth + 1) + (n > 1 ? "," : "");
+            }
+            return s + "]";
+        }
+    }
+}
+
+// a text meant to match schema, which it does not always do
+static std::string random_value(std::mt19937 & rng, const ordered_json & schema, int depth)
+{
+    if (!schema.is_object() || pick(rng, 20) == 0)
+    {
+        return random_any(rng, depth);
+    }
+    if (schema.contains("const"))
+    {
+        return schema.at("const").dump();
+    }
+    if (schema.contains("enum") && !schema.at("enum").empty())
+    {
+        return schema.at("enum").at(pick(rng, schema.at("enum").size())).dump();
+    }
+    for (const char * key : {"anyOf", "oneOf"})
+    {
+        if (schema.contains(key) && !schema.at(key).empty())
+        {
+            return random_value(rng, schema.at(key).at(pick(rng, schema.at(key).size())), depth);
+        }
+    }
+    if (!schema.contains("type"))
+    {
+        return random_any(rng, depth);
+    }
+
+    ordered_json type = schema.at("type");
+    if (type.is_array())
+    {
+        if (type.empty())
+        {
+            return random_any(rng, depth);
+        }
+        type = type.at(pick(rng, type.size()));
+    }
+    const std::string name = type.get<std::string>();
+    if (name == "object" && schema.contains("properties"))
+    {
+        std::string s = "{";
+        for (const auto & prop : schema.at("properties").items())
+        {
+            if (pick(rng, 3) != 0)
+            {
+                s += (s.size() > 1 ? "," : "") + ordered_json(prop.key()).dump() + ":" + random_value(rng, prop.value(), depth + 1);
+            }
+        }
+        return s + "}";
+    }
+    if (name == "array")
+    {
+        const ordered_json items = schema.contains("items") ? schema.at("items") : ordered_json::object();
+        const size_t n_min = schema.contains("minItems") ? schema.at("minItems").get<size_t>() : 0;
+        std::string s = "[";
+        for (size_t n = n_min + pick(rng, 4); n > 0; n--)
+        {
+            s += random_value(rng, items, depth + 1) + (n > 1 ? "," : "");
+        }
+        return s + "]";
+    }
+    if (name == "string")  { return random_string(rng); }
+    if (name == "number")  { return random_number(rng, false); }
+    if (name == "integer") { return random_number(rng, true); }
+    if (name == "boolean") { return pick(rng, 2) ? "true" : "false"; }
+    if (name == "null")    { return "null"; }
+    return random_any(rng, depth);
+}
+
+static std::string mutate(std::mt19937 & rng, std::string text)
+{
+    static const std::string bytes = "{}[]:,\"\\0123456789.-+eEtrufalsn ab\x01\x80";
+    if (text.empty())
+    {
+        return text;
+    }
+    switch (pick(rng, 4))
+    {
+        case 0: text.resize(pick(rng, text.size())); break;
+        case 1: text[pick(rng, text.size())] = bytes[pick(rng, bytes.size())]; break;
+        case 2: text.insert(pick(rng, text.size() + 1), 1, bytes[pick(rng, bytes.size())]); break;
+        default: break;
+    }
+    return text;
+}
+
+// every state that can be reached from the start can still reach an accepting one
+static bool all_live(const json_schema_automaton & automaton)
+{
+    const size_t n = automaton.transitions.size();
+    std::vector<bool> reached(n, false);
+    std::vector<int32_t> stack(1, 0);
+    reached[0] = true;
+    while (!stack.empty())
+    {
+        const int32_t s = stack.back();
+        stack.pop_back();
+        for (const int32_t to : automaton.transitions[s])
+        {
+            if (to != json_schema_automaton::DEAD && !reached[to])
+            {
+                reached[to] = true;
+                stack.push_back(to);
+            }
+        }
+    }
+
+    for (size_t s = 0; s < n; s++)
+    {
+        if (!reached[s])
+        {
+            continue;
+        }
+        // forward search for an accepting state
+        std::vector<bool> seen(n, false);
+        std::vector<int32_t> todo(1, (int32_t) s);
+        seen[s] = true;
+        bool live = false;
+        while (!todo.empty() && !live)
+        {
+            const int32_t cur = todo.back();
+            todo.pop_back();
+            live = automaton.accepting[cur];
+            for (const int32_t to : automaton.transitions[cur])
+            {
+                if (to != json_schema_automaton::DEAD && !seen[to])
+                {
+                    seen[to] = true;
+                    todo.push_back(to);
+                }
+            }
+        }
+        if (!live)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct test_vocab
+{
+    std::vector<std::string> pieces;
+    std::vector<llama_token> sorted;
+    std::vector<int32_t>     lcp;
+    llama_token              eos;
+
+    void finish()
+    {
+        eos = (llama_token) pieces.size();
+        pieces.push_back(""); // EOS has no text
+        json_schema_sort_vocab(pieces, sorted, lcp);
+    }
+};
+
+// every byte, and pieces spanning the punctuation of compact JSON
+static test_vocab small_vocab()
+{
+    test_vocab vocab;
+    for (int c = 0; c < 256; c++)
+    {
+        vocab.pieces.push_back(std::string(1, (char) c));
+    }
+    for (const char * piece : {"true", "false", "null", "{\"", "\":", "\",\"", "},", "[{", "]}", "\"a\"", "12", ".5",
+                               "e+", "\\u00", "ab", "\"name\":\"", "1,", "],[", "tr", "\xc3\xa9"})
+    {
+        vocab.pieces.push_back(piece);
+    }
+    vocab.finish();
+    return vocab;
+}
+
+static test_vocab large_vocab(std::mt19937 & rng)
+{
+    static const std::string bytes = "{}[]:,\"0123456789abcxy-.etruflsn";
+    test_vocab vocab = small_vocab();
+    vocab.pieces.pop_back();
+    while (vocab.pieces.size() < (1 << 16))
+    {
+        std::string piece;
+        for (size_t n = 1 + pick(rng, 6); n > 0; n--)
+        {
+            piece += bytes[pick(rng, bytes.size())];
+        }
+        vocab.pieces.push_back(piece);
+    }
+    vocab.finish();
+    return vocab;
+}
+
+static bool mask_agrees(const json_schema_automaton & automaton, const test_vocab & vocab, int32_t state, llama_token tok)
+{
+    const std::string & piece = vocab.pieces[tok];
+    const bool walk = tok == vocab.eos ? (bool) automaton.accepting[state]
+                                       : !piece.empty() && automaton.advance(state, piece) != json_schema_automaton::DEAD;
+    return automaton.is_allowed(state, tok) == walk;
+}
+
+static void test_schema(std::mt19937 & rng, const char * text, const test_vocab & vocab, int n_cases)
+{
+    const ordered_json schema = ordered_json::parse(text);
+    json_schema_automaton automaton;
+    if (!automaton.compile(schema, vocab.pieces, vocab.sorted, vocab.lcp, vocab.eos))
+    {
+        fail(text, "", ("rejected: " + automaton.error).c_str());
+        return;
+    }
+    if (!all_live(automaton))
+    {
+        fail(text, "", "a reachable state can't reach an accepting one");
+    }
+
+    for (int c = 0; c < n_cases; c++)
+    {
+        std::string candidate = pick(rng, 4) == 0 ? random_any(rng, 0) : random_value(rng, schema, 0);
+        if (pick(rng, 2) == 0)
+        {
+            candidate = mutate(rng, candidate);
+        }
+
+        int32_t state = 0;
+        for (size_t i = 0; i < candidate.size() && state != json_schema_automaton::DEAD; i++)
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                const llama_token tok = k == 0 ? vocab.eos : (llama_token) pick(rng, vocab.pieces.size());
+                if (!mask_agrees(automaton, vocab, state, tok))
+                {
+                    fail(text, candidate, "mask differs from walking the piece");
+                    return;
+                }
+            }
+            state = automaton.transitions[state][(uint8_t) candidate[i]];
+        }
+        const bool accepted = state != json_schema_automaton::DEAD && automaton.accepting[state];
+        if (accepted != reference_json_schema::accepts(schema, candidate))
+        {
+            fail(text, candidate, accepted ? "accepted, the reference rejects it" : "rejected, the reference accepts it");
+            return;
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const int      n_cases = argc > 1 ? atoi(argv[1]) : 20000;
+    const uint32_t seed    = argc > 2 ? (uint32_t) atoi(argv[2]) : 42;
+
+    std::mt19937 rng(seed);
+    const test_vocab vocab = small_vocab();
+
+    for (const char * text : schemas)
+    {
+        test_schema(rng, text, vocab, n_cases);
+    }
+
+    for (const char * text : unsatisfiable)
+    {
+        json_schema_automaton automaton;
+        if (automaton.compile(ordered_json::parse(text), vocab.pieces, vocab.sorted, vocab.lcp, vocab.eos))
+        {
+            fail(text, "", "compiled a schema no value satisfies");
+        }
+    }
+
+    // masks built by compile, on first use and past max_mask_bytes
+    {
+        const test_vocab large = large_vocab(rng);
+        json_schema_automaton automaton;
+        if (!automaton.compile(ordered_json::parse(large_schema), large.pieces, large.sorted, large.lcp, large.eos))
+        {
+            fail(large_schema, "", ("rejected: " + automaton.error).c_str());
+        }
+        else if (automaton.transitions.size() * large.pieces.size() / 8 <= json_schema_automaton::max_mask_bytes)
+        {
+            fail(large_schema, "", "too few states to go past max_mask_bytes");
+        }
+        else
+        {
+            for (int32_t state = 0; state < (int32_t) automaton.transitions.size(); state++)
+            {
+                for (int k = 0; k < 16; k++)
+                {
+                    if (!mask_agrees(automaton, large, state, (llama_token) pick(rng, large.pieces.size())))
+                    {
+                        fail(large_schema, std::to_string(state), "mask of the large vocab differs");
+                        break;
+                    }
+                }
+            }
+            size_t kept = 0;
+            for (const std::vector<uint64_t> & bits : automaton.allowed)
+            {
+                kept += bits.size() * sizeof(uint64_t);
+            }
+            if (kept > json_schema_automaton::max_mask_bytes)
+            {
+                fail(large_schema, "", "masks kept past max_mask_bytes");
+            }
+            test_schema(rng, large_schema, large, n_cases / 10);
+        }
+    }
+
+    const int n_schemas = (int) (sizeof(schemas) / sizeof(schemas[0]) + sizeof(unsatisfiable) / sizeof(unsatisfiable[0])) + 1;
+    printf("%d schemas, %d cases each, %d failures\n", n_schemas, n_cases, failures);
+    return failures == 0 ? 0 : 1;
+}
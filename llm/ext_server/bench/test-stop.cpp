@@ -0,0 +1,210 @@
+// Differential tests of the stop matchers over random generations on a small alphabet, so stops overlap, are
+// prefixes of each other and are cut at the end of pieces:
+// - stop_string_matcher against the find_stopping_strings search it replaced: the first full match (position
+//   and word), and the partial match held back at the end of every piece until then.
+// - stop_token_matcher against a naive suffix check of the sampled tokens, with the hold and release rule of
+//   process_sampled_token: tokens that may start a stop sequence are held, released once it breaks, dropped
+//   when it completes.
+//
+//   test-stop [cases] [seed]
+
+#include "common.h"
+#include "llama.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "utils.hpp"
+
+#include "stop-reference.hpp"
+
+bool server_verbose  = false;
+bool server_log_json = false;
+
+static int failures = 0;
+
+static void fail(int c, const char * what)
+{
+    if (failures++ < 10)
+    {
+        fprintf(stderr, "case %d: %s\n", c, what);
+    }
+}
+
+static std::string random_string(std::mt19937 & rng, const std::string & alphabet, size_t n)
+{
+    std::string s;
+    for (size_t i = 0; i < n; i++)
+    {
+        s += alphabet[rng() % alphabet.size()];
+    }
+    return s;
+}
+
+static void test_strings(std::mt19937 & rng, int c)
+{
+    const std::string alphabet = rng() % 2 ? "ab" : "abc\n";
+
+    std::vector<std::string> words(1 + rng() % 4);
+    for (std::string & word : words)
+    {
+        word = random_string(rng, alphabet, 1 + rng() % 5);
+    }
+    // a stop that is a prefix or a suffix of another one
+    if (words.size() > 1 && rng() % 2)
+    {
+        const std::string & other = words[rng() % words.size()];
+        const size_t n = 1 + rng() % other.size();
+        words[0] = rng() % 2 ? other.substr(0, n) : other.substr(other.size() - n);
+    }
+
+    stop_string_matcher matcher;
+    matcher.build(words);
+
+    std::string text;
+    for (int piece_i = 0; piece_i < 64; piece_i++)
+    {
+        // pieces without text happen too, for tokens that only continue a UTF-8 character
+        const std::string piece = random_string(rng, alphabet, rng() % 5);
+        text += piece;
+        matcher.feed(piece);
+
+        int word = -1;
+        const size_t full = reference_find_stopping_strings(words, text, piece.size(), true, word);
+        if (matcher.match_pos != full || (full != std::string::npos && matcher.match_word != word))
+        {
+            fail(c, "stop string: full match differs");
+            return;
+        }
+        if (full != std::string::npos)
+        {
+            return; // the generation stops here
+        }
+        if (matcher.partial_pos() != reference_find_stopping_strings(words, text, piece.size(), false, word))
+        {
+            fail(c, "stop string: partial match differs");
+            return;
+        }
+    }
+}
+
+// the longest stop sequence the tokens end with, the first listed of equal ones, or -1
+static int naive_token_match(const std::vector<std::vector<llama_token>> & sequences, const std::vector<llama_token> & tokens)
+{
+    int best = -1;
+    for (size_t s = 0; s < sequences.size(); s++)
+    {
+        const std::vector<llama_token> & seq = sequences[s];
+        if (seq.size() <= tokens.size() && std::equal(seq.begin(), seq.end(), tokens.end() - seq.size()) &&
+            (best < 0 || seq.size() > sequences[best].size()))
+        {
+            best = (int) s;
+        }
+    }
+    return best;
+}
+
+// the number of trailing tokens that are the start of a stop sequence
+static size_t naive_token_partial(const std::vector<std::vector<llama_token>> & sequences, const std::vector<llama_token> & tokens)
+{
+    size_t best = 0;
+    for (const std::vector<llama_token> & seq : sequences)
+    {
+        for (size_t n = std::min(seq.size(), tokens.size()); n > best; n--)
+        {
+            if (std::equal(seq.begin(), seq.begin() + n, tokens.end() - n))
+            {
+                best = n;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+static void test_tokens(std::mt19937 & rng, int c)
+{
+    const llama_token n_vocab = 2 + rng() % 3;
+
+    std::vector<std::vector<llama_token>> sequences(1 + rng() % 4);
+    for (std::vector<llama_token> & seq : sequences)
+    {
+        seq.resize(1 + rng() % 4);
+        for (llama_token & tok : seq)
+        {
+            tok = rng() % n_vocab;
+        }
+    }
+    if (sequences.size() > 1 && rng() % 2)
+    {
+        const std::vector<llama_token> & other = sequences[rng() % sequences.size()];
+        const size_t n = 1 + rng() % other.size();
+        sequences[0] = rng() % 2 ? std::vector<llama_token>(other.begin(), other.begin() + n)
+                                 : std::vector<llama_token>(other.end() - n, other.end());
+    }
+
+    stop_token_matcher matcher;
+    matcher.build(sequences);
+
+    std::vector<llama_token> sampled;
+    std::vector<llama_token> released;
+    std::vector<llama_token> held;
+    for (int i = 0; i < 64; i++)
+    {
+        const llama_token tok = rng() % n_vocab;
+        sampled.push_back(tok);
+
+        // process_sampled_token
+        const int32_t matched = matcher.feed(tok);
+        held.push_back(tok);
+        const size_t n_hold  = matched >= 0 ? matcher.sequences[matched].size() : matcher.n_partial();
+        const size_t n_flush = held.size() - n_hold;
+        released.insert(released.end(), held.begin(), held.begin() + n_flush);
+        held.erase(held.begin(), held.begin() + n_flush);
+
+        const int want = naive_token_match(sequences, sampled);
+        if (matched != want)
+        {
+            fail(c, "stop tokens: match differs");
+            return;
+        }
+        if (matched >= 0)
+        {
+            // everything before the stop sequence went out, the sequence itself is dropped
+            if (released.size() + sequences[matched].size() != sampled.size() ||
+                !std::equal(released.begin(), released.end(), sampled.begin()))
+            {
+                fail(c, "stop tokens: wrong tokens released before the stop sequence");
+            }
+            return;
+        }
+
+        // nothing is lost or reordered, and only what may still start a stop sequence is held
+        std::vector<llama_token> all = released;
+        all.insert(all.end(), held.begin(), held.end());
+        if (all != sampled || held.size() != naive_token_partial(sequences, sampled))
+        {
+            fail(c, "stop tokens: wrong tokens held back");
+            return;
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const int      n_cases = argc > 1 ? atoi(argv[1]) : 100000;
+    const uint32_t seed    = argc > 2 ? (uint32_t) atoi(argv[2]) : 42;
+
+    std::mt19937 rng(seed);
+
+    for (int c = 0; c < n_cases; c++)
+    {
+        test_strings(rng, c);
+        test_tokens(rng, c);
+    }
+
+    printf("%d cases, %d failures\n", n_cases, failures);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,700 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "llama.h"
+#include "json.hpp"
+
+//
+// JSON schema constrained decoding
+//
+// The schema is compiled into a byte-level DFA (Thompson NFA + subset construction). For every DFA state
+// the set of vocab tokens whose bytes keep the output inside the DFA is a bitset, so sampling only has to mask
+// the logits and accepting a token is a walk over its bytes. compile builds the bitsets of the states closest to
+// the start, the others are built the first time generation reaches them.
+//
+// Supported: object (properties, required), array (items, minItems, maxItems), string, number, integer,
+// boolean, null, enum, const, anyOf / oneOf and lists of types. A schema without a type, or an object without
+// properties, accepts any JSON value up to a fixed nesting depth. $ref and string patterns are not supported.
+// Schemas whose automaton would be too large are rejected, see max_states and max_dfa_states, and so are schemas
+// no value satisfies, like an empty enum. Parts of a schema that can't be completed (an optional property with an
+// empty enum) are cut from the automaton, so generation never gets into a state it can't finish from.
+//
+// The output is compact JSON without whitespace between tokens, so keys and punctuation are fully determined
+// by the schema and can be emitted without sampling (see json_schema_automaton::forced).
+//
+
+using ordered_json = nlohmann::ordered_json;
+
+struct json_schema_nfa {
+    struct edge {
+        uint8_t lo;
+        uint8_t hi;
+        int32_t to;
+    };
+
+    std::vector<std::vector<edge>>    edges;
+    std::vector<std::vector<int32_t>> eps;
+
+    std::string error;
+
+    // nesting depth up to which untyped values may contain objects and arrays
+    static const int max_any_depth = 3;
+    static const int max_unrolled_items = 64;
+    static const int max_number_digits = 16;
+    // nested unrolled arrays grow the NFA exponentially, such schemas are rejected
+    static const int32_t max_states = 1 << 16;
+    static const int max_depth = 64;
+
+    int32_t new_state() {
+        edges.emplace_back();
+        eps.emplace_back();
+        return (int32_t) edges.size() - 1;
+    }
+
+    void add_range(int32_t from, uint8_t lo, uint8_t hi, int32_t to) {
+        edges[from].push_back({lo, hi, to});
+    }
+
+    void add_eps(int32_t from, int32_t to) {
+        eps[from].push_back(to);
+    }
+
+    int32_t literal(int32_t from, const std::string & str) {
+        for (const char c : str) {
+            const int32_t to = new_state();
+            add_range(from, (uint8_t) c, (uint8_t) c, to);
+            from = to;
+        }
+        return from;
+    }
+
+    int32_t string_value(int32_t from) {
+        const int32_t body = literal(from, "\"");
+        const int32_t esc  = new_state();
+        const int32_t end  = new_state();
+
+        add_range(body, 0x20, '"' - 1, body);
+        add_range(body, '"' + 1, '\\' - 1, body);
+        add_range(body, '\\' + 1, 0xFF, body);
+        add_range(body, '\\', '\\', esc);
+        add_range(body, '"', '"', end);
+
+        for (const char c : std::string("\"\\/bfnrt")) {
+            add_range(esc, (uint8_t) c, (uint8_t) c, body);
+        }
+
+        // \uXXXX
+        int32_t hex = literal(esc, "u");
+        for (int i = 0; i < 4; ++i) {
+            const int32_t next = i == 3 ? body : new_state();
+            add_range(hex, '0', '9', next);
+            add_range(hex, 'a', 'f', next);
+            add_range(hex, 'A', 'F', next);
+            hex = next;
+        }
+
+        return end;
+    }
+
+    // [0-9]{1,n}
+    int32_t digits(int32_t from, int n) {
+        const int32_t end = new_state();
+        for (int i = 0; i < n; ++i) {
+            const int32_t to = new_state();
+            add_range(from, '0', '9', to);
+            add_eps(to, end);
+            from = to;
+        }
+        return end;
+    }
+
+    int32_t number_value(int32_t from, bool integer) {
+        const int32_t sign = new_state();
+        add_eps(from, sign);
+        add_range(from, '-', '-', sign);
+
+        // integral part without leading zeros
+        const int32_t integral = new_state();
+        add_range(sign, '0', '0', integral);
+        const int32_t first = new_state();
+        add_range(sign, '1', '9', first);
+        add_eps(first, integral);
+        add_eps(digits(first, max_number_digits - 1), integral);
+
+        if (integer) {
+            return integral;
+        }
+
+        const int32_t end = new_state();
+        add_eps(integral, end);
+
+        const int32_t frac = digits(literal(integral, "."), max_number_digits);
+        add_eps(frac, end);
+
+        const int32_t exp      = new_state();
+        const int32_t exp_sign = new_state();
+        add_eps(integral, exp);
+        add_eps(frac, exp);
+        add_range(exp, 'e', 'e', exp_sign);
+        add_range(exp, 'E', 'E', exp_sign);
+        const int32_t exp_digits = new_state();
+        add_eps(exp_sign, exp_digits);
+        add_range(exp_sign, '-', '-', exp_digits);
+        add_range(exp_sign, '+', '+', exp_digits);
+        add_eps(digits(exp_digits, 3), end);
+
+        return end;
+    }
+
+    int32_t alternatives(int32_t from, const std::vector<ordered_json> & schemas, int depth) {
+        const int32_t end = new_state();
+        for (const ordered_json & schema : schemas) {
+            const int32_t to = value(from, schema, depth);
+            if (to < 0) {
+                return -1;
+            }
+            add_eps(to, end);
+        }
+        return end;
+    }
+
+    int32_t object_value(int32_t from, const ordered_json & schema, int depth) {
+        int32_t none = literal(from, "{"); // no property emitted yet
+        int32_t some = new_state();               // at least one property emitted, the next one needs a comma
+
+        if (!schema.contains("properties") || !schema.at("properties").is_object()) {
+            // free-form object: any string keys with untyped values
+            if (depth >= max_any_depth) {
+                add_eps(none, some);
+                return literal(some, "}");
+            }
+            const int32_t key_start = new_state();
+            add_eps(none, key_start);
+            add_eps(literal(some, ","), key_start);
+            const int32_t val = value(literal(string_value(key_start), ":"), ordered_json::object(), depth + 1);
+            if (val < 0) {
+                return -1;
+            }
+            add_eps(val, some);
+            // not through some, which would allow a comma before the first key
+            const int32_t end = literal(some, "}");
+            add_range(none, '}', '}', end);
+            return end;
+        }
+
+        std::vector<std::string> required;
+        if (schema.contains("required") && schema.at("required").is_array()) {
+            for (const auto & r : schema.at("required")) {
+                if (r.is_string()) {
+                    required.push_back(r.get<std::string>());
+                }
+            }
+        }
+
+        for (const auto & prop : schema.at("properties").items()) {
+            const bool is_required = std::find(required.begin(), required.end(), prop.key()) != required.end();
+            const std::string key  = ordered_json(prop.key()).dump() + ":";
+
+            const int32_t next_none = new_state();
+            const int32_t next_some = new_state();
+
+            // the property is the same fragment with or without a comma before it, so it is built once
+            const int32_t key_start = new_state();
+            add_eps(none, key_start);
+            add_eps(literal(some, ","), key_start);
+            const int32_t val = value(literal(key_start, key), prop.value(), depth + 1);
+            if (val < 0) {
+                return -1;
+            }
+            add_eps(val, next_some);
+
+            if (!is_required) {
+                add_eps(none, next_none);
+                add_eps(some, next_some);
+            }
+
+            none = next_none;
+            some = next_some;
+        }
+
+        add_eps(none, some);
+        return literal(some, "}");
+    }
+
+    int32_t array_value(int32_t from, const ordered_json & schema, int depth) {
+        const ordered_json items = schema.contains("items") ? schema.at("items") : ordered_json::object();
+        for (const char * key : {"minItems", "maxItems"}) {
+            if (!schema.contains(key)) {
+                continue;
+            }
+            const ordered_json & n = schema.at(key);
+            if (!n.is_number_integer() || n.get<int64_t>() < 0 || n.get<int64_t>() > INT32_MAX) {
+                error = std::string(key) + " must be a non-negative integer";
+                return -1;
+            }
+        }
+        const int n_min = schema.contains("minItems") ? schema.at("minItems").get<int>() : 0;
+        const int n_max = schema.contains("maxItems") ? schema.at("maxItems").get<int>() : -1;
+
+        if (n_min > max_unrolled_items) {
+            error = "minItems is too large";
+            return -1;
+        }
+        if (n_max >= 0 && n_max < n_min) {
+            error = "maxItems is smaller than minItems";
+            return -1;
+        }
+
+        const int32_t open  = literal(from, "[");
+        const int32_t close = new_state();
+        if (n_min == 0) {
+            add_eps(open, close);
+        }
+        if (n_max == 0) {
+            return literal(close, "]");
+        }
+
+        int32_t cur = value(open, items, depth + 1);
+        if (cur < 0) {
+            return -1;
+        }
+        for (int n = 1; n < n_min; ++n) {
+            cur = value(literal(cur, ","), items, depth + 1);
+            if (cur < 0) {
+                return -1;
+            }
+        }
+        add_eps(cur, close);
+
+        if (n_max < 0 || n_max > max_unrolled_items) {
+            const int32_t item = value(literal(cur, ","), items, depth + 1);
+            if (item < 0) {
+                return -1;
+            }
+            add_eps(item, cur);
+        } else {
+            for (int n = std::max(n_min, 1); n < n_max; ++n) {
+                cur = value(literal(cur, ","), items, depth + 1);
+                if (cur < 0) {
+                    return -1;
+                }
+                add_eps(cur, close);
+            }
+        }
+
+        return literal(close, "]");
+    }
+
+    int32_t any_value(int32_t from, int depth) {
+        const int32_t end = new_state();
+        add_eps(string_value(from), end);
+        add_eps(number_value(from, false), end);
+        add_eps(literal(from, "true"), end);
+        add_eps(literal(from, "false"), end);
+        add_eps(literal(from, "null"), end);
+        if (depth < max_any_depth) {
+            const int32_t obj = object_value(from, ordered_json::object(), depth);
+            const int32_t arr = array_value(from, ordered_json::object(), depth);
+            if (obj < 0 || arr < 0) {
+                return -1;
+            }
+            add_eps(obj, end);
+            add_eps(arr, end);
+        }
+        return end;
+    }
+
+    // add the fragment matching schema starting at state from, returns its end state or -1
+    int32_t value(int32_t from, const ordered_json & schema, int depth) {
+        if ((int32_t) edges.size() > max_states) {
+            error = "schema is too large";
+            return -1;
+        }
+        if (depth > max_depth) {
+            error = "schema is nested too deeply";
+            return -1;
+        }
+        if (schema.is_boolean() && schema.get<bool>()) {
+            return any_value(from, depth);
+        }
+        if (!schema.is_object()) {
+            error = "unsupported schema: " + schema.dump();
+            return -1;
+        }
+        if (schema.contains("$ref")) {
+            error = "$ref is not supported";
+            return -1;
+        }
+
+        if (schema.contains("const")) {
+            return literal(from, schema.at("const").dump());
+        }
+        if (schema.contains("enum") && schema.at("enum").is_array()) {
+            const int32_t end = new_state();
+            for (const auto & v : schema.at("enum")) {
+                add_eps(literal(from, v.dump()), end);
+            }
+            return end;
+        }
+        for (const char * key : {"anyOf", "oneOf"}) {
+            if (schema.contains(key) && schema.at(key).is_array()) {
+                return alternatives(from, schema.at(key).get<std::vector<ordered_json>>(), depth);
+            }
+        }
+
+        if (!schema.contains("type")) {
+            return any_value(from, depth);
+        }
+
+        const ordered_json & type = schema.at("type");
+        if (type.is_array()) {
+            std::vector<ordered_json> schemas;
+            for (const auto & t : type) {
+                ordered_json sub = schema;
+                sub["type"] = t;
+                schemas.push_back(sub);
+            }
+            return alternatives(from, schemas, depth);
+        }
+
+        const std::string type_name = type.is_string() ? type.get<std::string>() : "";
+        if (type_name == "object")  { return object_value(from, schema, depth); }
+        if (type_name == "array")   { return array_value(from, schema, depth); }
+        if (type_name == "string")  { return string_value(from); }
+        if (type_name == "number")  { return number_value(from, false); }
+        if (type_name == "integer") { return number_value(from, true); }
+        if (type_name == "boolean") {
+            const int32_t end = new_state();
+            add_eps(literal(from, "true"), end);
+            add_eps(literal(from, "false"), end);
+            return end;
+        }
+        if (type_name == "null") {
+            return literal(from, "null");
+        }
+
+        error = "unsupported type: " + type.dump();
+        return -1;
+    }
+
+    void closure(std::vector<int32_t> & states) const {
+        std::vector<int32_t> stack(states);
+        std::vector<bool> seen(edges.size(), false);
+        for (const int32_t s : states) {
+            seen[s] = true;
+        }
+        while (!stack.empty()) {
+            const int32_t s = stack.back();
+            stack.pop_back();
+            for (const int32_t to : eps[s]) {
+                if (!seen[to]) {
+                    seen[to] = true;
+                    states.push_back(to);
+                    stack.push_back(to);
+                }
+            }
+        }
+        std::sort(states.begin(), states.end());
+    }
+};
+
+struct json_schema_automaton {
+    static const int32_t DEAD = -1;
+
+    // byte-level DFA, state 0 is the start state
+    std::vector<std::array<int32_t, 256>> transitions;
+    std::vector<bool> accepting;
+
+    // per DFA state, the only byte that can follow it or -1 if there is a choice (or the state is accepting)
+    std::vector<int16_t> forced_byte;
+
+    // per DFA state, one bit per vocab token that can be emitted without leaving the DFA, empty until built;
+    // the states compile leaves out are built by mask() on the server loop, the only thread sampling with them
+    mutable std::vector<std::vector<uint64_t>> allowed;
+    mutable size_t mask_bytes = 0;       // of allowed
+    mutable std::vector<uint64_t> spare; // the mask of a state past max_mask_bytes, built again for every use
+
+    llama_token eos = -1;
+
+    std::string error;
+
+    // the vocab compile was given, kept for the masks built later
+    const std::vector<std::string> * pieces     = nullptr;
+    const std::vector<llama_token> * sorted_ids = nullptr;
+    const std::vector<int32_t>     * lcp        = nullptr;
+
+    // 1 KiB of transitions each
+    static const int32_t max_dfa_states = 1 << 15;
+    // DFA states times vocab size compile spends on the masks up front, the rest costs one vocab walk each
+    // the first time generation reaches them
+    static const int64_t max_mask_work = int64_t(1) << 27;
+    // masks kept per automaton, twice what max_mask_work builds up front
+    static const size_t max_mask_bytes = size_t(32) << 20;
+
+    // what the automaton can grow to once generation reached all its states; safe to call from any thread
+    size_t size_bytes() const {
+        const size_t mask_size = (pieces->size() + 63) / 64 * sizeof(uint64_t);
+        return transitions.size() * (sizeof(transitions[0]) + sizeof(int16_t) + 1) +
+               std::min((size_t) max_mask_bytes, transitions.size() * mask_size);
+    }
+
+    // the mask of state, built on first use: walk the vocab in sorted order, so each piece only walks the bytes
+    // past the prefix it shares with the previous one
+    const std::vector<uint64_t> & mask(int32_t state) const {
+        if (!allowed[state].empty()) {
+            return allowed[state];
+        }
+        const size_t n_words = (pieces->size() + 63) / 64;
+        const bool keep = mask_bytes + n_words * sizeof(uint64_t) <= max_mask_bytes;
+        std::vector<uint64_t> & bits = keep ? allowed[state] : spare;
+        mask_bytes += keep ? n_words * sizeof(uint64_t) : 0;
+        bits.assign(n_words, 0);
+
+        std::vector<int32_t> path(1, state); // path[d] = DFA state after the first d bytes of the previous piece
+        for (size_t i = 0; i < sorted_ids->size(); ++i) {
+            const llama_token tok = (*sorted_ids)[i];
+            const std::string & piece = (*pieces)[tok];
+            const int32_t shared = (*lcp)[i];
+            // path stops where the previous piece left the DFA, a piece sharing that byte leaves it as well
+            if ((size_t) shared >= path.size()) {
+                continue;
+            }
+            path.resize(shared + 1);
+            int32_t cur = path.back();
+            for (size_t d = shared; d < piece.size(); ++d) {
+                cur = transitions[cur][(uint8_t) piece[d]];
+                if (cur == DEAD) {
+                    break;
+                }
+                path.push_back(cur);
+            }
+            if (cur != DEAD && !piece.empty()) {
+                bits[tok / 64] |= uint64_t(1) << (tok % 64);
+            }
+        }
+        return bits;
+    }
+
+    int32_t advance(int32_t state, const std::string & piece) const {
+        for (const char c : piece) {
+            if (state == DEAD) {
+                break;
+            }
+            state = transitions[state][(uint8_t) c];
+        }
+        return state;
+    }
+
+    // the text that has to follow state no matter what is sampled, up to the next choice
+    std::string forced(int32_t state, size_t n_max) const {
+        std::string result;
+        while (state != DEAD && forced_byte[state] >= 0 && result.size() < n_max) {
+            result += (char) forced_byte[state];
+            state = transitions[state][forced_byte[state]];
+        }
+        return result;
+    }
+
+    bool is_allowed(int32_t state, llama_token tok) const {
+        if (state == DEAD) {
+            return tok == eos;
+        }
+        if (tok == eos) {
+            return accepting[state];
+        }
+        return (mask(state)[tok / 64] >> (tok % 64)) & 1;
+    }
+
+    // set the logits of every token that would break the schema to -inf
+    void apply(int32_t state, float * logits, int32_t n_vocab) const {
+        if (state == DEAD) {
+            for (int32_t i = 0; i < n_vocab; ++i) {
+                if (i != eos) {
+                    logits[i] = -INFINITY;
+                }
+            }
+            return;
+        }
+
+        const std::vector<uint64_t> & bits = mask(state);
+        for (int32_t w = 0; w * 64 < n_vocab; ++w) {
+            const uint64_t word = bits[w];
+            if (word == ~uint64_t(0)) {
+                continue;
+            }
+            const int32_t end = std::min(n_vocab, (w + 1) * 64);
+            for (int32_t i = w * 64; i < end; ++i) {
+                if (!((word >> (i % 64)) & 1)) {
+                    logits[i] = -INFINITY;
+                }
+            }
+        }
+
+        if (eos >= 0 && eos < n_vocab) {
+            logits[eos] = accepting[state] ? logits[eos] : -INFINITY;
+        }
+    }
+
+    // cut the transitions into states no accepting state can be reached from, false when that's the start state
+    bool prune() {
+        const int32_t n_states = (int32_t) transitions.size();
+        std::vector<std::vector<int32_t>> from(n_states);
+        for (int32_t s = 0; s < n_states; ++s) {
+            for (const int32_t to : transitions[s]) {
+                if (to != DEAD && (from[to].empty() || from[to].back() != s)) {
+                    from[to].push_back(s);
+                }
+            }
+        }
+
+        std::vector<bool> live(accepting);
+        std::vector<int32_t> stack;
+        for (int32_t s = 0; s < n_states; ++s) {
+            if (live[s]) {
+                stack.push_back(s);
+            }
+        }
+        while (!stack.empty()) {
+            const int32_t s = stack.back();
+            stack.pop_back();
+            for (const int32_t prev : from[s]) {
+                if (!live[prev]) {
+                    live[prev] = true;
+                    stack.push_back(prev);
+                }
+            }
+        }
+
+        for (auto & row : transitions) {
+            for (int32_t & to : row) {
+                if (to != DEAD && !live[to]) {
+                    to = DEAD;
+                }
+            }
+        }
+        return live[0];
+    }
+
+    // vocab holds the text of every token, vocab_sorted the token ids ordered by piece and vocab_lcp[i] the
+    // length of the common prefix of the pieces of vocab_sorted[i - 1] and vocab_sorted[i]; they have to outlive
+    // the automaton
+    bool compile(const ordered_json & schema, const std::vector<std::string> & vocab,
+                 const std::vector<llama_token> & vocab_sorted, const std::vector<int32_t> & vocab_lcp, llama_token eos_token) {
+        eos        = eos_token;
+        pieces     = &vocab;
+        sorted_ids = &vocab_sorted;
+        lcp        = &vocab_lcp;
+
+        json_schema_nfa nfa;
+        const int32_t start = nfa.new_state();
+        const int32_t end = nfa.value(start, schema, 0);
+        if (end < 0) {
+            error = nfa.error;
+            return false;
+        }
+
+        // subset construction
+        std::map<std::vector<int32_t>, int32_t> ids;
+        std::vector<std::vector<int32_t>> subsets;
+
+        std::vector<int32_t> initial = {start};
+        nfa.closure(initial);
+        ids[initial] = 0;
+        subsets.push_back(initial);
+
+        std::array<std::vector<int32_t>, 256> moves;
+        for (size_t i = 0; i < subsets.size(); ++i) {
+            for (auto & m : moves) {
+                m.clear();
+            }
+            for (const int32_t s : subsets[i]) {
+                for (const auto & e : nfa.edges[s]) {
+                    for (int c = e.lo; c <= e.hi; ++c) {
+                        moves[c].push_back(e.to);
+                    }
+                }
+            }
+
+            std::array<int32_t, 256> row;
+            for (int c = 0; c < 256; ++c) {
+                row[c] = DEAD;
+                if (moves[c].empty()) {
+                    continue;
+                }
+                std::vector<int32_t> & next = moves[c];
+                std::sort(next.begin(), next.end());
+                next.erase(std::unique(next.begin(), next.end()), next.end());
+                nfa.closure(next);
+
+                const auto it = ids.find(next);
+                if (it != ids.end()) {
+                    row[c] = it->second;
+                } else {
+                    if ((int32_t) subsets.size() >= max_dfa_states) {
+                        error = "schema is too complex, it needs more than " + std::to_string(max_dfa_states) + " automaton states";
+                        return false;
+                    }
+                    row[c] = (int32_t) subsets.size();
+                    ids[next] = row[c];
+                    subsets.push_back(next);
+                }
+            }
+            transitions.push_back(row);
+            accepting.push_back(std::binary_search(subsets[i].begin(), subsets[i].end(), end));
+        }
+
+        if (!prune()) {
+            error = "schema can't be satisfied by any value";
+            return false;
+        }
+
+        for (size_t i = 0; i < transitions.size(); ++i) {
+            int16_t forced = -1;
+            for (int c = 0; c < 256 && !accepting[i]; ++c) {
+                if (transitions[i][c] != DEAD) {
+                    if (forced >= 0) {
+                        forced = -1;
+                        break;
+                    }
+                    forced = (int16_t) c;
+                }
+            }
+            forced_byte.push_back(forced);
+        }
+
+        // the masks of the states closest to the start, subset construction numbers them breadth first
+        const int64_t n_vocab  = std::max<int64_t>(vocab.size(), 1);
+        const int32_t n_masked = (int32_t) std::min<int64_t>(transitions.size(), std::max<int64_t>(max_mask_work / n_vocab, 1));
+        allowed.resize(transitions.size());
+        for (int32_t state = 0; state < n_masked; ++state) {
+            mask(state);
+        }
+
+        return true;
+    }
+};
+
+// vocab pieces sorted for json_schema_automaton::compile
+static void json_schema_sort_vocab(const std::vector<std::string> & pieces, std::vector<llama_token> & sorted_ids, std::vector<int32_t> & lcp) {
+    sorted_ids.resize(pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        sorted_ids[i] = (llama_token) i;
+    }
+    std::sort(sorted_ids.begin(), sorted_ids.end(), [&](llama_token a, llama_token b) { return pieces[a] < pieces[b]; });
+
+    lcp.assign(pieces.size(), 0);
+    for (size_t i = 1; i < sorted_ids.size(); ++i) {
+        const std::string & a = pieces[sorted_ids[i - 1]];
+        const std::string & b = pieces[sorted_ids[i]];
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n]) {
+            n++;
+        }
+        lcp[i] = (int32_t) n;
+    }
+}
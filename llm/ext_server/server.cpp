@@ -24,6 +24,7 @@
 #include "llama.h"
 #include "grammar-parser.h"
 #include "utils.hpp"
+#include "json-schema.hpp"
 
 #include "../llava/clip.h"
 #include "../llava/llava.h"
@@ -41,6 +42,22 @@
 
 #if defined(_WIN32)
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #include <cstddef>
@@ -48,6 +65,8 @@
 #include <chrono>
 #include <condition_variable>
 #include <atomic>
+#include <list>
+#include <deque>
 #include <signal.h>
 
 using json = nlohmann::json;
@@ -63,20 +82,24 @@ struct server_params {
     bool slots_endpoint = true;
     bool metrics_endpoint = false;
     int n_threads_http = -1;
+    std::string unix_socket; // also serve completions on this socket, with binary framing
+    std::string shm_path;    // shared memory rings for the streamed tokens of unix socket requests
+    int shm_eventfd = -1;    // signalled after writing to the rings, inherited from the parent
+    int32_t completion_cache_mb = 0;  // budget of the deterministic completion cache, 0 disables it
+    int32_t embedding_cache_mb = 64;  // budget of the /embedding result cache, 0 disables it
+    int32_t image_cache_mb = 256;     // budget of the CLIP image embedding cache, 0 disables it
+    int32_t image_threads = -1;       // threads of the image encoder, -1 for half of --threads
+    std::string embedding_cache_file; // keep the cache in this file across restarts
 };
 
 bool server_verbose = false;
 bool server_log_json = true;
 
-enum stop_type {
-    STOP_FULL,
-    STOP_PARTIAL,
-};
-
 // TODO: can become bool if we can't find use of more states
 enum slot_state {
     IDLE,
     PROCESSING,
+    ENCODING, // waiting for the image encoder, the prompt is loaded once the images are ready
 };
 
 enum slot_command {
@@ -93,20 +116,71 @@ struct slot_params {
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_predict = -1; // new tokens to predict
 
+    // streamed pieces are coalesced into one frame per stream_min_tokens tokens or once the oldest one
+    // has waited stream_flush_ms, 0 disables the respective limit (both 0: one frame per token)
+    int32_t stream_min_tokens = 0;
+    int32_t stream_flush_ms   = 0;
+
+    // fields of the final response to send, empty for all of them; "stop" is always sent
+    std::set<std::string> response_fields;
+
     std::vector<std::string> antiprompt;
 
+    embedding_format embd_format; // how /embedding sends the vector back
+
+    bool wants_field(const char *name) const
+    {
+        return response_fields.empty() || response_fields.count(name) != 0;
+    }
+
     json input_prefix;
     json input_suffix;
 };
 
+// content hash of an image file, names it in the image cache. SHA-256, so that no image can be crafted to be
+// served another one's embedding
+struct image_hash {
+    sha256::digest_type digest = {};
+
+    bool operator==(const image_hash & other) const {
+        return digest == other.digest;
+    }
+
+    static image_hash of(const uint8_t * data, size_t n) {
+        image_hash hash;
+        hash.digest = sha256::of(data, n);
+        return hash;
+    }
+};
+
+struct image_hash_hasher {
+    size_t operator()(const image_hash & hash) const {
+        size_t h;
+        memcpy(&h, hash.digest.data(), sizeof(h));
+        return h;
+    }
+};
+
+// an image in the cached prompt of a slot, whose cache_tokens hold image_token at each of its positions
+struct slot_cache_image {
+    int32_t pos;
+    int32_t n_tokens;
+    image_hash hash;
+};
+
+// stands for every position of an image in a prompt, never a token of the vocab
+static const llama_token image_token = -1;
+
 struct slot_image {
     int32_t id;
 
+    image_hash hash;
+
     bool request_encode_image = false;
-    float * image_embedding = nullptr;
+    std::shared_ptr<float> image_embedding; // shared with the image cache
     int32_t image_tokens = 0;
 
-    clip_image_u8 * img_data;
+    clip_image_u8 * img_data = nullptr; // only until encoded, images found in the cache are not loaded
 
     std::string prefix_prompt; // before of this image
 };
@@ -135,9 +209,11 @@ struct server_slot {
     int32_t n_prompt_tokens_processed = 0;
 
     json prompt;
+    std::vector<llama_token> prompt_ids; // a token prompt parsed straight from the request, used instead of prompt
     std::string generated_text;
     llama_token sampled;
     std::vector<llama_token> cache_tokens;
+    std::vector<slot_cache_image> cache_images; // the images among cache_tokens, in order
     std::vector<completion_token_output> generated_token_probs;
 
     bool infill = false;
@@ -149,11 +225,26 @@ struct server_slot {
     bool stopped_limit = false;
 
     std::string stopping_word;
+    stop_string_matcher stop_matcher;
+    stop_token_matcher  stop_tokens;
+
+    // sampled tokens that may be the start of a token stop sequence, not yet passed to process_token
+    std::vector<completion_token_output> stop_tokens_held;
 
     // sampling
     struct llama_sampling_params sparams;
     llama_sampling_context *ctx_sampling = nullptr;
 
+    // tokens in the repetition penalty window (prompt or penalty_prompt, then the generated tokens)
+    token_window_counts penalty_counts;
+
+    // JSON schema constraint, json_schema_state is the automaton state after the generated text
+    std::shared_ptr<const json_schema_automaton> json_schema;
+    int32_t json_schema_state = 0;
+
+    // sampled token followed by the tokens forced by the schema, evaluated together in the next batch (jump-forward)
+    std::vector<llama_token> pending_tokens;
+
     int32_t ga_i = 0;   // group-attention state
     int32_t ga_n = 1;   // group-attention factor
     int32_t ga_w = 512; // group-attention width
@@ -162,6 +253,12 @@ struct server_slot {
 
     // multimodal
     std::vector<slot_image> images;
+    uint64_t encoding_job = 0; // the image encoder job an ENCODING slot waits for
+
+    // streamed text not sent yet, see slot_params::stream_min_tokens
+    completion_token_output stream_pending;
+    int32_t n_stream_pending = 0;
+    int64_t t_stream_pending = 0;
 
     // stats
     size_t n_sent_text = 0; // number of sent text character
@@ -176,8 +273,24 @@ struct server_slot {
     // multitasks
     int multitask_id = -1;
 
+    // shared memory ring the streamed tokens go to, -1 for none
+    int shm_ring = -1;
+    uint32_t shm_ring_gen = 0;
+
+    // a deterministic request records its results for the completion cache under record_key, and for the
+    // identical requests that follow it, found by request_key
+    bool recording = false;
+    std::string record_key;
+    std::string request_key;
+    std::vector<task_result> recorded;
+
     void reset() {
         n_prompt_tokens        = 0;
+        prompt_ids.clear();
+        recording              = false;
+        record_key.clear();
+        request_key.clear();
+        recorded.clear();
         generated_text         = "";
         truncated              = false;
         stopped_eos            = false;
@@ -190,11 +303,17 @@ struct server_slot {
         infill                 = false;
         ga_i                   = 0;
         n_past_se              = 0;
+        json_schema_state      = 0;
+
+        n_stream_pending       = 0;
+        stream_pending.text_to_send.clear();
 
+        json_schema.reset();
+        pending_tokens.clear();
+        stop_tokens_held.clear();
         generated_token_probs.clear();
 
         for (slot_image & img : images) {
-            free(img.image_embedding);
             if (img.img_data) {
                 clip_image_u8_free(img.img_data);
             }
@@ -225,6 +344,7 @@ struct server_slot {
     }
 
     bool is_processing() const {
+        // an ENCODING slot has not touched the KV cache of its task yet, there is nothing to shift
         return (state == IDLE && command == LOAD_PROMPT) || state == PROCESSING;
     }
 
@@ -242,23 +362,32 @@ struct server_slot {
             t_token_generation = (ggml_time_us() - t_start_genereration) / 1e3;
             command = RELEASE;
         }
+        else if (state == ENCODING)
+        {
+            // the job keeps running, its images still go to the image cache
+            command = RELEASE;
+        }
     }
 
-    json get_formated_timings() {
+    static json timings_json(int32_t n_prompt, double t_prompt, int32_t n_predicted, double t_predicted) {
         return json
         {
-            {"prompt_n",               n_prompt_tokens_processed},
-            {"prompt_ms",              t_prompt_processing},
-            {"prompt_per_token_ms",    t_prompt_processing / n_prompt_tokens_processed},
-            {"prompt_per_second",      1e3 / t_prompt_processing * n_prompt_tokens_processed},
-
-            {"predicted_n",            n_decoded},
-            {"predicted_ms",           t_token_generation},
-            {"predicted_per_token_ms", t_token_generation / n_decoded},
-            {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+            {"prompt_n",               n_prompt},
+            {"prompt_ms",              t_prompt},
+            {"prompt_per_token_ms",    t_prompt / n_prompt},
+            {"prompt_per_second",      1e3 / t_prompt * n_prompt},
+
+            {"predicted_n",            n_predicted},
+            {"predicted_ms",           t_predicted},
+            {"predicted_per_token_ms", t_predicted / n_predicted},
+            {"predicted_per_second",   1e3 / t_predicted * n_predicted},
         };
     }
 
+    json get_formated_timings() {
+        return timings_json(n_prompt_tokens_processed, t_prompt_processing, n_decoded, t_token_generation);
+    }
+
     void print_timings() const {
        char buffer[512];
         double t_token = t_prompt_processing / n_prompt_tokens_processed;
@@ -300,6 +429,345 @@ struct server_slot {
     }
 };
 
+// compiled grammars shared by all slots, least recently used evicted first
+// slots get their own copy of the initial grammar state, so cached entries are never advanced
+struct grammar_cache {
+    struct entry {
+        size_t hash;
+        std::string text;
+        grammar_parser::parse_state parsed;
+        llama_grammar * grammar = nullptr;
+    };
+
+    size_t n_max = 32;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<size_t, std::list<entry>::iterator> index;
+
+    ~grammar_cache() {
+        for (entry & e : entries) {
+            llama_grammar_free(e.grammar);
+        }
+    }
+
+    const entry * find(const std::string & text) {
+        const auto it = index.find(std::hash<std::string>()(text));
+        if (it == index.end() || it->second->text != text) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front();
+    }
+
+    // parse and compile the grammar, returns nullptr if it does not parse
+    const entry * add(const std::string & text) {
+        grammar_parser::parse_state parsed = grammar_parser::parse(text.c_str());
+        if (parsed.rules.empty() || parsed.symbol_ids.find("root") == parsed.symbol_ids.end()) {
+            return nullptr;
+        }
+
+        const size_t hash = std::hash<std::string>()(text);
+        const auto collision = index.find(hash);
+        if (collision != index.end()) {
+            llama_grammar_free(collision->second->grammar);
+            entries.erase(collision->second);
+            index.erase(collision);
+        }
+
+        while (!entries.empty() && entries.size() >= n_max) {
+            llama_grammar_free(entries.back().grammar);
+            index.erase(entries.back().hash);
+            entries.pop_back();
+        }
+
+        std::vector<const llama_grammar_element *> grammar_rules(parsed.c_rules());
+        entries.emplace_front();
+        entry & e = entries.front();
+        e.hash    = hash;
+        e.text    = text;
+        e.grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed.symbol_ids.at("root"));
+        e.parsed  = std::move(parsed);
+        index[hash] = entries.begin();
+        return &e;
+    }
+};
+
+// Results of deterministic completions, keyed by the settings and prompt tokens of the request, replayed to
+// identical requests one result at a time, least recently used out first. Only the loop thread uses it.
+struct completion_cache {
+    struct entry {
+        std::string key;
+        std::vector<task_result> results; // the streamed pieces, then the final response
+        size_t size;
+    };
+
+    size_t n_bytes_max = 0; // 0 disables the cache
+    size_t n_bytes     = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+
+    static size_t result_size(const task_result & res) {
+        size_t size = sizeof(task_result) + res.text.size();
+        for (const completion_token_output & p : res.probs) {
+            size += sizeof(completion_token_output) + p.text_to_send.size() + p.probs.size() * sizeof(completion_token_output::token_prob);
+        }
+        if (!res.result_json.is_null()) {
+            size += res.result_json.dump().size();
+        }
+        return size;
+    }
+
+    const std::vector<task_result> * find(const std::string & key) {
+        const auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front().results;
+    }
+
+    void add(std::string key, std::vector<task_result> results) {
+        if (n_bytes_max == 0) {
+            return;
+        }
+
+        size_t size = key.size();
+        for (const task_result & res : results) {
+            size += result_size(res);
+        }
+        if (size > n_bytes_max) {
+            return;
+        }
+
+        const auto existing = index.find(key);
+        if (existing != index.end()) {
+            n_bytes -= existing->second->size;
+            entries.erase(existing->second);
+            index.erase(existing);
+        }
+
+        while (!entries.empty() && n_bytes + size > n_bytes_max) {
+            n_bytes -= entries.back().size;
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+
+        entries.emplace_front();
+        entry & e  = entries.front();
+        e.key      = std::move(key);
+        e.results  = std::move(results);
+        e.size     = size;
+        n_bytes   += size;
+        index[e.key] = entries.begin();
+    }
+};
+
+// CLIP embeddings of recent images shared by all slots, least recently used evicted first past the byte budget
+struct image_cache {
+    struct entry {
+        image_hash hash;
+        std::shared_ptr<float> embedding; // image_tokens rows of the model's n_embd
+        int32_t image_tokens;
+        size_t size;
+    };
+
+    size_t n_bytes_max = 0; // 0 disables the cache
+    size_t n_bytes     = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<image_hash, std::list<entry>::iterator, image_hash_hasher> index;
+
+    const entry * find(const image_hash & hash) {
+        const auto it = index.find(hash);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front();
+    }
+
+    void add(const image_hash & hash, std::shared_ptr<float> embedding, int32_t image_tokens, size_t size) {
+        if (n_bytes_max == 0 || size > n_bytes_max) {
+            return;
+        }
+
+        const auto existing = index.find(hash);
+        if (existing != index.end()) {
+            n_bytes -= existing->second->size;
+            entries.erase(existing->second);
+            index.erase(existing);
+        }
+
+        while (!entries.empty() && n_bytes + size > n_bytes_max) {
+            n_bytes -= entries.back().size;
+            index.erase(entries.back().hash);
+            entries.pop_back();
+        }
+
+        entries.emplace_front();
+        entry & e      = entries.front();
+        e.hash         = hash;
+        e.embedding    = std::move(embedding);
+        e.image_tokens = image_tokens;
+        e.size         = size;
+        n_bytes       += size;
+        index[hash]    = entries.begin();
+    }
+};
+
+// Encodes images with CLIP on its own thread and thread budget, so token generation goes on meanwhile.
+// A clip_ctx runs one graph at a time, jobs are taken in order. A job owns the images it encodes, the slot
+// that submitted it may be released and reused before it is done.
+struct image_encoder {
+    struct job {
+        uint64_t id;
+        int slot_id;
+        std::vector<size_t>          index;  // of the images in the slot
+        std::vector<image_hash>      hashes;
+        std::vector<clip_image_u8 *> images; // freed once encoded
+        std::vector<std::shared_ptr<float>> embeddings;
+        std::vector<int32_t>         image_tokens;
+        bool ok = true;
+    };
+
+    clip_ctx * clp_ctx = nullptr;
+    int32_t n_threads  = 1;
+    uint64_t n_jobs    = 0;
+    std::function<void(void)> on_done; // called from the encoder thread after every job
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<job> pending;
+    std::vector<job> done;
+    bool running = false;
+    std::thread worker;
+
+    ~image_encoder() {
+        stop();
+    }
+
+    bool started() const {
+        return worker.joinable();
+    }
+
+    void start(clip_ctx * ctx, int32_t threads, std::function<void(void)> callback) {
+        clp_ctx   = ctx;
+        n_threads = std::max(threads, 1);
+        on_done   = std::move(callback);
+        running   = true;
+        worker    = std::thread(&image_encoder::run, this);
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        for (job & j : pending) {
+            for (clip_image_u8 * img : j.images) {
+                clip_image_u8_free(img);
+            }
+        }
+        pending.clear();
+    }
+
+    // returns the id of the job
+    uint64_t submit(job && j) {
+        std::unique_lock<std::mutex> lock(mutex);
+        j.id = ++n_jobs;
+        pending.push_back(std::move(j));
+        condition.notify_one();
+        return n_jobs;
+    }
+
+    std::vector<job> take_done() {
+        std::vector<job> jobs;
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.swap(done);
+        return jobs;
+    }
+
+    void run() {
+        while (true) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]{ return !pending.empty() || !running; });
+                if (!running) {
+                    return;
+                }
+                j = std::move(pending.front());
+                pending.pop_front();
+            }
+
+            j.embeddings.resize(j.images.size());
+            j.image_tokens.resize(j.images.size(), 0);
+            for (size_t i = 0; i < j.images.size(); ++i) {
+                float * embedding = nullptr;
+                if (j.ok && llava_image_embed_make_with_clip_img(clp_ctx, n_threads, j.images[i], &embedding, &j.image_tokens[i])) {
+                    j.embeddings[i] = std::shared_ptr<float>(embedding, free);
+                } else {
+                    j.ok = false;
+                }
+                clip_image_u8_free(j.images[i]);
+            }
+            j.images.clear();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.push_back(std::move(j));
+            }
+            on_done();
+        }
+    }
+};
+
+// compiled JSON schemas shared by all slots, least recently used evicted first
+// the automata are immutable, the per-slot state is only an index into them
+// shared by the HTTP threads compiling schemas and the server loop
+// an automaton counts for what it grows to with all its masks built, so the bound holds as generation builds them
+struct json_schema_cache {
+    size_t max_bytes = size_t(256) << 20;
+    size_t n_bytes   = 0;
+
+    std::list<std::pair<std::string, std::shared_ptr<const json_schema_automaton>>> entries; // most recently used first
+    std::mutex mutex;
+
+    std::shared_ptr<const json_schema_automaton> find(const std::string & text) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first == text) {
+                entries.splice(entries.begin(), entries, it);
+                return entries.front().second;
+            }
+        }
+        return nullptr;
+    }
+
+    void add(const std::string & text, std::shared_ptr<const json_schema_automaton> automaton) {
+        const size_t size = entry_bytes(text, *automaton);
+        if (size > max_bytes) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!entries.empty() && n_bytes + size > max_bytes) {
+            n_bytes -= entry_bytes(entries.back().first, *entries.back().second);
+            entries.pop_back();
+        }
+        n_bytes += size;
+        entries.emplace_front(text, std::move(automaton));
+    }
+
+    static size_t entry_bytes(const std::string & text, const json_schema_automaton & automaton) {
+        return text.size() + automaton.size_bytes();
+    }
+};
+
 struct server_metrics {
     uint64_t n_prompt_tokens_processed_total = 0;
     uint64_t n_tokens_predicted_total        = 0;
@@ -310,6 +778,26 @@ struct server_metrics {
     uint64_t n_tokens_predicted       = 0;
     uint64_t t_tokens_generation      = 0;
 
+    uint64_t n_grammar_cache_hits   = 0;
+    uint64_t n_grammar_cache_misses = 0;
+    double   t_grammar_parse        = 0; // ms
+
+    uint64_t n_completion_cache_hits   = 0;
+    uint64_t n_completion_cache_misses = 0;
+
+    uint64_t n_image_cache_hits   = 0;
+    uint64_t n_image_cache_misses = 0;
+
+    uint64_t n_deduplicated = 0; // requests that followed an identical running one
+
+    void on_grammar_cache_hit() {
+        n_grammar_cache_hits++;
+    }
+
+    void on_grammar_parse(double t_parse) {
+        n_grammar_cache_misses++;
+        t_grammar_parse += t_parse;
+    }
 
     void on_prompt_eval(const server_slot &slot) {
         n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
@@ -317,6 +805,12 @@ struct server_metrics {
         t_prompt_processing             += slot.t_prompt_processing;
     }
 
+    void on_embedding_batch(int32_t n_tokens, double t_ms) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_ms;
+    }
+
     void on_prediction(const server_slot &slot) {
         n_tokens_predicted_total += slot.n_decoded;
         n_tokens_predicted       += slot.n_decoded;
@@ -331,113 +825,596 @@ struct server_metrics {
     }
 };
 
-struct llama_server_context
+// An /embedding request served by embed_batch(): its inputs are packed together with those of other requests
+// into shared llama_decode calls, one sequence per input, without taking a slot.
+struct embedding_job
 {
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
+    int  task_id = -1;
+    bool multi   = false; // the content was an array of inputs, answer with "results"
 
-    clip_ctx *clp_ctx = nullptr;
+    embedding_format format;
+    std::string      key;    // the format and every input's tokens, identical requests follow this one
 
-    gpt_params params;
+    std::vector<std::vector<llama_token>> inputs;    // the ones to decode, cache hits are left out
+    std::vector<size_t>                   positions; // where inputs[i] goes in embeddings
+    std::vector<std::vector<float>>       embeddings;
 
-    llama_batch batch;
+    size_t n_next = 0;    // inputs before this one are done
+    bool   failed = false;
+};
 
-    bool multimodal         = false;
-    bool clean_kv_cache     = true;
-    bool all_slots_are_idle = false;
-    bool add_bos_token      = true;
+// Embeddings of recent /embedding inputs, keyed by the SHA-256 of the model and the tokens so that no input can
+// be crafted to get another one's embedding, least recently used out first. They live in fixed size records, in
+// memory or in a file mapped with --embedding-cache-file so they survive restarts: a 64 byte header {u32 magic,
+// u32 version, u32 n_embd, u32 unused, u64 model, u64 n_records, u64 clock}, then n_records records
+// {u8 key[32], u64 stamp, f32 embd[n_embd]}, stamp 0 when free.
+// The file is started over when the header doesn't match. Shared by the HTTP threads and the loop thread.
+struct embedding_cache
+{
+    static const uint32_t MAGIC       = 0x43454c4f; // "OLEC"
+    static const uint32_t VERSION     = 2;
+    static const size_t   HEADER_SIZE = 64;
+    static const size_t   STAMP       = 32; // offsets in a record
+    static const size_t   EMBD        = 40;
 
-    int32_t n_ctx;  // total context for all clients / slots
+    typedef sha256::digest_type key_type;
 
-    // system prompt
-    bool system_need_update = false;
+    struct key_hash
+    {
+        size_t operator()(const key_type &key) const
+        {
+            size_t h;
+            memcpy(&h, key.data(), sizeof(h));
+            return h;
+        }
+    };
 
-    std::string              system_prompt;
-    std::vector<llama_token> system_tokens;
+    std::mutex mutex;
 
-    std::string name_user;      // this should be the antiprompt
-    std::string name_assistant;
+    uint64_t model       = 0;
+    int      n_embd      = 0;
+    size_t   record_size = 0;
+    size_t   n_max       = 0; // records in the budget, 0 when disabled
+    size_t   n_used      = 0; // records handed out, the in memory buffer grows with it
+    uint64_t clock       = 0;
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+    char  *mapped      = nullptr;
+    size_t mapped_size = 0;
+    std::vector<char> memory;
 
-    llama_server_queue    queue_tasks;
-    llama_server_response queue_results;
+    std::vector<uint32_t> free_records;
+    std::list<uint32_t>   lru; // most recently used first
+    std::unordered_map<key_type, std::list<uint32_t>::iterator, key_hash> index;
 
-    server_metrics metrics;
+    std::atomic<uint64_t> n_hits{0};
+    std::atomic<uint64_t> n_misses{0};
 
-    ~llama_server_context()
+    ~embedding_cache()
     {
-        if (clp_ctx)
-        {
-            LOG_INFO("freeing clip model", {});
-            clip_free(clp_ctx);
-            clp_ctx = nullptr;
-        }
-        if (ctx)
+#if !defined(_WIN32)
+        if (mapped != nullptr)
         {
-            llama_free(ctx);
-            ctx = nullptr;
+            munmap(mapped, mapped_size);
         }
-        if (model)
+#endif
+    }
+
+    static uint64_t hash_bytes(const void *data, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+    {
+        const uint8_t *p = (const uint8_t *) data;
+        for (size_t i = 0; i < n; i++)
         {
-            llama_free_model(model);
-            model = nullptr;
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
         }
+        return h;
     }
 
-    bool load_model(const gpt_params &params_)
+    key_type key_of(const std::vector<llama_token> &tokens) const
     {
-        params = params_;
-        if (!params.mmproj.empty()) {
-            multimodal = true;
-            LOG_INFO("Multi Modal Mode Enabled", {});
-            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
-            if(clp_ctx == nullptr) {
-                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
-                return false;
-            }
+        return sha256().update(&model, sizeof(model)).update(tokens.data(), tokens.size() * sizeof(llama_token)).digest();
+    }
 
-            if (params.n_ctx < 2048) { // request larger context for the image embedding
-                params.n_ctx = 2048;
-            }
-        }
+    bool enabled() const
+    {
+        return n_max > 0;
+    }
 
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
-        if (model == nullptr)
+    char *record(uint32_t i)
+    {
+        return (mapped != nullptr ? mapped + HEADER_SIZE : memory.data()) + (size_t) i * record_size;
+    }
+
+    bool init(size_t n_bytes, int embd_size, uint64_t model_id, const std::string &path)
+    {
+        n_embd      = embd_size;
+        model       = model_id;
+        record_size = (EMBD + n_embd * sizeof(float) + 7) & ~(size_t) 7;
+        n_max       = std::min(n_bytes / record_size, (size_t) UINT32_MAX);
+        if (n_max == 0 || path.empty())
         {
-            LOG_ERROR("unable to load model", {{"model", params.model}});
-            return false;
+            return true;
         }
 
-        if (multimodal) {
-            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
-            const int n_embd_llm  = llama_n_embd(model);
-            if (n_embd_clip != n_embd_llm) {
-                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
-                llama_free(ctx);
-                llama_free_model(model);
-                return false;
+#if !defined(_WIN32)
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            LOG_ERROR("couldn't open embedding cache file", {{"path", path}, {"errno", errno}});
+            if (fd >= 0)
+            {
+                close(fd);
             }
+            n_max = 0;
+            return false;
         }
 
-        n_ctx = llama_n_ctx(ctx);
-
-        add_bos_token = llama_should_add_bos_token(model);
+        mapped_size = HEADER_SIZE + n_max * record_size;
 
-        return true;
-    }
+        uint32_t header[4] = {};
+        uint64_t header_model = 0, header_records = 0;
+        const bool valid = (size_t) st.st_size == mapped_size &&
+                           pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+                           pread(fd, &header_model, sizeof(uint64_t), 16) == sizeof(uint64_t) &&
+                           pread(fd, &header_records, sizeof(uint64_t), 24) == sizeof(uint64_t) &&
+                           header[0] == MAGIC && header[1] == VERSION && header[2] == (uint32_t) n_embd &&
+                           header_model == model && header_records == n_max;
 
-    void validate_model_chat_template(server_params & sparams) {
-        llama_chat_message chat[] = {{"user", "test"}};
-        std::vector<char> buf(1);
-        int res = llama_chat_apply_template(model, nullptr, chat, 1, true, buf.data(), buf.size());
-        if (res < 0) {
-            LOG_ERROR("The chat template comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses", {});
-            sparams.chat_template = "chatml";
+        if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, mapped_size) != 0))
+        {
+            LOG_ERROR("couldn't size embedding cache file", {{"path", path}, {"errno", errno}});
+            close(fd);
+            n_max = 0;
+            return false;
         }
-    }
+
+        void *addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            LOG_ERROR("couldn't map embedding cache file", {{"path", path}, {"errno", errno}});
+            n_max = 0;
+            return false;
+        }
+        mapped = (char *) addr;
+        n_used = n_max;
+
+        if (!valid)
+        {
+            const uint32_t magic[4] = { MAGIC, VERSION, (uint32_t) n_embd, 0 };
+            const uint64_t records  = n_max;
+            memcpy(mapped, magic, sizeof(magic));
+            memcpy(mapped + 16, &model, sizeof(model));
+            memcpy(mapped + 24, &records, sizeof(records));
+        }
+        memcpy(&clock, mapped + 32, sizeof(clock));
+
+        // rebuild the index, oldest first so that the most recent end up in front
+        std::vector<std::pair<uint64_t, uint32_t>> stamps;
+        for (uint32_t i = n_max; i-- > 0;)
+        {
+            uint64_t stamp;
+            memcpy(&stamp, record(i) + STAMP, sizeof(stamp));
+            if (stamp == 0)
+            {
+                free_records.push_back(i);
+            }
+            else
+            {
+                stamps.emplace_back(stamp, i);
+            }
+        }
+        std::sort(stamps.begin(), stamps.end());
+        for (const auto &stamp : stamps)
+        {
+            key_type key;
+            memcpy(key.data(), record(stamp.second), key.size());
+            lru.push_front(stamp.second);
+            index[key] = lru.begin();
+        }
+
+        LOG_INFO("embedding cache file", {{"path", path}, {"n_records", n_max}, {"n_cached", index.size()}});
+        return true;
+#else
+        LOG_WARNING("embedding cache files are not supported on Windows, keeping it in memory", {{"path", path}});
+        return true;
+#endif
+    }
+
+    void touch(uint32_t i)
+    {
+        const uint64_t stamp = ++clock;
+        memcpy(record(i) + STAMP, &stamp, sizeof(stamp));
+        if (mapped != nullptr)
+        {
+            memcpy(mapped + 32, &clock, sizeof(clock));
+        }
+    }
+
+    // lookups don't count towards the hit rate, record() does once it's clear how a request was answered
+    bool find(const std::vector<llama_token> &tokens, std::vector<float> &embd)
+    {
+        if (!enabled())
+        {
+            return false;
+        }
+
+        const key_type key = key_of(tokens);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto it = index.find(key);
+        if (it == index.end())
+        {
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        touch(*it->second);
+
+        embd.resize(n_embd);
+        memcpy(embd.data(), record(*it->second) + EMBD, n_embd * sizeof(float));
+        return true;
+    }
+
+    void add(const std::vector<llama_token> &tokens, const std::vector<float> &embd)
+    {
+        if (!enabled() || embd.size() != (size_t) n_embd)
+        {
+            return;
+        }
+
+        const key_type key = key_of(tokens);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (index.count(key) != 0)
+        {
+            return;
+        }
+
+        uint32_t i;
+        if (!free_records.empty())
+        {
+            i = free_records.back();
+            free_records.pop_back();
+        }
+        else if (n_used < n_max)
+        {
+            i = n_used++;
+            const size_t size = n_used * record_size;
+            if (memory.capacity() < size)
+            {
+                memory.reserve(std::min(n_max * record_size, std::max(size, 2 * memory.capacity())));
+            }
+            memory.resize(size);
+        }
+        else
+        {
+            i = lru.back();
+            lru.pop_back();
+
+            key_type old;
+            memcpy(old.data(), record(i), old.size());
+            index.erase(old);
+        }
+
+        // a record being rewritten is free until its stamp is set again
+        char *r = record(i);
+        memset(r + STAMP, 0, sizeof(uint64_t));
+        memcpy(r,        key.data(),  key.size());
+        memcpy(r + EMBD, embd.data(), n_embd * sizeof(float));
+        touch(i);
+
+        lru.push_front(i);
+        index[key] = lru.begin();
+    }
+
+    void record_lookups(uint64_t hits, uint64_t misses)
+    {
+        n_hits   += hits;
+        n_misses += misses;
+    }
+};
+
+// Shared memory delivery of streamed tokens (--shm, Linux only).
+// The file holds a 64 byte header {u32 magic, u32 version, u32 n_rings, u32 ring_size}, then n_rings rings of
+// a 64 byte line with the u64 write counter, a 64 byte line with the u64 read counter and ring_size bytes of data.
+// The loop thread is the only producer of a ring and the reader of a Unix socket connection its only consumer.
+// Records are u32 size, i32 token, text (size counts the token and the text), wrapping around the data.
+// The counters only grow; the producer publishes with a release store and the eventfd given by the parent is
+// signalled once per update_slots pass in which anything was written.
+struct shm_token_rings
+{
+    static const uint32_t MAGIC       = 0x52534c4f; // "OLSR"
+    static const uint32_t VERSION     = 1;
+    static const size_t   HEADER_SIZE = 64;
+    static const size_t   CONTROL_SIZE = 128;
+
+    char *base      = nullptr;
+    size_t size     = 0;
+    uint32_t n_rings   = 0;
+    uint32_t ring_size = 0;
+    int event_fd    = -1;
+    bool dirty      = false; // loop thread only
+
+    // rings are handed out to connections and bumped to a new generation when they change hands,
+    // writes for an older generation (a cancelled task still running) are dropped
+    std::mutex mutex;
+    std::vector<bool>     in_use;
+    std::vector<uint32_t> gen;
+
+    bool enabled() const
+    {
+        return base != nullptr;
+    }
+
+    bool init(const std::string &path, uint32_t n, uint32_t ring_bytes, int efd)
+    {
+#if defined(__linux__)
+        n_rings   = n;
+        ring_size = ring_bytes;
+        size      = HEADER_SIZE + (size_t) n_rings * (CONTROL_SIZE + ring_size);
+
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0 || ftruncate(fd, size) != 0)
+        {
+            LOG_ERROR("couldn't create shared memory file", {{"path", path}, {"errno", errno}});
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return false;
+        }
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            LOG_ERROR("couldn't map shared memory file", {{"path", path}, {"errno", errno}});
+            return false;
+        }
+
+        base     = (char *) addr;
+        event_fd = efd;
+        in_use.assign(n_rings, false);
+        gen.assign(n_rings, 0);
+
+        const uint32_t header[4] = { MAGIC, VERSION, n_rings, ring_size };
+        memcpy(base, header, sizeof(header));
+        return true;
+#else
+        (void) path; (void) n; (void) ring_bytes; (void) efd;
+        LOG_ERROR("shared memory rings are only supported on Linux", {});
+        return false;
+#endif
+    }
+
+    std::atomic<uint64_t> *write_counter(int i) const
+    {
+        return reinterpret_cast<std::atomic<uint64_t> *>(base + HEADER_SIZE + (size_t) i * (CONTROL_SIZE + ring_size));
+    }
+
+    std::atomic<uint64_t> *read_counter(int i) const
+    {
+        return reinterpret_cast<std::atomic<uint64_t> *>(base + HEADER_SIZE + (size_t) i * (CONTROL_SIZE + ring_size) + 64);
+    }
+
+    char *data(int i) const
+    {
+        return base + HEADER_SIZE + (size_t) i * (CONTROL_SIZE + ring_size) + CONTROL_SIZE;
+    }
+
+    // returns the ring index or -1 when all are taken
+    int acquire(uint32_t &ring_gen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < n_rings; ++i)
+        {
+            if (!in_use[i])
+            {
+                in_use[i] = true;
+                ring_gen  = ++gen[i];
+                write_counter(i)->store(0, std::memory_order_relaxed);
+                read_counter(i)->store(0, std::memory_order_release);
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void release(int i)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        in_use[i] = false;
+        ++gen[i];
+    }
+
+    void copy_in(int i, uint64_t pos, const void *src, size_t n)
+    {
+        const size_t off   = pos & (ring_size - 1);
+        const size_t first = std::min(n, (size_t) ring_size - off);
+        memcpy(data(i) + off, src, first);
+        memcpy(data(i), (const char *) src + first, n - first);
+    }
+
+    // false when the ring has no room for the record, the caller then sends it the regular way
+    bool write(int i, uint32_t ring_gen, llama_token tok, const std::string &text)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (gen[i] != ring_gen)
+        {
+            return true; // the reader is gone
+        }
+
+        const uint64_t tail = write_counter(i)->load(std::memory_order_relaxed);
+        const uint64_t head = read_counter(i)->load(std::memory_order_acquire);
+        const size_t   need = 8 + text.size();
+        if (need > ring_size - (tail - head))
+        {
+            return false;
+        }
+
+        // records are read on the same host, so native byte order is little endian on every platform we run on
+        const uint32_t n = (uint32_t) (4 + text.size());
+        const int32_t  t = tok;
+        copy_in(i, tail,     &n, 4);
+        copy_in(i, tail + 4, &t, 4);
+        copy_in(i, tail + 8, text.data(), text.size());
+        write_counter(i)->store(tail + need, std::memory_order_release);
+        dirty = true;
+        return true;
+    }
+
+    void notify()
+    {
+#if defined(__linux__)
+        if (!dirty)
+        {
+            return;
+        }
+        dirty = false;
+        const uint64_t one = 1;
+        if (::write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            LOG_ERROR("couldn't signal shared memory eventfd", {{"errno", errno}});
+        }
+#endif
+    }
+};
+
+struct llama_server_context
+{
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+
+    clip_ctx *clp_ctx = nullptr;
+
+    gpt_params params;
+
+    llama_batch batch;
+
+    bool multimodal         = false;
+    bool clean_kv_cache     = true;
+    bool all_slots_are_idle = false;
+    bool add_bos_token      = true;
+
+    int32_t n_ctx;  // total context for all clients / slots
+
+    // system prompt
+    bool system_need_update = false;
+
+    std::string              system_prompt;
+    std::vector<llama_token> system_tokens;
+
+    // system_prompt.empty() && add_bos_token, kept by the loop thread for the HTTP threads tokenizing embedding inputs
+    std::atomic<bool> add_bos_prompt{true};
+
+    std::string name_user;      // this should be the antiprompt
+    std::string name_assistant;
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    llama_server_queue    queue_tasks;
+    llama_server_response queue_results;
+
+    server_metrics metrics;
+
+    grammar_cache grammars;
+
+    completion_cache completions;
+    // deferred tasks identical requests follow, by request_key, and the followers that took the place of the
+    // cancelled ones, {task id, multitask id} by the id of the deferred task
+    std::unordered_map<std::string, int> deferred_leaders;
+    std::unordered_map<int, std::pair<int, int>> deferred_promotions;
+    image_cache image_embeddings;
+    image_encoder encoder;
+
+    // vocab pieces sorted for the JSON schema token masks, filled on the first request with a schema
+    std::once_flag           vocab_pieces_once;
+    std::vector<std::string> vocab_pieces;
+    std::vector<llama_token> vocab_sorted;
+    std::vector<int32_t>     vocab_lcp;
+
+    json_schema_cache json_schemas;
+
+    shm_token_rings shm_rings;
+
+    std::deque<embedding_job> embedding_jobs;
+    embedding_cache           embd_cache;
+
+    ~llama_server_context()
+    {
+        encoder.stop();
+        if (clp_ctx)
+        {
+            LOG_INFO("freeing clip model", {});
+            clip_free(clp_ctx);
+            clp_ctx = nullptr;
+        }
+        if (ctx)
+        {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+        if (model)
+        {
+            llama_free_model(model);
+            model = nullptr;
+        }
+    }
+
+    bool load_model(const gpt_params &params_)
+    {
+        params = params_;
+        if (!params.mmproj.empty()) {
+            multimodal = true;
+            LOG_INFO("Multi Modal Mode Enabled", {});
+            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
+            if(clp_ctx == nullptr) {
+                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
+                return false;
+            }
+
+            if (params.n_ctx < 2048) { // request larger context for the image embedding
+                params.n_ctx = 2048;
+            }
+        }
+
+        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        if (model == nullptr)
+        {
+            LOG_ERROR("unable to load model", {{"model", params.model}});
+            return false;
+        }
+
+        if (multimodal) {
+            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
+            const int n_embd_llm  = llama_n_embd(model);
+            if (n_embd_clip != n_embd_llm) {
+                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
+                llama_free(ctx);
+                llama_free_model(model);
+                return false;
+            }
+        }
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_should_add_bos_token(model);
+        add_bos_prompt = system_prompt.empty() && add_bos_token;
+
+        return true;
+    }
+
+    void validate_model_chat_template(server_params & sparams) {
+        llama_chat_message chat[] = {{"user", "test"}};
+        std::vector<char> buf(1);
+        int res = llama_chat_apply_template(model, nullptr, chat, 1, true, buf.data(), buf.size());
+        if (res < 0) {
+            LOG_ERROR("The chat template comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses", {});
+            sparams.chat_template = "chatml";
+        }
+    }
 
     void initialize() {
         // create slots
@@ -561,13 +1538,22 @@ struct llama_server_context
         return last_used;
     }
 
-    bool launch_slot_with_data(server_slot* &slot, json data) {
+    // the prompt as the request sent it
+    static json slot_prompt_json(const server_slot &slot)
+    {
+        return slot.prompt_ids.empty() ? slot.prompt : json(slot.prompt_ids);
+    }
+
+    // error is set when the request itself is at fault and the client should be told why
+    bool launch_slot_with_data(server_slot* &slot, const json &data, const server_request *request, std::string &error) {
         slot_params default_params;
         llama_sampling_params default_sparams;
 
         slot->params.stream             = json_value(data, "stream",            false);
         slot->params.cache_prompt       = json_value(data, "cache_prompt",      false);
         slot->params.n_predict          = json_value(data, "n_predict",         default_params.n_predict);
+        slot->params.stream_min_tokens  = json_value(data, "stream_min_tokens", default_params.stream_min_tokens);
+        slot->params.stream_flush_ms    = json_value(data, "stream_flush_ms",   default_params.stream_flush_ms);
         slot->sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
         slot->sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
         slot->sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
@@ -587,13 +1573,68 @@ struct llama_server_context
         slot->params.n_keep             = json_value(data, "n_keep",            slot->params.n_keep);
         slot->params.seed               = json_value(data, "seed",              default_params.seed);
         slot->sparams.grammar           = json_value(data, "grammar",           default_sparams.grammar);
-        slot->sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
+        slot->sparams.n_probs           = std::min(json_value(data, "n_probs", default_sparams.n_probs), llama_n_vocab(model));
         slot->sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
 
-        if (slot->n_predict > 0 && slot->params.n_predict > slot->n_predict) {
-            // Might be better to reject the request with a 400 ?
-            LOG_WARNING("Max tokens to predict exceeds server configuration", {
-                {"params.n_predict", slot->params.n_predict},
+        // response_fields: a list of final response fields, or "compact" for all but the echoed prompt and settings
+        slot->params.response_fields.clear();
+        const auto &response_fields = data.find("response_fields");
+        if (response_fields != data.end() && response_fields->is_string() && response_fields->get<std::string>() == "compact")
+        {
+            slot->params.response_fields = {
+                "content", "slot_id", "model", "tokens_predicted", "tokens_evaluated", "truncated",
+                "stopped_eos", "stopped_word", "stopped_limit", "stopping_word", "tokens_cached", "timings",
+                "completion_probabilities",
+            };
+        }
+        else if (response_fields != data.end() && response_fields->is_array())
+        {
+            for (const auto &field : *response_fields)
+            {
+                if (field.is_string())
+                {
+                    slot->params.response_fields.insert(field.get<std::string>());
+                }
+            }
+            slot->params.response_fields.insert("stop");
+        }
+
+        slot->params.embd_format = embedding_format_from_json(data);
+
+        // json_schema replaces the grammar: the schema is compiled into a token-level automaton instead,
+        // key order is only preserved when the schema is sent as a string. The HTTP thread compiled it already,
+        // only tasks made here, without a parsed request, compile it on the loop
+        slot->json_schema.reset();
+        slot->json_schema_state = 0;
+        if (data.count("json_schema") != 0 && !data["json_schema"].is_null())
+        {
+            if (request != nullptr && (request->json_schema != nullptr || !request->json_schema_error.empty()))
+            {
+                slot->json_schema = request->json_schema;
+                error             = request->json_schema_error;
+            }
+            else
+            {
+                const json &schema = data["json_schema"];
+                slot->json_schema = json_schema_get(schema.is_string() ? schema.get<std::string>() : schema.dump(), error);
+            }
+            if (slot->json_schema == nullptr)
+            {
+                LOG_ERROR("failed to compile json schema", {
+                    {"slot_id", slot->id},
+                    {"task_id", slot->task_id},
+                    {"error",   error},
+                });
+                error = "json_schema: " + error;
+                return false;
+            }
+            slot->sparams.grammar.clear();
+        }
+
+        if (slot->n_predict > 0 && slot->params.n_predict > slot->n_predict) {
+            // Might be better to reject the request with a 400 ?
+            LOG_WARNING("Max tokens to predict exceeds server configuration", {
+                {"params.n_predict", slot->params.n_predict},
                 {"slot.n_predict", slot->n_predict},
             });
             slot->params.n_predict = slot->n_predict;
@@ -626,6 +1667,10 @@ struct llama_server_context
         {
             slot->prompt = "";
         }
+        if (request != nullptr && request->has_prompt_tokens)
+        {
+            slot->prompt_ids = request->prompt_tokens;
+        }
 
         slot->sparams.penalty_prompt_tokens.clear();
         slot->sparams.use_penalty_prompt_tokens = false;
@@ -637,16 +1682,11 @@ struct llama_server_context
                 const auto penalty_prompt_string = penalty_prompt->get<std::string>();
                 auto penalty_tokens = llama_tokenize(model, penalty_prompt_string, false);
                 slot->sparams.penalty_prompt_tokens.swap(penalty_tokens);
-                if (slot->params.n_predict > 0)
-                {
-                    slot->sparams.penalty_prompt_tokens.reserve(slot->sparams.penalty_prompt_tokens.size() + slot->params.n_predict);
-                }
                 slot->sparams.use_penalty_prompt_tokens = true;
             }
             else if (penalty_prompt->is_array())
             {
-                const auto n_tokens = penalty_prompt->size();
-                slot->sparams.penalty_prompt_tokens.reserve(n_tokens + std::max(0, slot->params.n_predict));
+                slot->sparams.penalty_prompt_tokens.reserve(penalty_prompt->size());
                 const int n_vocab = llama_n_vocab(model);
                 for (const auto &penalty_token : *penalty_prompt)
                 {
@@ -725,6 +1765,53 @@ struct llama_server_context
                 }
             }
         }
+        slot->stop_matcher.build(slot->params.antiprompt);
+
+        // stops given as token ids, matched without detokenizing
+        {
+            const int n_vocab = llama_n_vocab(model);
+            std::vector<std::vector<llama_token>> stop_sequences;
+
+            const auto &stop_tokens = data.find("stop_tokens");
+            if (stop_tokens != data.end() && stop_tokens->is_array())
+            {
+                for (const auto &tok : *stop_tokens)
+                {
+                    if (tok.is_number_integer() && tok.get<llama_token>() >= 0 && tok.get<llama_token>() < n_vocab)
+                    {
+                        stop_sequences.push_back({tok.get<llama_token>()});
+                    }
+                }
+            }
+
+            const auto &stop_token_sequences = data.find("stop_token_sequences");
+            if (stop_token_sequences != data.end() && stop_token_sequences->is_array())
+            {
+                for (const auto &seq : *stop_token_sequences)
+                {
+                    if (!seq.is_array() || seq.empty())
+                    {
+                        continue;
+                    }
+                    std::vector<llama_token> tokens;
+                    for (const auto &tok : seq)
+                    {
+                        if (!tok.is_number_integer() || tok.get<llama_token>() < 0 || tok.get<llama_token>() >= n_vocab)
+                        {
+                            tokens.clear();
+                            break;
+                        }
+                        tokens.push_back(tok.get<llama_token>());
+                    }
+                    if (!tokens.empty())
+                    {
+                        stop_sequences.push_back(tokens);
+                    }
+                }
+            }
+
+            slot->stop_tokens.build(stop_sequences);
+        }
 
         const auto &samplers_sequence = data.find("samplers");
         if (samplers_sequence != data.end() && samplers_sequence->is_array())
@@ -749,12 +1836,38 @@ struct llama_server_context
             const auto &images_data = data.find("image_data");
             if (images_data != data.end() && images_data->is_array())
             {
-                for (const auto &img : *images_data)
+                for (size_t i = 0; i < images_data->size(); ++i)
                 {
-                    const std::vector<uint8_t> image_buffer = base64_decode(img["data"].get<std::string>());
+                    const json &img = (*images_data)[i];
+
+                    // images of a parsed request were decoded along with it
+                    const bool parsed = request != nullptr && i < request->images_decoded.size() && request->images_decoded[i];
+                    std::vector<uint8_t> decoded;
+                    if (!parsed)
+                    {
+                        decoded = base64_decode(img["data"].get<std::string>());
+                    }
+                    const std::vector<uint8_t> &image_buffer = parsed ? request->images[i] : decoded;
 
                     slot_image img_sl;
-                    img_sl.id = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
+                    img_sl.id   = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
+                    img_sl.hash = image_hash::of(image_buffer.data(), image_buffer.size());
+
+                    // an image encoded before needs neither loading nor encoding
+                    const image_cache::entry *cached = image_embeddings.n_bytes_max > 0 ? image_embeddings.find(img_sl.hash) : nullptr;
+                    if (cached != nullptr)
+                    {
+                        metrics.n_image_cache_hits++;
+                        img_sl.image_embedding = cached->embedding;
+                        img_sl.image_tokens    = cached->image_tokens;
+                        slot->images.push_back(img_sl);
+                        continue;
+                    }
+                    if (image_embeddings.n_bytes_max > 0)
+                    {
+                        metrics.n_image_cache_misses++;
+                    }
+
                     img_sl.img_data = clip_image_u8_init();
                     if (!clip_image_load_from_bytes(image_buffer.data(), image_buffer.size(), img_sl.img_data))
                     {
@@ -762,6 +1875,7 @@ struct llama_server_context
                             {"slot_id",   slot->id},
                             {"img_sl_id", img_sl.id}
                         });
+                        clip_image_u8_free(img_sl.img_data);
                         return false;
                     }
                     LOG_VERBOSE("image loaded", {
@@ -773,7 +1887,7 @@ struct llama_server_context
                 }
                 // process prompt
                 // example: system prompt [img-102] user [img-103] describe [img-134] -> [{id: 102, prefix: 'system prompt '}, {id: 103, prefix: ' user '}, {id: 134, prefix: ' describe '}]}
-                if (slot->images.size() > 0 && !slot->prompt.is_array())
+                if (slot->images.size() > 0 && !slot->prompt.is_array() && slot->prompt_ids.empty())
                 {
                     std::string prompt = slot->prompt.get<std::string>();
                     size_t pos = 0, begin_prefix = 0;
@@ -812,7 +1926,6 @@ struct llama_server_context
                     }
                     slot->prompt = "";
                     slot->params.input_suffix = prompt.substr(begin_prefix);
-                    slot->params.cache_prompt = false; // multimodal doesn't support cache prompt
                 }
             }
         }
@@ -821,7 +1934,28 @@ struct llama_server_context
         {
             llama_sampling_free(slot->ctx_sampling);
         }
-        slot->ctx_sampling = llama_sampling_init(slot->sparams);
+        slot->ctx_sampling = sampling_init(slot->sparams);
+        if (slot->ctx_sampling == nullptr)
+        {
+            LOG_ERROR("failed to parse grammar", {
+                {"slot_id", slot->id},
+                {"task_id", slot->task_id},
+            });
+            return false;
+        }
+
+        // penalties and logit biases are applied to the raw logits by sample_token
+        slot->ctx_sampling->params.penalty_last_n = 0;
+        slot->ctx_sampling->params.logit_bias.clear();
+        slot->penalty_counts.reset(slot->sparams.penalty_last_n < 0 ? slot->n_ctx : slot->sparams.penalty_last_n);
+        if (slot->sparams.use_penalty_prompt_tokens)
+        {
+            for (const llama_token tok : slot->sparams.penalty_prompt_tokens)
+            {
+                slot->penalty_counts.push(tok);
+            }
+        }
+
         llama_set_rng_seed(ctx, slot->params.seed);
         slot->command = LOAD_PROMPT;
 
@@ -835,6 +1969,169 @@ struct llama_server_context
         return true;
     }
 
+    // same as llama_sampling_init, but the grammar is parsed and compiled once per distinct grammar text
+    // and every later request only copies the initial grammar state
+    llama_sampling_context * sampling_init(const llama_sampling_params &sparams)
+    {
+        if (sparams.grammar.empty())
+        {
+            return llama_sampling_init(sparams);
+        }
+
+        const grammar_cache::entry * cached = grammars.find(sparams.grammar);
+        if (cached != nullptr)
+        {
+            metrics.on_grammar_cache_hit();
+        }
+        else
+        {
+            const int64_t t_start = ggml_time_us();
+            cached = grammars.add(sparams.grammar);
+            if (cached == nullptr)
+            {
+                return nullptr;
+            }
+            metrics.on_grammar_parse((ggml_time_us() - t_start) / 1e3);
+        }
+
+        llama_sampling_params sparams_no_grammar = sparams;
+        sparams_no_grammar.grammar.clear();
+
+        llama_sampling_context * result = llama_sampling_init(sparams_no_grammar);
+        result->params.grammar = sparams.grammar;
+        result->parsed_grammar = cached->parsed;
+        result->grammar        = llama_grammar_copy(cached->grammar);
+        return result;
+    }
+
+    // compile the schema, or take it from the cache; returns nullptr and sets error if it is not supported.
+    // Called by the HTTP threads before queuing, see compile_json_schema
+    std::shared_ptr<const json_schema_automaton> json_schema_get(const std::string &text, std::string &error)
+    {
+        std::shared_ptr<const json_schema_automaton> cached = json_schemas.find(text);
+        if (cached != nullptr)
+        {
+            return cached;
+        }
+
+        ordered_json schema = ordered_json::parse(text, nullptr, false);
+        if (schema.is_discarded())
+        {
+            error = "invalid JSON";
+            return nullptr;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        std::call_once(vocab_pieces_once, [this]()
+        {
+            const int32_t n_vocab = llama_n_vocab(model);
+            vocab_pieces.reserve(n_vocab);
+            for (llama_token tok = 0; tok < n_vocab; ++tok)
+            {
+                vocab_pieces.push_back(llama_token_to_piece(ctx, tok));
+            }
+            json_schema_sort_vocab(vocab_pieces, vocab_sorted, vocab_lcp);
+        });
+
+        std::shared_ptr<json_schema_automaton> automaton = std::make_shared<json_schema_automaton>();
+        if (!automaton->compile(schema, vocab_pieces, vocab_sorted, vocab_lcp, llama_token_eos(model)))
+        {
+            error = automaton->error;
+            return nullptr;
+        }
+
+        LOG_INFO("compiled json schema", {
+            {"n_states", automaton->transitions.size()},
+            {"size",     automaton->size_bytes()},
+            {"t_ms",     (ggml_time_us() - t_start) / 1e3},
+        });
+
+        json_schemas.add(text, automaton);
+        return automaton;
+    }
+
+    // when the schema allows a single continuation, emit it without sampling: the forced text is tokenized after
+    // the piece of the sampled token, so the split is the tokenizer's own, and the tokens go through the stop
+    // sequences like sampled ones before being evaluated together with the sampled token in the next batch
+    void jump_forward(server_slot &slot)
+    {
+        if (slot.json_schema == nullptr || slot.ga_n != 1)
+        {
+            return;
+        }
+
+        const std::string text = slot.json_schema->forced(slot.json_schema_state, params.n_batch);
+        if (text.empty())
+        {
+            return;
+        }
+
+        // the tokens spelling exactly the forced text, from a boundary the tokenizer puts between it and the
+        // sampled token; when it merges them there is no such boundary and the sampler goes on
+        const std::vector<llama_token> all = ::llama_tokenize(ctx, vocab_pieces[slot.sampled] + text, false, false);
+        size_t first  = all.size();
+        size_t n_text = 0;
+        while (first > 0 && n_text < text.size())
+        {
+            n_text += vocab_pieces[all[--first]].size();
+        }
+        if (n_text != text.size() || first == 0)
+        {
+            return;
+        }
+        std::string spelled;
+        for (size_t i = first; i < all.size(); ++i)
+        {
+            spelled += vocab_pieces[all[i]];
+        }
+        if (spelled != text)
+        {
+            return;
+        }
+        // the last token could merge with the text that follows, the sampler produces it
+        std::vector<llama_token> tokens(all.begin() + first, all.end() - 1);
+
+        // leave the context shift to the regular path
+        if (tokens.empty() || system_tokens.size() + slot.cache_tokens.size() + slot.stop_tokens_held.size() + tokens.size() >= (size_t) slot.n_ctx)
+        {
+            return;
+        }
+
+        slot.pending_tokens.push_back(slot.sampled);
+        for (const llama_token tok : tokens)
+        {
+            llama_sampling_accept(slot.ctx_sampling, ctx, tok, false);
+            slot.penalty_counts.push(tok);
+            slot.json_schema_state = slot.json_schema->advance(slot.json_schema_state, vocab_pieces[tok]);
+            slot.pending_tokens.push_back(tok);
+            slot.n_decoded += 1;
+
+            // not sampled, so there are no probabilities to report
+            completion_token_output result;
+            result.tok = tok;
+
+            if (!process_sampled_token(result, slot))
+            {
+                // the forced tokens never reach the KV cache, the cache keeps what it holds and the sampled token
+                slot.cache_tokens.resize(std::min(slot.cache_tokens.size(), (size_t) slot.n_past + 1));
+                slot.pending_tokens.clear();
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                return;
+            }
+        }
+
+        LOG_VERBOSE("jump forward", {
+            {"slot_id",  slot.id},
+            {"task_id",  slot.task_id},
+            {"n_tokens", tokens.size()},
+            {"text",     text},
+        });
+    }
+
     void kv_cache_clear() {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
@@ -900,60 +2197,23 @@ struct llama_server_context
         system_prompt  = sys_props.value("prompt", "");
         name_user      = sys_props.value("anti_prompt", "");
         name_assistant = sys_props.value("assistant_name", "");
+        add_bos_prompt = system_prompt.empty() && add_bos_token;
 
 
         system_prompt_notify();
     }
 
-    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                        const stop_type type, server_slot &slot)
-    {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string &word : slot.params.antiprompt)
-        {
-            size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
-            {
-                pos = find_partial_stop_string(word, text);
-            }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
-            {
-                if (type == STOP_FULL)
-                {
-                    slot.stopped_word   = true;
-                    slot.stopping_word  = word;
-                    slot.has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     bool process_token(completion_token_output &result, server_slot &slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = llama_token_to_piece(ctx, result.tok);
         slot.sampled = result.tok;
 
         // search stop word and delete it
+        result.text_pos = slot.generated_text.size();
         slot.generated_text += token_str;
+        slot.stop_matcher.feed(token_str);
         slot.has_next_token = true;
 
-        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
-        {
-            // we can change penalty_prompt_tokens because it is always created from scratch each request
-            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
-        }
-
         // check if there is incomplete UTF-8 character at the end
         bool incomplete = false;
         for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
@@ -986,39 +2246,47 @@ struct llama_server_context
         if (!incomplete)
         {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            const std::string str_test = slot.generated_text.substr(pos);
             bool is_stop_full = false;
-            size_t stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_FULL, slot);
+            size_t stop_pos = slot.stop_matcher.match_pos;
             if (stop_pos != std::string::npos)
             {
                 is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
+                slot.stopped_word   = true;
+                slot.stopping_word  = slot.stop_matcher.words[slot.stop_matcher.match_word];
+                slot.has_next_token = false;
+                slot.generated_text.erase(stop_pos);
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             }
             else
             {
-                is_stop_full = false;
-                stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_PARTIAL, slot);
+                stop_pos = slot.stop_matcher.partial_pos();
+            }
+            if (stop_pos != std::string::npos)
+            {
+                // relative to the text that has not been sent yet
+                stop_pos = stop_pos > pos ? stop_pos - pos : 0;
             }
 
             // check if there is any token to predict
             if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
             {
                 // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                result.text_to_send.assign(slot.generated_text, pos, std::string::npos);
                 slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
             }
 
+            // add the token to slot queue and cache before sending, so its probabilities go out with its text
+            slot.add_token_string(result);
+
             if (slot.params.stream)
             {
-                send_partial_response(slot, result);
+                stream_partial_response(slot, result);
             }
         }
-
-        slot.add_token_string(result);
+        else
+        {
+            slot.add_token_string(result);
+        }
 
         if (incomplete)
         {
@@ -1054,7 +2322,55 @@ struct llama_server_context
         return slot.has_next_token; // continue
     }
 
-    bool process_images(server_slot &slot) const
+    // token stop sequences are matched on the sampled ids before anything is detokenized: a token that may start
+    // a stop sequence is held back until the sequence either completes (the held tokens are dropped) or breaks
+    // (the held tokens go through process_token)
+    bool process_sampled_token(completion_token_output &result, server_slot &slot)
+    {
+        if (slot.stop_tokens.empty())
+        {
+            return process_token(result, slot);
+        }
+
+        const int32_t matched = slot.stop_tokens.feed(result.tok);
+        slot.stop_tokens_held.push_back(result);
+
+        size_t n_hold = matched >= 0 ? slot.stop_tokens.sequences[matched].size() : slot.stop_tokens.n_partial();
+        // the budget and the context size are checked by process_token, so nothing is held back past them
+        if (matched < 0 && (!slot.has_budget(params) ||
+                            system_tokens.size() + slot.cache_tokens.size() + slot.stop_tokens_held.size() >= (size_t) slot.n_ctx))
+        {
+            n_hold = 0;
+        }
+
+        const size_t n_flush = slot.stop_tokens_held.size() - n_hold;
+        for (size_t i = 0; i < n_flush; ++i)
+        {
+            if (!process_token(slot.stop_tokens_held[i], slot))
+            {
+                slot.stop_tokens_held.clear();
+                return false;
+            }
+        }
+        slot.stop_tokens_held.erase(slot.stop_tokens_held.begin(), slot.stop_tokens_held.begin() + n_flush);
+        slot.sampled = result.tok;
+
+        if (matched >= 0)
+        {
+            slot.stop_tokens_held.clear();
+            slot.stopped_word   = true;
+            slot.has_next_token = false;
+            LOG_VERBOSE("stop token sequence found", {
+                {"slot_id",  slot.id},
+                {"sequence", slot.stop_tokens.sequences[matched]},
+            });
+            return false;
+        }
+
+        return true;
+    }
+
+    bool process_images(server_slot &slot)
     {
         for (slot_image &img : slot.images)
         {
@@ -1063,77 +2379,290 @@ struct llama_server_context
                 continue;
             }
 
-            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
+            float *image_embedding = nullptr;
+            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &image_embedding, &img.image_tokens)) {
                 LOG_TEE("Error processing the given image");
                 return false;
             }
+            img.image_embedding = std::shared_ptr<float>(image_embedding, free);
+            image_embeddings.add(img.hash, img.image_embedding, img.image_tokens,
+                                 (size_t) img.image_tokens * clip_n_mmproj_embd(clp_ctx) * sizeof(float));
 
-
+            clip_image_u8_free(img.img_data);
+            img.img_data = nullptr;
             img.request_encode_image = false;
         }
 
         return slot.images.size() > 0;
     }
 
-    void send_error(task_server& task, const std::string &error)
+    void start_image_encoder(int32_t n_threads)
     {
-        LOG_TEE("task %i - error: %s\n", task.id, error.c_str());
-        task_result res;
-        res.id = task.id;
-        res.multitask_id = task.multitask_id;
-        res.stop = false;
-        res.error = true;
-        res.result_json = { { "content", error } };
-        queue_results.send(res);
+        encoder.start(clp_ctx, n_threads, [this]()
+        {
+            // wake up the loop, it may be waiting for tasks
+            task_server task;
+            task.type = TASK_TYPE_NEXT_RESPONSE;
+            task.target_id = -1;
+            queue_tasks.post(task);
+        });
     }
 
-    json get_formated_generation(server_slot &slot)
+    // hand the images the slot still needs encoded to the image encoder, the slot waits as ENCODING
+    bool encode_images(server_slot &slot)
     {
-        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
-        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
-                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
-        std::vector<std::string> samplers_sequence;
-        for (const auto &sampler_type : slot.sparams.samplers_sequence)
+        if (!encoder.started())
         {
-            samplers_sequence.emplace_back(sampler_type_to_name_string(sampler_type));
+            return false;
         }
 
-        return json {
-            {"n_ctx",             slot.n_ctx},
-            {"n_predict",         slot.n_predict},
-            {"model",             params.model_alias},
-            {"seed",              slot.params.seed},
-            {"temperature",       slot.sparams.temp},
-            {"dynatemp_range",    slot.sparams.dynatemp_range},
-            {"dynatemp_exponent", slot.sparams.dynatemp_exponent},
-            {"top_k",             slot.sparams.top_k},
-            {"top_p",             slot.sparams.top_p},
-            {"min_p",             slot.sparams.min_p},
-            {"tfs_z",             slot.sparams.tfs_z},
-            {"typical_p",         slot.sparams.typical_p},
-            {"repeat_last_n",     slot.sparams.penalty_last_n},
-            {"repeat_penalty",    slot.sparams.penalty_repeat},
-            {"presence_penalty",  slot.sparams.penalty_present},
-            {"frequency_penalty", slot.sparams.penalty_freq},
-            {"penalty_prompt_tokens", slot.sparams.penalty_prompt_tokens},
-            {"use_penalty_prompt_tokens", slot.sparams.use_penalty_prompt_tokens},
-            {"mirostat",          slot.sparams.mirostat},
-            {"mirostat_tau",      slot.sparams.mirostat_tau},
-            {"mirostat_eta",      slot.sparams.mirostat_eta},
-            {"penalize_nl",       slot.sparams.penalize_nl},
-            {"stop",              slot.params.antiprompt},
-            {"n_predict",         slot.params.n_predict},
-            {"n_keep",            params.n_keep},
-            {"ignore_eos",        ignore_eos},
-            {"stream",            slot.params.stream},
-            {"logit_bias",        slot.sparams.logit_bias},
-            {"n_probs",           slot.sparams.n_probs},
-            {"min_keep",          slot.sparams.min_keep},
-            {"grammar",           slot.sparams.grammar},
-            {"samplers",          samplers_sequence}
-        };
-    }
-
+        image_encoder::job job;
+        job.slot_id = slot.id;
+        for (size_t i = 0; i < slot.images.size(); ++i)
+        {
+            slot_image &img = slot.images[i];
+            if (img.request_encode_image)
+            {
+                job.index.push_back(i);
+                job.hashes.push_back(img.hash);
+                job.images.push_back(img.img_data);
+                img.img_data = nullptr;
+            }
+        }
+        if (job.images.empty())
+        {
+            return false;
+        }
+
+        LOG_VERBOSE("slot is encoding images", {
+            {"slot_id",  slot.id},
+            {"task_id",  slot.task_id},
+            {"n_images", job.images.size()}
+        });
+        slot.encoding_job = encoder.submit(std::move(job));
+        slot.state = ENCODING;
+        return true;
+    }
+
+    // put the embeddings of finished encoder jobs into the image cache and their slots, which go back to
+    // loading their prompt
+    void collect_encoded_images()
+    {
+        if (!encoder.started())
+        {
+            return;
+        }
+
+        for (image_encoder::job &job : encoder.take_done())
+        {
+            // the slot either loads its prompt or is released next
+            all_slots_are_idle = false;
+
+            for (size_t i = 0; i < job.embeddings.size(); ++i)
+            {
+                if (job.embeddings[i])
+                {
+                    image_embeddings.add(job.hashes[i], job.embeddings[i], job.image_tokens[i],
+                                         (size_t) job.image_tokens[i] * clip_n_mmproj_embd(clp_ctx) * sizeof(float));
+                }
+            }
+
+            server_slot &slot = slots[job.slot_id];
+            if (slot.state != ENCODING || slot.encoding_job != job.id || slot.command == RELEASE)
+            {
+                continue;
+            }
+
+            if (!job.ok)
+            {
+                task_server task;
+                task.id           = slot.task_id;
+                task.multitask_id = slot.multitask_id;
+                send_error(task, "failed to encode image");
+                slot.command = RELEASE;
+                continue;
+            }
+
+            for (size_t i = 0; i < job.index.size(); ++i)
+            {
+                slot_image &img = slot.images[job.index[i]];
+                img.image_embedding      = job.embeddings[i];
+                img.image_tokens         = job.image_tokens[i];
+                img.request_encode_image = false;
+            }
+            slot.state = IDLE; // still LOAD_PROMPT
+        }
+    }
+
+    // mirrors the sampler queue of llama_sampling_sample, run over an already truncated candidates array
+    void apply_samplers(const llama_sampling_params &sparams, llama_token_data_array &cur_p, size_t min_keep)
+    {
+        for (const auto &sampler_type : sparams.samplers_sequence)
+        {
+            switch (sampler_type)
+            {
+                case llama_sampler_type::TOP_K:     llama_sample_top_k    (ctx, &cur_p, sparams.top_k,     min_keep); break;
+                case llama_sampler_type::TFS_Z:     llama_sample_tail_free(ctx, &cur_p, sparams.tfs_z,     min_keep); break;
+                case llama_sampler_type::TYPICAL_P: llama_sample_typical  (ctx, &cur_p, sparams.typical_p, min_keep); break;
+                case llama_sampler_type::TOP_P:     llama_sample_top_p    (ctx, &cur_p, sparams.top_p,     min_keep); break;
+                case llama_sampler_type::MIN_P:     llama_sample_min_p    (ctx, &cur_p, sparams.min_p,     min_keep); break;
+                case llama_sampler_type::TEMPERATURE:
+                    if (sparams.dynatemp_range > 0)
+                    {
+                        const float dynatemp_min = std::max(0.0f, sparams.temp - sparams.dynatemp_range);
+                        const float dynatemp_max = std::max(0.0f, sparams.temp + sparams.dynatemp_range);
+                        llama_sample_entropy(ctx, &cur_p, dynatemp_min, dynatemp_max, sparams.dynatemp_exponent);
+                    }
+                    else
+                    {
+                        llama_sample_temp(ctx, &cur_p, sparams.temp);
+                    }
+                    break;
+                default: break;
+            }
+        }
+    }
+
+    // sample the next token of the slot from the logits at batch index idx and collect the n_probs most likely candidates
+    // logit biases, repetition penalties and the JSON schema mask are applied in place to the raw logits first;
+    // greedy and top-k-first chains then read the raw logits directly, everything that needs the whole vocab
+    // (grammar, mirostat, or a chain that does not start with top-k) goes through llama_sampling_sample
+    llama_token sample_token(server_slot &slot, int idx, std::vector<completion_token_output::token_prob> &probs)
+    {
+        llama_sampling_context *ctx_sampling = slot.ctx_sampling;
+        const llama_sampling_params &sparams = ctx_sampling->params;
+        const int32_t n_vocab = llama_n_vocab(model);
+        const int32_t n_probs = sparams.n_probs;
+
+        float *logits = llama_get_logits_ith(ctx, idx);
+        for (const auto &bias : slot.sparams.logit_bias)
+        {
+            logits[bias.first] += bias.second;
+        }
+
+        slot.penalty_counts.apply(logits, sparams.penalty_repeat, sparams.penalty_freq, sparams.penalty_present,
+                                  sparams.penalize_nl ? -1 : llama_token_nl(model));
+
+        if (slot.json_schema != nullptr)
+        {
+            slot.json_schema->apply(slot.json_schema_state, logits, n_vocab);
+        }
+
+        const bool greedy       = sparams.temp <= 0.0f;
+        const size_t min_keep   = std::max(1, sparams.min_keep);
+        const int32_t top_k     = std::max(sparams.top_k, (int32_t) min_keep);
+        const bool top_k_first  = !sparams.samplers_sequence.empty() &&
+                                  sparams.samplers_sequence.front() == llama_sampler_type::TOP_K &&
+                                  sparams.top_k > 0 && top_k < n_vocab;
+
+        if (ctx_sampling->grammar != nullptr || sparams.mirostat != 0 || (!greedy && !top_k_first))
+        {
+            const llama_token id = llama_sampling_sample(ctx_sampling, ctx, NULL, idx);
+
+            llama_token_data_array cur_p = { ctx_sampling->cur.data(), ctx_sampling->cur.size(), false };
+            if (greedy && n_probs > 0)
+            {
+                // for llama_sample_token_greedy we need to sort candidates
+                llama_sample_softmax(ctx, &cur_p);
+            }
+
+            for (size_t i = 0; i < std::min(cur_p.size, (size_t) n_probs); ++i)
+            {
+                probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+            }
+            return id;
+        }
+
+        std::vector<llama_token_data> &cur = ctx_sampling->cur;
+
+        if (greedy)
+        {
+            if (n_probs <= 0)
+            {
+                return logits_argmax(logits, n_vocab);
+            }
+
+            logits_top_k(logits, n_vocab, n_probs, cur);
+            const float sum = logits_sum_exp(logits, n_vocab, cur[0].logit);
+            for (const llama_token_data &cand : cur)
+            {
+                probs.push_back({cand.id, expf(cand.logit - cur[0].logit) / sum});
+            }
+            return cur[0].id;
+        }
+
+        // only the top_k candidates can survive the chain, so the rest of the vocab is never materialized
+        logits_top_k(logits, n_vocab, top_k, cur);
+        llama_token_data_array cur_p = { cur.data(), cur.size(), true };
+        apply_samplers(sparams, cur_p, min_keep);
+        const llama_token id = llama_sample_token(ctx, &cur_p);
+
+        for (size_t i = 0; i < std::min(cur.size(), (size_t) n_probs); ++i)
+        {
+            probs.push_back({cur[i].id, cur[i].p});
+        }
+        return id;
+    }
+
+    void send_error(task_server& task, const std::string &error)
+    {
+        LOG_TEE("task %i - error: %s\n", task.id, error.c_str());
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = false;
+        res.error = true;
+        res.result_json = { { "content", error } };
+        queue_results.send(res);
+    }
+
+    json get_formated_generation(server_slot &slot)
+    {
+        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
+        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
+                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
+        std::vector<std::string> samplers_sequence;
+        for (const auto &sampler_type : slot.sparams.samplers_sequence)
+        {
+            samplers_sequence.emplace_back(sampler_type_to_name_string(sampler_type));
+        }
+
+        return json {
+            {"n_ctx",             slot.n_ctx},
+            {"n_predict",         slot.n_predict},
+            {"model",             params.model_alias},
+            {"seed",              slot.params.seed},
+            {"temperature",       slot.sparams.temp},
+            {"dynatemp_range",    slot.sparams.dynatemp_range},
+            {"dynatemp_exponent", slot.sparams.dynatemp_exponent},
+            {"top_k",             slot.sparams.top_k},
+            {"top_p",             slot.sparams.top_p},
+            {"min_p",             slot.sparams.min_p},
+            {"tfs_z",             slot.sparams.tfs_z},
+            {"typical_p",         slot.sparams.typical_p},
+            {"repeat_last_n",     slot.sparams.penalty_last_n},
+            {"repeat_penalty",    slot.sparams.penalty_repeat},
+            {"presence_penalty",  slot.sparams.penalty_present},
+            {"frequency_penalty", slot.sparams.penalty_freq},
+            {"penalty_prompt_tokens", slot.sparams.penalty_prompt_tokens},
+            {"use_penalty_prompt_tokens", slot.sparams.use_penalty_prompt_tokens},
+            {"mirostat",          slot.sparams.mirostat},
+            {"mirostat_tau",      slot.sparams.mirostat_tau},
+            {"mirostat_eta",      slot.sparams.mirostat_eta},
+            {"penalize_nl",       slot.sparams.penalize_nl},
+            {"stop",              slot.params.antiprompt},
+            {"n_predict",         slot.params.n_predict},
+            {"n_keep",            params.n_keep},
+            {"ignore_eos",        ignore_eos},
+            {"stream",            slot.params.stream},
+            {"logit_bias",        slot.sparams.logit_bias},
+            {"n_probs",           slot.sparams.n_probs},
+            {"min_keep",          slot.sparams.min_keep},
+            {"grammar",           slot.sparams.grammar},
+            {"samplers",          samplers_sequence}
+        };
+    }
+
     void send_partial_response(server_slot &slot, completion_token_output tkn)
     {
         task_result res;
@@ -1142,6 +2671,63 @@ struct llama_server_context
         res.error = false;
         res.stop = false;
 
+        std::vector<completion_token_output> probs_output = {};
+        if (slot.sparams.n_probs > 0)
+        {
+            // the tokens whose text has (at least partly) been sent so far
+            size_t probs_pos      = std::min(slot.n_sent_token_probs, slot.generated_token_probs.size());
+            size_t probs_stop_pos = probs_pos;
+            while (probs_stop_pos < slot.generated_token_probs.size() &&
+                   slot.generated_token_probs[probs_stop_pos].text_pos < slot.n_sent_text)
+            {
+                probs_stop_pos++;
+            }
+            if (probs_pos < probs_stop_pos)
+            {
+                probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
+            }
+            slot.n_sent_token_probs = probs_stop_pos;
+        }
+
+        if (slot.multitask_id == -1)
+        {
+            if (slot.recording)
+            {
+                task_result piece;
+                piece.stop        = false;
+                piece.error       = false;
+                piece.stream_text = true;
+                piece.text        = tkn.text_to_send;
+                piece.tok         = tkn.tok;
+                piece.with_probs  = slot.sparams.n_probs > 0;
+                piece.probs       = probs_output;
+                slot.recorded.push_back(std::move(piece));
+            }
+
+            res.stream_text = true;
+            res.text        = std::move(tkn.text_to_send);
+            res.tok         = tkn.tok;
+            res.slot_id     = slot.id;
+            res.with_probs  = slot.sparams.n_probs > 0;
+            res.probs       = std::move(probs_output);
+
+            // identical requests following this one still get the piece through the results queue
+            if (slot.shm_ring >= 0 && slot.sparams.n_probs == 0)
+            {
+                if (shm_rings.write(slot.shm_ring, slot.shm_ring_gen, res.tok, res.text))
+                {
+                    queue_results.send_followers(res);
+                    return;
+                }
+                // the ring is full: the rest of the task goes out as socket frames, which the reader only
+                // handles after draining the ring, so ring entries written after a frame would overtake it
+                slot.shm_ring = -1;
+            }
+
+            queue_results.send(std::move(res));
+            return;
+        }
+
         res.result_json = json
         {
             {"content",    tkn.text_to_send},
@@ -1149,58 +2735,128 @@ struct llama_server_context
             {"slot_id",    slot.id},
             {"multimodal", multimodal}
         };
-
         if (slot.sparams.n_probs > 0)
         {
-            std::vector<completion_token_output> probs_output = {};
-            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
-            size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
-            size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
-            if (probs_pos < probs_stop_pos)
-            {
-                probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
-            }
-            slot.n_sent_token_probs = probs_stop_pos;
             res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
         }
 
+        if (slot.recording)
+        {
+            slot.recorded.push_back(res);
+        }
         queue_results.send(res);
     }
 
+    // the json a streamed text result stands for, as sent before stream_text existed
+    json stream_result_to_json(const task_result &res) const
+    {
+        json result = json
+        {
+            {"content",    res.text},
+            {"stop",       false},
+            {"slot_id",    res.slot_id},
+            {"multimodal", multimodal}
+        };
+        if (res.with_probs)
+        {
+            result["completion_probabilities"] = probs_vector_to_json(ctx, res.probs);
+        }
+        return result;
+    }
+
+    // queue the piece of a streamed token, sending the pending frame once the slot's coalescing limits are reached
+    void stream_partial_response(server_slot &slot, const completion_token_output &tkn)
+    {
+        const int32_t n_min = slot.params.stream_min_tokens;
+        const int32_t t_max = slot.params.stream_flush_ms;
+        if (n_min <= 1 && t_max <= 0)
+        {
+            send_partial_response(slot, tkn);
+            return;
+        }
+
+        const int64_t t_now = ggml_time_us();
+        if (slot.n_stream_pending == 0)
+        {
+            slot.t_stream_pending = t_now;
+        }
+        slot.stream_pending.text_to_send += tkn.text_to_send;
+        slot.stream_pending.tok = tkn.tok;
+        slot.n_stream_pending++;
+
+        if ((n_min > 0 && slot.n_stream_pending >= n_min) || (t_max > 0 && t_now - slot.t_stream_pending >= t_max * 1000ll))
+        {
+            flush_partial_response(slot);
+        }
+    }
+
+    // send the coalesced frames that have waited stream_flush_ms, before the next decode delays them further
+    void flush_due_partial_responses()
+    {
+        const int64_t t_now = ggml_time_us();
+        for (server_slot &slot : slots)
+        {
+            const int32_t t_max = slot.params.stream_flush_ms;
+            if (slot.n_stream_pending > 0 && t_max > 0 && t_now - slot.t_stream_pending >= t_max * 1000ll)
+            {
+                flush_partial_response(slot);
+            }
+        }
+    }
+
+    void flush_partial_response(server_slot &slot)
+    {
+        if (slot.n_stream_pending == 0)
+        {
+            return;
+        }
+        send_partial_response(slot, std::move(slot.stream_pending));
+        slot.stream_pending   = completion_token_output();
+        slot.n_stream_pending = 0;
+    }
+
     void send_final_response(server_slot &slot)
     {
+        // the final frame must not overtake the coalesced text
+        flush_partial_response(slot);
+
         task_result res;
         res.id = slot.task_id;
         res.multitask_id = slot.multitask_id;
         res.error = false;
         res.stop = true;
 
-        res.result_json = json
-        {
-            {"content",             !slot.params.stream ? slot.generated_text : ""},
-            {"slot_id",             slot.id},
-            {"stop",                true},
-            {"model",               params.model_alias},
-            {"tokens_predicted",    slot.n_decoded},
-            {"tokens_evaluated",    slot.n_prompt_tokens},
-            {"generation_settings", get_formated_generation(slot)},
-            {"prompt",              slot.prompt},
-            {"truncated",           slot.truncated},
-            {"stopped_eos",         slot.stopped_eos},
-            {"stopped_word",        slot.stopped_word},
-            {"stopped_limit",       slot.stopped_limit},
-            {"stopping_word",       slot.stopping_word},
-            {"tokens_cached",       slot.n_past},
-            {"timings",             slot.get_formated_timings()}
-        };
-
-        if (slot.sparams.n_probs > 0)
+        // only build what the request asked for, generation_settings and prompt can be large
+        const slot_params &p = slot.params;
+        json &result = res.result_json;
+        result = json{{"stop", true}};
+        if (p.wants_field("content"))             result["content"]             = !p.stream ? slot.generated_text : "";
+        if (p.wants_field("slot_id"))             result["slot_id"]             = slot.id;
+        if (p.wants_field("model"))               result["model"]               = params.model_alias;
+        if (p.wants_field("tokens_predicted"))    result["tokens_predicted"]    = slot.n_decoded;
+        if (p.wants_field("tokens_evaluated"))    result["tokens_evaluated"]    = slot.n_prompt_tokens;
+        if (p.wants_field("generation_settings")) result["generation_settings"] = get_formated_generation(slot);
+        if (p.wants_field("prompt"))              result["prompt"]              = slot_prompt_json(slot);
+        if (p.wants_field("truncated"))           result["truncated"]           = slot.truncated;
+        if (p.wants_field("stopped_eos"))         result["stopped_eos"]         = slot.stopped_eos;
+        if (p.wants_field("stopped_word"))        result["stopped_word"]        = slot.stopped_word;
+        if (p.wants_field("stopped_limit"))       result["stopped_limit"]       = slot.stopped_limit;
+        if (p.wants_field("stopping_word"))       result["stopping_word"]       = slot.stopping_word;
+        if (p.wants_field("tokens_cached"))       result["tokens_cached"]       = slot.n_past;
+        if (p.wants_field("timings"))             result["timings"]             = slot.get_formated_timings();
+
+        if (slot.sparams.n_probs > 0 && p.wants_field("completion_probabilities"))
         {
             std::vector<completion_token_output> probs = {};
-            if (!slot.params.stream && slot.stopped_word)
+            if (!p.stream && slot.stopped_word)
             {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
-                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.end() - stop_word_toks.size());
+                // leave out the tokens that only made up the stop word
+                auto end = slot.generated_token_probs.begin();
+                while (end != slot.generated_token_probs.end() && end->text_pos < slot.generated_text.size())
+                {
+                    ++end;
+                }
+                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), end);
             }
             else
             {
@@ -1208,9 +2864,15 @@ struct llama_server_context
                                     slot.generated_token_probs.begin(),
                                     slot.generated_token_probs.end());
             }
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs);
+            result["completion_probabilities"] = probs_vector_to_json(ctx, probs);
         }
 
+        if (slot.recording)
+        {
+            slot.recorded.push_back(res);
+            completions.add(std::move(slot.record_key), std::move(slot.recorded));
+            slot.recording = false;
+        }
         queue_results.send(res);
     }
 
@@ -1227,10 +2889,7 @@ struct llama_server_context
         if (!params.embedding)
         {
             LOG_WARNING("embedding disabled", {{"params.embedding", params.embedding}});
-            res.result_json = json
-            {
-                {"embedding", std::vector<float>(n_embd, 0.0f)},
-            };
+            res.result_json = embedding_to_json(std::vector<float>(n_embd, 0.0f), slot.params.embd_format);
         }
         else
         {
@@ -1244,24 +2903,48 @@ struct llama_server_context
                     embd = llama_get_embeddings_ith(ctx, i);
                     if (embd == NULL) {
                         LOG_ERROR("failed to get embeddings for token", {{"token", batch.token[i]}, {"seq_id", batch.seq_id[i][0]}});
-                        res.result_json = json
-                        {
-                            {"embedding", std::vector<float>(n_embd, 0.0f)},
-                        };
+                        res.result_json = embedding_to_json(std::vector<float>(n_embd, 0.0f), slot.params.embd_format);
                         continue;
                     }
                 }
 
-                res.result_json = json
-                {
-                    {"embedding", std::vector<float>(embd, embd + n_embd)},
-                };
+                res.result_json = embedding_to_json(std::vector<float>(embd, embd + n_embd), slot.params.embd_format);
             }
         }
         queue_results.send(res);
     }
 
-    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id)
+    // compile the request's json_schema, unless it already was; done before queuing rather than on the server loop,
+    // which would stall every slot meanwhile
+    void compile_json_schema(server_request &request)
+    {
+        if (request.json_schema != nullptr || !request.json_schema_error.empty())
+        {
+            return;
+        }
+        const auto schema = request.data.find("json_schema");
+        if (schema != request.data.end() && !schema->is_null())
+        {
+            request.json_schema = json_schema_get(schema->is_string() ? schema->get<std::string>() : schema->dump(), request.json_schema_error);
+        }
+    }
+
+    // a parsed request body, its token prompt and decoded images travel with the task instead of being json
+    void request_completion(int task_id, server_request &&request, bool infill, bool embedding, int shm_ring = -1, uint32_t shm_ring_gen = 0)
+    {
+        compile_json_schema(request);
+
+        json data = std::move(request.data);
+        std::shared_ptr<const server_request> extra;
+        if (request.has_prompt_tokens || !request.images.empty() || request.json_schema != nullptr || !request.json_schema_error.empty())
+        {
+            extra = std::make_shared<server_request>(std::move(request));
+        }
+        request_completion(task_id, std::move(data), infill, embedding, -1, shm_ring, shm_ring_gen, std::move(extra));
+    }
+
+    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id, int shm_ring = -1, uint32_t shm_ring_gen = 0,
+                            std::shared_ptr<const server_request> request = nullptr)
     {
         task_server task;
         task.id = task_id;
@@ -1271,6 +2954,9 @@ struct llama_server_context
         task.embedding_mode = embedding;
         task.type = TASK_TYPE_COMPLETION;
         task.multitask_id = multitask_id;
+        task.shm_ring = shm_ring;
+        task.shm_ring_gen = shm_ring_gen;
+        task.request = std::move(request);
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1290,7 +2976,7 @@ struct llama_server_context
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
-                queue_tasks.post(task);
+                queue_tasks.post(std::move(task));
             } else {
                 split_multiprompt_task(task_id, task);
             }
@@ -1299,86 +2985,329 @@ struct llama_server_context
             if (task.data.contains("prompt") && task.data["prompt"].is_string() && task.data["prompt"].get<std::string>().empty()) {
                 task.data["prompt"] = " "; // add a space so that we have one token
             }
-            queue_tasks.post(task);
+            queue_tasks.post(std::move(task));
         }
     }
 
-    // for multiple images processing
-    bool ingest_images(server_slot &slot, int n_batch)
+    // Splits and tokenizes the content of an /embedding request into its inputs, false when it is neither text
+    // nor tokens. multi is set for an array of inputs. Called from the HTTP threads too, for the cache lookup, so it
+    // only reads the system prompt through add_bos_prompt.
+    bool embedding_inputs(const json &prompt, const server_request *request, std::vector<std::vector<llama_token>> &inputs, bool &multi) const
     {
-        int image_idx = 0;
+        const bool add_bos = add_bos_prompt.load();
 
-        while (image_idx < (int) slot.images.size())
+        multi = false;
+        inputs.clear();
+        try
         {
-            slot_image &img = slot.images[image_idx];
-
-            // process prefix prompt
-            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
+            if (request != nullptr && request->has_prompt_tokens)
             {
-                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
-                llama_batch batch_view = {
-                    n_tokens,
-                    batch.token    + i,
-                    nullptr,
-                    batch.pos      + i,
-                    batch.n_seq_id + i,
-                    batch.seq_id   + i,
-                    batch.logits   + i,
-                    0, 0, 0, // unused
-                };
-                if (llama_decode(ctx, batch_view))
+                inputs.push_back(request->prompt_tokens);
+            }
+            else if (prompt.is_array() && prompt.size() > 1 &&
+                     std::none_of(prompt.begin(), prompt.end(), [](const json &e) { return e.is_number(); }))
+            {
+                multi = true;
+                for (const json &input : prompt)
                 {
-                    LOG_TEE("%s : failed to eval\n", __func__);
-                    return false;
+                    inputs.push_back(tokenize(input, add_bos));
                 }
             }
+            else
+            {
+                inputs.push_back(tokenize(prompt, add_bos));
+            }
+        }
+        catch (const json::exception &)
+        {
+            return false;
+        }
+
+        // an empty prompt can make slot become buggy, same as in request_completion
+        for (std::vector<llama_token> &input : inputs)
+        {
+            if (input.empty())
+            {
+                input = tokenize(" ", add_bos);
+            }
+        }
+        return true;
+    }
+
+    // the response to an /embedding request whose inputs are all cached, answered without queuing a task
+    bool embedding_from_cache(const server_request &request, json &result)
+    {
+        std::vector<std::vector<llama_token>> inputs;
+        bool multi;
+        if (!embd_cache.enabled() || !embedding_inputs(request.data.at("prompt"), &request, inputs, multi))
+        {
+            return false;
+        }
+
+        const embedding_format format = embedding_format_from_json(request.data);
+        std::vector<json> results;
+        for (const std::vector<llama_token> &input : inputs)
+        {
+            std::vector<float> embedding;
+            if (!embd_cache.find(input, embedding))
+            {
+                return false;
+            }
+            results.push_back(embedding_to_json(std::move(embedding), format));
+        }
+
+        embd_cache.record_lookups(inputs.size(), 0);
+        result = multi ? json{ { "results", results } } : std::move(results[0]);
+        return true;
+    }
+
+    // text-only embedding requests don't take a slot, their inputs are packed together by embed_batch()
+    void request_embedding(int task_id, server_request &&request)
+    {
+        task_server task;
+        task.id = task_id;
+        task.target_id = 0;
+        task.embedding_mode = true;
+        task.type = TASK_TYPE_EMBEDDING;
+        task.data = std::move(request.data);
+        if (request.has_prompt_tokens)
+        {
+            task.request = std::make_shared<server_request>(std::move(request));
+        }
+        queue_tasks.post(std::move(task));
+    }
+
+    // results recorded by another request, resent as the ones of task_id. A replay from the completion cache
+    // (t_replay_start >= 0) evaluated nothing: its final response says so instead of repeating the timings and
+    // tokens_cached of the request that was recorded, the generation time is the time the replay took
+    void send_recorded(int task_id, int multitask_id, const std::vector<task_result> &results, int slot_id, int64_t t_replay_start = -1)
+    {
+        for (task_result res : results)
+        {
+            res.id           = task_id;
+            res.multitask_id = multitask_id;
+            if (res.stream_text)
+            {
+                res.slot_id = slot_id;
+            }
+            else if (res.result_json.contains("slot_id"))
+            {
+                res.result_json["slot_id"] = slot_id;
+            }
+            if (t_replay_start >= 0 && res.stop)
+            {
+                json &result = res.result_json;
+                if (result.contains("tokens_cached"))
+                {
+                    result["tokens_cached"] = 0;
+                }
+                if (result.contains("timings"))
+                {
+                    result["timings"] = server_slot::timings_json(0, 0.0, 0, (ggml_time_us() - t_replay_start) / 1e3);
+                }
+            }
+            queue_results.send(std::move(res));
+        }
+    }
+
+    // The request as received when it can follow an identical one, else empty: a deterministic completion, judged
+    // like replay_completion does from the fields launch_slot_with_data takes the sampling from. It is checked
+    // before the task gets a slot, so a duplicate never takes one, even while all of them are busy.
+    std::string request_key(const task_server &task) const
+    {
+        if (task.infill_mode || task.embedding_mode || task.data.contains("system_prompt"))
+        {
+            return "";
+        }
+        const auto image_data = task.data.find("image_data");
+        if (image_data != task.data.end() && image_data->is_array() && !image_data->empty())
+        {
+            return "";
+        }
+
+        slot_params default_params;
+        llama_sampling_params default_sparams;
+        const bool deterministic = json_value(task.data, "temperature", default_sparams.temp) <= 0.0f ||
+                                   (json_value(task.data, "seed", default_params.seed) != (uint32_t) -1 && slots.size() == 1);
+        if (!deterministic)
+        {
+            return "";
+        }
+
+        std::string key = task.data.dump();
+        key.push_back('\0');
+        key.push_back(task.multitask_id != -1 ? 'm' : 's');
+        if (task.request && task.request->has_prompt_tokens)
+        {
+            key.append((const char *) task.request->prompt_tokens.data(), task.request->prompt_tokens.size() * sizeof(llama_token));
+        }
+        return key;
+    }
+
+    // Attaches task to an identical request: a running one replays what it sent so far, a deferred one has not
+    // sent anything yet. queue_results copies the rest to the task.
+    bool follow_identical(const task_server &task, const std::string &key)
+    {
+        int leader_id = -1;
+        for (const server_slot &slot : slots)
+        {
+            if (slot.recording && slot.command != RELEASE && slot.request_key == key)
+            {
+                send_recorded(task.id, task.multitask_id, slot.recorded, slot.id);
+                leader_id = slot.task_id;
+                break;
+            }
+        }
+        if (leader_id == -1)
+        {
+            const auto deferred = deferred_leaders.find(key);
+            if (deferred == deferred_leaders.end() || deferred->second == task.id)
+            {
+                return false;
+            }
+            leader_id = deferred->second;
+        }
+
+        metrics.n_deduplicated++;
+        LOG_VERBOSE("following identical task", {{"task_id", task.id}, {"leader_task_id", leader_id}});
+        queue_results.add_follower(leader_id, task.id, task.multitask_id);
+        return true;
+    }
+
+    // Answers a launched request from the completion cache when its sampling is deterministic: greedy, or a fixed
+    // seed with a single slot since the sampling RNG belongs to the context. The slot is idle again right away.
+    // Otherwise the slot records its results, for the cache and for identical requests following it.
+    bool replay_completion(server_slot &slot, const json &data)
+    {
+        const int64_t t_start = ggml_time_us();
+        const bool deterministic = slot.sparams.temp <= 0.0f || (slot.params.seed != (uint32_t) -1 && slots.size() == 1);
+        if (!deterministic || slot.infill || slot.embedding || !slot.images.empty())
+        {
+            return false;
+        }
+
+        if (completions.n_bytes_max == 0)
+        {
+            slot.recording = true;
+            return false;
+        }
+
+        const std::vector<llama_token> prompt_tokens = !slot.prompt_ids.empty() ? slot.prompt_ids : tokenize(slot.prompt, system_prompt.empty() && add_bos_token);
+        if (prompt_tokens.empty())
+        {
+            return false;
+        }
+
+        // the normalized settings plus what they leave out but changes the results
+        json settings = get_formated_generation(slot);
+        settings["system_prompt"]     = system_prompt;
+        settings["json_schema"]       = data.count("json_schema") != 0 ? data.at("json_schema") : json();
+        settings["response_fields"]   = slot.params.response_fields;
+        settings["stream_min_tokens"] = slot.params.stream_min_tokens;
+        settings["stream_flush_ms"]   = slot.params.stream_flush_ms;
+        settings["multitask"]         = slot.multitask_id != -1;
+
+        std::string key = settings.dump();
+        key.push_back('\0');
+        key.append((const char *) prompt_tokens.data(), prompt_tokens.size() * sizeof(llama_token));
+
+        const std::vector<task_result> *results = completions.find(key);
+        if (results == nullptr)
+        {
+            metrics.n_completion_cache_misses++;
+            slot.recording  = true;
+            slot.record_key = std::move(key);
+            return false;
+        }
+
+        metrics.n_completion_cache_hits++;
+        LOG_VERBOSE("replaying cached completion", {{"slot_id", slot.id}, {"task_id", slot.task_id}, {"n_results", results->size()}});
+        send_recorded(slot.task_id, slot.multitask_id, *results, slot.id, t_start);
+
+        slot.command     = NONE;
+        slot.t_last_used = ggml_time_us();
+        queue_tasks.notify_slot_changed();
+        return true;
+    }
+
+    // the prompt of a multimodal slot: the text before each image, image_token for every position of the image,
+    // then the suffix; images gets where each image is
+    std::vector<llama_token> multimodal_prompt(const server_slot &slot, std::vector<slot_cache_image> &images)
+    {
+        std::vector<llama_token> tokens;
+        for (size_t i = 0; i < slot.images.size(); ++i)
+        {
+            const slot_image &img = slot.images[i];
+            const std::vector<llama_token> prefix = tokenize(img.prefix_prompt, i == 0 && add_bos_token);
+            tokens.insert(tokens.end(), prefix.begin(), prefix.end());
+
+            images.push_back({(int32_t) tokens.size(), img.image_tokens, img.hash});
+            tokens.insert(tokens.end(), img.image_tokens, image_token);
+        }
+        const std::vector<llama_token> suffix = tokenize(slot.params.input_suffix, false);
+        tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+        return tokens;
+    }
+
+    // decode the prompt of a multimodal slot from slot.n_past to the end of its last image, which may be cached
+    // in part already: the text in a batch of its own, so the shared batch is left to the other slots, and the
+    // images from their embeddings
+    bool ingest_images(server_slot &slot, const std::vector<llama_token> &prompt_tokens, const std::vector<slot_cache_image> &prompt_images, int n_batch)
+    {
+        const int n_embd = llama_n_embd(model);
+
+        llama_batch batch_text = llama_batch_init(n_batch, 0, 1);
+        bool ok = true;
+        for (size_t k = 0; k < prompt_images.size() && ok; ++k)
+        {
+            const slot_cache_image &img = prompt_images[k];
+            if (img.pos + img.n_tokens <= slot.n_past)
+            {
+                continue;
+            }
 
-            // process image with llm
-            for (int i = 0; i < img.image_tokens; i += n_batch)
+            // the text before the image
+            while (slot.n_past < img.pos && ok)
             {
-                int n_eval = img.image_tokens - i;
-                if (n_eval > n_batch)
+                llama_batch_clear(batch_text);
+                for (; slot.n_past < img.pos && batch_text.n_tokens < n_batch; ++slot.n_past)
                 {
-                    n_eval = n_batch;
+                    llama_batch_add(batch_text, prompt_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
                 }
+                if (llama_decode(ctx, batch_text))
+                {
+                    LOG_TEE("%s : failed to eval\n", __func__);
+                    ok = false;
+                }
+            }
 
-                const int n_embd = llama_n_embd(model);
+            // the image, from where the cache ends
+            for (int32_t i = slot.n_past - img.pos; i < img.n_tokens && ok; i += n_batch)
+            {
+                const int32_t n_eval = std::min(n_batch, img.n_tokens - i);
                 llama_batch batch_img = {
                     n_eval,
                     nullptr,
-                    (img.image_embedding + i * n_embd),
+                    (slot.images[k].image_embedding.get() + i * n_embd),
                     nullptr,
                     nullptr,
                     nullptr,
                     nullptr,
-                    slot.n_past,
-                    1, 0
+                    (llama_pos) system_tokens.size() + slot.n_past,
+                    1, slot.id
                 };
                 if (llama_decode(ctx, batch_img))
                 {
                     LOG_TEE("%s : failed to eval image\n", __func__);
-                    return false;
+                    ok = false;
+                    break;
                 }
                 slot.n_past += n_eval;
             }
-            image_idx++;
-
-            llama_batch_clear(batch);
-
-            // append prefix of next image
-            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
-                slot.params.input_suffix : // no more images, then process suffix prompt
-                (json)(slot.images[image_idx].prefix_prompt);
-
-            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
-            for (int i = 0; i < (int) append_tokens.size(); ++i)
-            {
-                llama_batch_add(batch, append_tokens[i], system_tokens.size() + slot.n_past, { slot.id }, true);
-                slot.n_past += 1;
-            }
         }
+        llama_batch_free(batch_text);
 
-        return true;
+        return ok;
     }
 
     void request_cancel(int task_id)
@@ -1414,7 +3343,8 @@ struct llama_server_context
             subtask_data["prompt"] = subtask_data["prompt"][i];
 
             // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            request_completion(subtask_ids[i], subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
+            request_completion(subtask_ids[i], std::move(subtask_data), multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id,
+                               -1, 0, multiprompt_task.request);
         }
     }
 
@@ -1423,14 +3353,38 @@ struct llama_server_context
         switch (task.type)
         {
             case TASK_TYPE_COMPLETION: {
+                // a deferred leader that was cancelled runs for the follower that took its place
+                const auto promoted = deferred_promotions.find(task.id);
+                if (promoted != deferred_promotions.end())
+                {
+                    task.id           = promoted->second.first;
+                    task.multitask_id = promoted->second.second;
+                    task.shm_ring     = -1;
+                    deferred_promotions.erase(promoted);
+                }
+
+                const std::string key = request_key(task);
+                if (!key.empty() && follow_identical(task, key))
+                {
+                    break;
+                }
+
                 server_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
                 if (slot == nullptr)
                 {
                     // if no slot is available, we defer this task for processing later
                     LOG_VERBOSE("no slot is available", {{"task_id", task.id}});
-                    queue_tasks.defer(task);
+                    if (!key.empty())
+                    {
+                        deferred_leaders.emplace(key, task.id);
+                    }
+                    queue_tasks.defer(std::move(task));
                     break;
                 }
+                if (!key.empty())
+                {
+                    deferred_leaders.erase(key);
+                }
 
                 if (task.data.contains("system_prompt"))
                 {
@@ -1444,6 +3398,7 @@ struct llama_server_context
                     for (server_slot &slot : slots)
                     {
                         slot.cache_tokens.clear();
+                        slot.cache_images.clear();
                         slot.n_past    = 0;
                         slot.n_past_se = 0;
                     }
@@ -1455,27 +3410,119 @@ struct llama_server_context
                 slot->embedding    = task.embedding_mode;
                 slot->task_id      = task.id;
                 slot->multitask_id = task.multitask_id;
+                slot->shm_ring     = task.shm_ring;
+                slot->shm_ring_gen = task.shm_ring_gen;
 
-                if (!launch_slot_with_data(slot, task.data))
+                std::string error;
+                if (!launch_slot_with_data(slot, task.data, task.request.get(), error))
                 {
                     // send error result
-                    send_error(task, "internal_error");
+                    send_error(task, error.empty() ? "internal_error" : error);
                     break;
                 }
+
+                slot->request_key = key;
+                replay_completion(*slot, task.data);
             } break;
             case TASK_TYPE_CANCEL: { // release slot linked with the task id
                 for (auto & slot : slots)
                 {
                     if (slot.task_id == task.target_id)
                     {
+                        // identical requests following this one take it over instead
+                        int follower_id, follower_multitask_id;
+                        if (queue_results.promote_follower(slot.task_id, follower_id, follower_multitask_id))
+                        {
+                            slot.task_id      = follower_id;
+                            slot.multitask_id = follower_multitask_id;
+                            slot.shm_ring     = -1;
+                            break;
+                        }
+                        slot.recording = false;
                         slot.release();
                         break;
                     }
                 }
+                for (auto & deferred : deferred_leaders)
+                {
+                    int follower_id, follower_multitask_id;
+                    if (deferred.second == task.target_id &&
+                        queue_results.promote_follower(task.target_id, follower_id, follower_multitask_id))
+                    {
+                        deferred_promotions[task.target_id] = {follower_id, follower_multitask_id};
+                        deferred.second = follower_id;
+                        break;
+                    }
+                }
+                queue_results.remove_follower(task.target_id);
             } break;
             case TASK_TYPE_NEXT_RESPONSE: {
                 // do nothing
             } break;
+            case TASK_TYPE_EMBEDDING: {
+                embedding_job job;
+                job.task_id = task.id;
+                job.format  = embedding_format_from_json(task.data);
+
+                std::vector<std::vector<llama_token>> inputs;
+                if (!embedding_inputs(task.data.at("prompt"), task.request.get(), inputs, job.multi))
+                {
+                    send_error(task, "content must be a string, an array of tokens or an array of those");
+                    break;
+                }
+
+                const int32_t format[4] = { job.format.encoding, job.format.normalize, job.format.dimensions, job.multi };
+                job.key.assign((const char *) format, sizeof(format));
+                for (const std::vector<llama_token> &input : inputs)
+                {
+                    const uint32_t n_tokens = input.size();
+                    job.key.append((const char *) &n_tokens, sizeof(n_tokens));
+                    job.key.append((const char *) input.data(), input.size() * sizeof(llama_token));
+                }
+
+                auto running = std::find_if(embedding_jobs.begin(), embedding_jobs.end(), [&job](const embedding_job &other) { return other.key == job.key; });
+                if (running != embedding_jobs.end())
+                {
+                    metrics.n_deduplicated++;
+                    queue_results.add_follower(running->task_id, task.id, task.multitask_id);
+                    break;
+                }
+
+                // inputs embedded before come from the cache, only the others are decoded
+                job.embeddings.resize(inputs.size());
+                bool fits = true;
+                for (size_t i = 0; i < inputs.size(); i++)
+                {
+                    if (embd_cache.find(inputs[i], job.embeddings[i]))
+                    {
+                        continue;
+                    }
+                    fits = fits && embedding_input_fits(inputs[i].size());
+                    job.inputs.push_back(std::move(inputs[i]));
+                    job.positions.push_back(i);
+                }
+                if (embd_cache.enabled())
+                {
+                    embd_cache.record_lookups(inputs.size() - job.inputs.size(), job.inputs.size());
+                }
+
+                if (!fits)
+                {
+                    // an input that doesn't fit a padded batch is decoded over several calls, which needs a slot
+                    task.type = TASK_TYPE_COMPLETION;
+                    if (job.multi)
+                    {
+                        split_multiprompt_task(task.id, task);
+                    }
+                    else
+                    {
+                        process_single_task(task);
+                    }
+                    break;
+                }
+
+                embedding_jobs.push_back(std::move(job));
+            } break;
             case TASK_TYPE_METRICS: {
                 json slots_data        = json::array();
                 int n_idle_slots       = 0;
@@ -1486,7 +3533,7 @@ struct llama_server_context
                     slot_data["id"] = slot.id;
                     slot_data["task_id"] = slot.task_id;
                     slot_data["state"] = slot.state;
-                    slot_data["prompt"] = slot.prompt;
+                    slot_data["prompt"] = slot_prompt_json(slot);
                     slot_data["next_token"] = {
                             {"has_next_token",       slot.has_next_token},
                             {"n_remain",             slot.n_remaining},
@@ -1532,6 +3579,21 @@ struct llama_server_context
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
                         { "t_tokens_generation",             metrics.t_tokens_generation},
 
+                        { "n_grammar_cache_hits",            metrics.n_grammar_cache_hits},
+                        { "n_grammar_cache_misses",          metrics.n_grammar_cache_misses},
+                        { "t_grammar_parse",                 metrics.t_grammar_parse},
+
+                        { "n_deduplicated",                  metrics.n_deduplicated},
+
+                        { "n_completion_cache_hits",         metrics.n_completion_cache_hits},
+                        { "n_completion_cache_misses",       metrics.n_completion_cache_misses},
+
+                        { "n_image_cache_hits",              metrics.n_image_cache_hits},
+                        { "n_image_cache_misses",            metrics.n_image_cache_misses},
+
+                        { "n_embedding_cache_hits",          embd_cache.n_hits.load()},
+                        { "n_embedding_cache_misses",        embd_cache.n_misses.load()},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
@@ -1562,67 +3624,320 @@ struct llama_server_context
         queue_results.send(result);
     }
 
-    bool update_slots() {
-        if (system_need_update)
-        {
-            LOG_INFO("updating system prompt", {});
-            system_prompt_update();
-        }
+    // Tokens in a batch of n_seqs embedding inputs of n_tokens tokens in total. The inputs take the sequence ids
+    // above the slots', so the slots keep their cached prompts, but pooling needs every seq_id below the number of
+    // tokens: a small batch is padded with a sequence of its own, whose embedding is not used.
+    int32_t embedding_batch_tokens(size_t n_seqs, int32_t n_tokens) const
+    {
+        const int32_t n_ids = (int32_t) slots.size() + (int32_t) n_seqs;
+        return n_tokens >= n_ids ? n_tokens : n_ids + 1;
+    }
 
-        llama_batch_clear(batch);
+    // whether embed_batch can decode an input of n_tokens tokens, on its own if need be
+    bool embedding_input_fits(int32_t n_tokens) const
+    {
+        return embedding_batch_tokens(1, n_tokens) <= std::min(params.n_batch, n_ctx);
+    }
 
-        if (all_slots_are_idle)
+    // drops the sequences of an embedding batch, all at once when the slots have nothing cached either
+    void embedding_kv_clear(const std::vector<llama_seq_id> &seq_ids)
+    {
+        bool slots_empty = system_tokens.empty();
+        for (const server_slot &slot : slots)
         {
-            if (system_prompt.empty() && clean_kv_cache)
-            {
-                LOG_INFO("all slots are idle and system prompt is empty, clear the KV cache", {});
-                kv_cache_clear();
-            }
-            return true;
+            slots_empty = slots_empty && slot.available() && slot.cache_tokens.empty();
         }
 
-        LOG_VERBOSE("posting NEXT_RESPONSE", {});
-        task_server task;
-        task.type = TASK_TYPE_NEXT_RESPONSE;
-        task.target_id = -1;
-        queue_tasks.post(task);
-
-        for (server_slot &slot : slots)
+        if (slots_empty)
         {
-            if (slot.ga_n == 1)
-            {
-                if (slot.is_processing() && system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
-                {
-                    // Shift context
-                    const int n_keep    = slot.params.n_keep + add_bos_token;
-                    const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = n_left / 2;
+            llama_kv_cache_clear(ctx);
+            return;
+        }
 
-                    LOG_INFO("slot context shift", {
-                        {"slot_id",         slot.id},
-                        {"task_id",         slot.task_id},
-                        {"n_keep",          n_keep},
-                        {"n_left",          n_left},
-                        {"n_discard",       n_discard},
-                        {"n_ctx",           n_ctx},
-                        {"n_past",          slot.n_past},
-                        {"n_system_tokens", system_tokens.size()},
-                        {"n_cache_tokens",  slot.cache_tokens.size()}
-                    });
-                    llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+        for (llama_seq_id seq_id : seq_ids)
+        {
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        }
+    }
 
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++)
-                    {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
+    // Decodes as many queued embedding inputs as fit in n_batch tokens with a single llama_decode, one sequence
+    // per input and no sampling, and answers the jobs that are complete. Runs once per loop pass, ahead of the slots.
+    void embed_batch()
+    {
+        if (embedding_jobs.empty())
+        {
+            return;
+        }
 
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+        struct embedding_input
+        {
+            embedding_job *job;
+            size_t         index;
+        };
 
-                    slot.n_past -= n_discard;
+        const int32_t n_batch = std::min(params.n_batch, n_ctx);
+        const int     n_embd  = llama_n_embd(model);
 
-                    slot.truncated = true;
-                }
+        std::vector<embedding_input> inputs;
+        int32_t n_tokens = 0;
+        for (embedding_job &job : embedding_jobs)
+        {
+            size_t i = job.n_next;
+            for (; i < job.inputs.size() && n_tokens + (int32_t) job.inputs[i].size() <= n_batch; i++)
+            {
+                inputs.push_back({ &job, i });
+                n_tokens += job.inputs[i].size();
+            }
+            if (i < job.inputs.size())
+            {
+                break;
+            }
+        }
+
+        std::vector<llama_seq_id> seq_ids;
+        bool decoded = false;
+        while (!decoded)
+        {
+            while (!inputs.empty() && embedding_batch_tokens(inputs.size(), n_tokens) > n_batch)
+            {
+                n_tokens -= inputs.back().job->inputs[inputs.back().index].size();
+                inputs.pop_back();
+            }
+            if (inputs.empty())
+            {
+                // the padding doesn't fit next to the first input, only a larger batch could take it
+                for (embedding_job &job : embedding_jobs)
+                {
+                    if (job.n_next < job.inputs.size())
+                    {
+                        LOG_ERROR("embedding input too large for a padded batch", {{"task_id", job.task_id}, {"n_tokens", job.inputs[job.n_next].size()}});
+                        job.failed = true;
+                        break;
+                    }
+                }
+                break;
+            }
+
+            seq_ids.clear();
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                seq_ids.push_back((llama_seq_id) (slots.size() + i));
+            }
+
+            llama_batch_clear(batch);
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                const std::vector<llama_token> &tokens = inputs[i].job->inputs[inputs[i].index];
+                for (size_t j = 0; j < tokens.size(); j++)
+                {
+                    llama_batch_add(batch, tokens[j], j, { seq_ids[i] }, j + 1 == tokens.size());
+                }
+            }
+            const int32_t n_padding = embedding_batch_tokens(inputs.size(), n_tokens) - n_tokens;
+            if (n_padding > 0)
+            {
+                const llama_seq_id pad_id = (llama_seq_id) (slots.size() + inputs.size());
+                for (int32_t j = 0; j < n_padding; j++)
+                {
+                    llama_batch_add(batch, batch.token[0], j, { pad_id }, false);
+                }
+                seq_ids.push_back(pad_id);
+            }
+
+            const int64_t t_start = ggml_time_us();
+            const int ret = llama_decode(ctx, batch);
+            if (ret == 0)
+            {
+                metrics.on_embedding_batch(n_tokens, (ggml_time_us() - t_start) / 1e3);
+                decoded = true;
+                break;
+            }
+
+            embedding_kv_clear(seq_ids);
+            if (ret < 0 || inputs.size() == 1)
+            {
+                LOG_ERROR("failed to decode the embedding batch", {{"n_inputs", inputs.size()}, {"n_tokens", n_tokens}, {"ret", ret}});
+                for (embedding_input &input : inputs)
+                {
+                    input.job->failed = true;
+                }
+                break;
+            }
+
+            // no room in the KV cache, retry with half the inputs
+            LOG_INFO("failed to find free space in the KV cache for the embedding batch, retrying with fewer inputs", {{"n_inputs", inputs.size()}});
+            inputs.resize(inputs.size() / 2);
+            n_tokens = 0;
+            for (const embedding_input &input : inputs)
+            {
+                n_tokens += input.job->inputs[input.index].size();
+            }
+        }
+
+        if (decoded)
+        {
+            int32_t i_batch = -1;
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                embedding_input &input = inputs[i];
+                i_batch += input.job->inputs[input.index].size();
+
+                const float * embd = llama_get_embeddings_seq(ctx, seq_ids[i]);
+                if (embd == NULL)
+                {
+                    embd = llama_get_embeddings_ith(ctx, i_batch);
+                }
+                std::vector<float> &embedding = input.job->embeddings[input.job->positions[input.index]];
+                if (embd == NULL)
+                {
+                    LOG_ERROR("failed to get embeddings for sequence", {{"seq_id", seq_ids[i]}});
+                    embedding.assign(n_embd, 0.0f);
+                }
+                else
+                {
+                    embedding.assign(embd, embd + n_embd);
+                    embd_cache.add(input.job->inputs[input.index], embedding);
+                }
+                input.job->n_next = input.index + 1;
+            }
+            embedding_kv_clear(seq_ids);
+        }
+
+        // inputs are taken in queue order, so finished jobs are always at the front
+        while (!embedding_jobs.empty())
+        {
+            embedding_job &job = embedding_jobs.front();
+            if (job.failed)
+            {
+                task_server task;
+                task.id = job.task_id;
+                send_error(task, "failed to decode the embedding batch");
+            }
+            else if (job.n_next == job.inputs.size())
+            {
+                task_result res;
+                res.id = job.task_id;
+                res.error = false;
+                res.stop = true;
+                if (job.multi)
+                {
+                    std::vector<json> results;
+                    for (std::vector<float> &embedding : job.embeddings)
+                    {
+                        results.push_back(embedding_to_json(std::move(embedding), job.format));
+                    }
+                    res.result_json = json{ { "results", results } };
+                }
+                else
+                {
+                    res.result_json = embedding_to_json(std::move(job.embeddings[0]), job.format);
+                }
+                queue_results.send(res);
+            }
+            else
+            {
+                break;
+            }
+            embedding_jobs.pop_front();
+        }
+
+        if (!embedding_jobs.empty())
+        {
+            task_server task;
+            task.type = TASK_TYPE_NEXT_RESPONSE;
+            task.target_id = -1;
+            queue_tasks.post(task);
+        }
+    }
+
+    // one pass of the loop, waking up the shared memory readers once for everything it streamed
+    void run_slots()
+    {
+        collect_encoded_images();
+        embed_batch();
+        update_slots();
+        shm_rings.notify();
+    }
+
+    bool update_slots() {
+        if (system_need_update)
+        {
+            LOG_INFO("updating system prompt", {});
+            system_prompt_update();
+        }
+
+        llama_batch_clear(batch);
+
+        if (all_slots_are_idle)
+        {
+            if (system_prompt.empty() && clean_kv_cache)
+            {
+                LOG_INFO("all slots are idle and system prompt is empty, clear the KV cache", {});
+                kv_cache_clear();
+            }
+            return true;
+        }
+
+        flush_due_partial_responses();
+
+        LOG_VERBOSE("posting NEXT_RESPONSE", {});
+        task_server task;
+        task.type = TASK_TYPE_NEXT_RESPONSE;
+        task.target_id = -1;
+        queue_tasks.post(task);
+
+        for (server_slot &slot : slots)
+        {
+            if (slot.ga_n == 1)
+            {
+                if (slot.is_processing() && system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
+                {
+                    // Shift context
+                    const int n_keep    = slot.params.n_keep + add_bos_token;
+                    const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
+                    const int n_discard = n_left / 2;
+
+                    LOG_INFO("slot context shift", {
+                        {"slot_id",         slot.id},
+                        {"task_id",         slot.task_id},
+                        {"n_keep",          n_keep},
+                        {"n_left",          n_left},
+                        {"n_discard",       n_discard},
+                        {"n_ctx",           n_ctx},
+                        {"n_past",          slot.n_past},
+                        {"n_system_tokens", system_tokens.size()},
+                        {"n_cache_tokens",  slot.cache_tokens.size()}
+                    });
+                    llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
+                    llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+
+                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++)
+                    {
+                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
+                    }
+
+                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+
+                    // images cut by the shift are gone, their leftover positions match no image anymore
+                    std::vector<slot_cache_image> cache_images;
+                    for (slot_cache_image img : slot.cache_images)
+                    {
+                        if (img.pos + img.n_tokens <= n_keep)
+                        {
+                            cache_images.push_back(img);
+                        }
+                        else if (img.pos >= n_keep + n_discard)
+                        {
+                            img.pos -= n_discard;
+                            cache_images.push_back(img);
+                        }
+                    }
+                    slot.cache_images = std::move(cache_images);
+
+                    slot.n_past -= n_discard;
+
+                    slot.truncated = true;
+                }
             }
         }
 
@@ -1651,7 +3966,8 @@ struct llama_server_context
                 continue;
             }
 
-            if (slot.state == IDLE)
+            // an ENCODING slot has no prompt in the KV cache yet, there is nothing to continue
+            if (slot.state != PROCESSING)
             {
                 continue;
             }
@@ -1662,8 +3978,22 @@ struct llama_server_context
 
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id }, true);
-            slot.n_past += 1;
+            if (slot.pending_tokens.empty())
+            {
+                llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id }, true);
+                slot.n_past += 1;
+            }
+            else
+            {
+                // jump-forward: only the last token needs logits
+                for (size_t i = 0; i < slot.pending_tokens.size(); ++i)
+                {
+                    llama_batch_add(batch, slot.pending_tokens[i], system_tokens.size() + slot.n_past, { slot.id }, i + 1 == slot.pending_tokens.size());
+                    slot.n_past += 1;
+                }
+                slot.i_batch = batch.n_tokens - 1;
+                slot.pending_tokens.clear();
+            }
         }
 
         // process in chunks of params.n_batch
@@ -1674,7 +4004,7 @@ struct llama_server_context
         {
             for (auto & slot : slots)
             {
-                const bool has_prompt = slot.prompt.is_array() || (slot.prompt.is_string() && !slot.prompt.get<std::string>().empty()) || !slot.images.empty();
+                const bool has_prompt = slot.prompt.is_array() || (slot.prompt.is_string() && !slot.prompt.get<std::string>().empty()) || !slot.images.empty() || !slot.prompt_ids.empty();
 
                 // empty prompt passed -> release the slot and send empty response
                 // note: infill mode allows empty prompt
@@ -1686,15 +4016,24 @@ struct llama_server_context
                     continue;
                 }
 
+                // images not found in the image cache are encoded first, beside the decoding of the other slots
+                if (slot.state == IDLE && slot.command == LOAD_PROMPT && encode_images(slot))
+                {
+                    continue;
+                }
+
                 // need process the prompt
                 if (slot.state == IDLE && slot.command == LOAD_PROMPT)
                 {
                     slot.state = PROCESSING;
                     slot.command = NONE;
                     std::vector<llama_token> prompt_tokens;
+                    std::vector<slot_cache_image> prompt_images;
                     slot.t_start_process_prompt = ggml_time_us();
                     slot.t_start_genereration = 0;
 
+                    const bool has_images = process_images(slot);
+
                     if (slot.infill)
                     {
                         bool suff_rm_leading_spc = true;
@@ -1718,9 +4057,13 @@ struct llama_server_context
                         prefix_tokens.push_back(llama_token_middle(model));
                         prompt_tokens = prefix_tokens;
                     }
+                    else if (has_images)
+                    {
+                        prompt_tokens = multimodal_prompt(slot, prompt_images);
+                    }
                     else
                     {
-                        prompt_tokens = tokenize(slot.prompt, system_prompt.empty() && add_bos_token);  // add BOS if there isn't system prompt
+                        prompt_tokens = !slot.prompt_ids.empty() ? slot.prompt_ids : tokenize(slot.prompt, system_prompt.empty() && add_bos_token);  // add BOS if there isn't system prompt
                     }
 
                     slot.n_prompt_tokens = prompt_tokens.size();
@@ -1732,7 +4075,8 @@ struct llama_server_context
                     slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
                     // if input prompt is too big, truncate it, if group attention self-extend is disabled
-                    if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx)
+                    // (images can't be cut in half, a prompt with images is kept whole)
+                    if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx && !has_images)
                     {
                         const int n_left = slot.n_ctx - slot.params.n_keep;
                         const int n_block_size = n_left / 2;
@@ -1773,11 +4117,37 @@ struct llama_server_context
                         // push the prompt into the sampling context (do not apply grammar)
                         for (auto &token : prompt_tokens)
                         {
+                            if (token == image_token)
+                            {
+                                continue;
+                            }
                             llama_sampling_accept(slot.ctx_sampling, ctx, token, false);
+                            if (!slot.sparams.use_penalty_prompt_tokens)
+                            {
+                                slot.penalty_counts.push(token);
+                            }
                         }
 
                         slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                        // image positions all look the same, the cache is only reused up to the first image that
+                        // isn't the cached one at the same place
+                        for (const slot_cache_image &img : prompt_images)
+                        {
+                            if (img.pos >= slot.n_past)
+                            {
+                                break;
+                            }
+                            const bool cached = std::any_of(slot.cache_images.begin(), slot.cache_images.end(), [&img](const slot_cache_image &c) {
+                                return c.pos == img.pos && c.n_tokens == img.n_tokens && c.hash == img.hash;
+                            });
+                            if (!cached)
+                            {
+                                slot.n_past = img.pos;
+                                break;
+                            }
+                        }
+
                         // the last token of the cache is not in the KV cache until the next call to llama_decode
                         // (it was sampled, pushed into the "cache_tokens", but not yet put in the context)
                         if (slot.n_past > 0 && slot.n_past == (int32_t) slot.cache_tokens.size())
@@ -1817,6 +4187,7 @@ struct llama_server_context
                     }
 
                     slot.cache_tokens = prompt_tokens;
+                    slot.cache_images = prompt_images;
 
                     if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0)
                     {
@@ -1846,10 +4217,19 @@ struct llama_server_context
                                                     {"to_eval", tokens_to_str(ctx, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
                                                 });
 
-                    const bool has_images = process_images(slot);
-
-                    // process the prefix of first image
-                    std::vector<llama_token> prefix_tokens = has_images ? tokenize(slot.images[0].prefix_prompt, add_bos_token) : prompt_tokens;
+                    // the prompt up to the end of the last image goes in batches of its own, the shared batch only gets
+                    // the text after it
+                    if (has_images && !ingest_images(slot, prompt_tokens, prompt_images, n_batch))
+                    {
+                        LOG_ERROR("failed processing images", {
+                            {"slot_id", slot.id},
+                            {"task_id", slot.task_id},
+                        });
+                        // FIXME @phymbert: to be properly tested
+                        //  early returning without changing the slot state will block the slot for ever
+                        // no one at the moment is checking the return value
+                        return false;
+                    }
 
                     int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
@@ -1857,7 +4237,7 @@ struct llama_server_context
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
-                    for (; slot.n_past < (int) prefix_tokens.size(); ++slot.n_past)
+                    for (; slot.n_past < (int) prompt_tokens.size(); ++slot.n_past)
                     {
                         if (slot.ga_n != 1)
                         {
@@ -1867,22 +4247,10 @@ struct llama_server_context
                                 ga_i += ga_w/ga_n;
                             }
                         }
-                        llama_batch_add(batch, prefix_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id }, false);
+                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id }, false);
                         slot_npast++;
                     }
 
-                    if (has_images && !ingest_images(slot, n_batch))
-                    {
-                        LOG_ERROR("failed processing images", {
-                            {"slot_id", slot.id},
-                            {"task_id", slot.task_id},
-                        });
-                        // FIXME @phymbert: to be properly tested
-                        //  early returning without changing the slot state will block the slot for ever
-                        // no one at the moment is checking the return value
-                        return false;
-                    }
-
                     // extract the logits only for the last token
                     if (batch.n_tokens > 0)
                     {
@@ -1983,9 +4351,15 @@ struct llama_server_context
                 }
 
                 completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                const llama_token id = sample_token(slot, slot.i_batch - i, result.probs);
 
                 llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                slot.penalty_counts.push(id);
+
+                if (slot.json_schema != nullptr)
+                {
+                    slot.json_schema_state = slot.json_schema->advance(slot.json_schema_state, vocab_pieces[id]);
+                }
 
                 slot.n_decoded += 1;
                 if (slot.n_decoded == 1)
@@ -1995,28 +4369,19 @@ struct llama_server_context
                     metrics.on_prompt_eval(slot);
                 }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
                 result.tok = id;
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
-                {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
-                }
-
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
-                {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
-                }
-
-                if (!process_token(result, slot))
+                if (!process_sampled_token(result, slot))
                 {
                     slot.release();
                     slot.print_timings();
                     send_final_response(slot);
                     metrics.on_prediction(slot);
                 }
+                else
+                {
+                    jump_forward(slot);
+                }
 
                 slot.i_batch = -1;
             }
@@ -2048,7 +4413,14 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  -v, --verbose             verbose output (default: %s)\n", server_verbose ? "enabled" : "disabled");
     printf("  -t N, --threads N         number of threads to use during computation (default: %d)\n", params.n_threads);
     printf("  -tb N, --threads-batch N  number of threads to use during batch and prompt processing (default: same as --threads)\n");
+#if defined(__linux__)
+    printf("  --threads-http N          number of threads running the http handlers, streams and idle connections don't take one (default: 2)\n");
+#else
     printf("  --threads-http N          number of threads in the http server pool to process requests (default: max(hardware concurrency - 1, --parallel N + 2))\n");
+#endif
+    printf("  --unix-socket PATH        also serve completions on a Unix domain socket, with length-prefixed binary frames (default: disabled)\n");
+    printf("  --shm PATH                deliver the tokens streamed to --unix-socket clients through shared memory rings in this file (Linux only)\n");
+    printf("  --shm-eventfd FD          inherited eventfd signalled after writes to the --shm rings\n");
     printf("  -c N, --ctx-size N        size of the prompt context (default: %d)\n", params.n_ctx);
     printf("  --rope-scaling {none,linear,yarn}\n");
     printf("                            RoPE frequency scaling method, defaults to linear unless specified by the model\n");
@@ -2101,6 +4473,12 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --api-key-file FNAME      path to file containing api keys delimited by new lines. If set, requests must include one of the keys for access.\n");
     printf("  -to N, --timeout N        server read/write timeout in seconds (default: %d)\n", sparams.read_timeout);
     printf("  --embedding               enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
+    printf("  --completion-cache-size N MiB of results kept to replay identical greedy or fixed seed requests, 0 disables it (default: %d)\n", sparams.completion_cache_mb);
+    printf("  --embedding-cache-size N  MiB of embeddings kept for repeated /embedding inputs, 0 disables it (default: %d)\n", sparams.embedding_cache_mb);
+    printf("  --embedding-cache-file PATH\n");
+    printf("                            keep the embedding cache in this file so it survives restarts (default: in memory)\n");
+    printf("  --image-cache-size N      MiB of CLIP embeddings kept for images sent again, 0 disables it (default: %d)\n", sparams.image_cache_mb);
+    printf("  --image-threads N         threads encoding images, beside the ones generating tokens (default: half of --threads)\n");
     printf("  -np N, --parallel N       number of slots for process requests (default: %d)\n", params.n_parallel);
     printf("  -cb, --cont-batching      enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
     printf("  -spf FNAME, --system-prompt-file FNAME\n");
@@ -2349,59 +4727,131 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             }
             params.n_threads_batch = std::stoi(argv[i]);
         }
-        else if (arg == "--threads-http")
+        else if (arg == "--unix-socket")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            sparams.n_threads_http = std::stoi(argv[i]);
+            sparams.unix_socket = argv[i];
         }
-        else if (arg == "-b" || arg == "--batch-size")
+        else if (arg == "--shm")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            params.n_batch = std::stoi(argv[i]);
+            sparams.shm_path = argv[i];
         }
-        else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
+        else if (arg == "--completion-cache-size")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            if (llama_supports_gpu_offload()) {
-                params.n_gpu_layers = std::stoi(argv[i]);
-            } else {
-                LOG_WARNING("Not compiled with GPU offload support, --n-gpu-layers option will be ignored. "
-                        "See main README.md for information on enabling GPU BLAS support",
-                        {{"n_gpu_layers", params.n_gpu_layers}});
-            }
+            sparams.completion_cache_mb = std::stoi(argv[i]);
         }
-        else if (arg == "--split-mode" || arg == "-sm")
+        else if (arg == "--image-threads")
         {
-            if (++i >= argc) {
+            if (++i >= argc)
+            {
                 invalid_param = true;
                 break;
             }
-            std::string arg_next = argv[i];
-            if (arg_next == "none")
-            {
-                params.split_mode = LLAMA_SPLIT_MODE_NONE;
-            }
-            else if (arg_next == "layer")
-            {
-                params.split_mode = LLAMA_SPLIT_MODE_LAYER;
-            }
-            else if (arg_next == "row")
+            sparams.image_threads = std::stoi(argv[i]);
+        }
+        else if (arg == "--image-cache-size")
+        {
+            if (++i >= argc)
             {
-                params.split_mode = LLAMA_SPLIT_MODE_ROW;
-            }
-            else {
+                invalid_param = true;
+                break;
+            }
+            sparams.image_cache_mb = std::stoi(argv[i]);
+        }
+        else if (arg == "--embedding-cache-size")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.embedding_cache_mb = std::stoi(argv[i]);
+        }
+        else if (arg == "--embedding-cache-file")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.embedding_cache_file = argv[i];
+        }
+        else if (arg == "--shm-eventfd")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.shm_eventfd = std::stoi(argv[i]);
+        }
+        else if (arg == "--threads-http")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_threads_http = std::stoi(argv[i]);
+        }
+        else if (arg == "-b" || arg == "--batch-size")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_batch = std::stoi(argv[i]);
+        }
+        else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            if (llama_supports_gpu_offload()) {
+                params.n_gpu_layers = std::stoi(argv[i]);
+            } else {
+                LOG_WARNING("Not compiled with GPU offload support, --n-gpu-layers option will be ignored. "
+                        "See main README.md for information on enabling GPU BLAS support",
+                        {{"n_gpu_layers", params.n_gpu_layers}});
+            }
+        }
+        else if (arg == "--split-mode" || arg == "-sm")
+        {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string arg_next = argv[i];
+            if (arg_next == "none")
+            {
+                params.split_mode = LLAMA_SPLIT_MODE_NONE;
+            }
+            else if (arg_next == "layer")
+            {
+                params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+            }
+            else if (arg_next == "row")
+            {
+                params.split_mode = LLAMA_SPLIT_MODE_ROW;
+            }
+            else {
                 invalid_param = true;
                 break;
             }
@@ -2700,67 +5150,2001 @@ static json format_partial_response(
         {"multimodal", llama.multimodal }
     };
 
-    if (slot->sparams.n_probs > 0)
+    if (slot->sparams.n_probs > 0)
+    {
+        res["completion_probabilities"] = probs_vector_to_json(llama.ctx, probs);
+    }
+
+    return res;
+}
+
+static json format_tokenizer_response(const std::vector<llama_token> &tokens)
+{
+    return json {
+        {"tokens", tokens}
+    };
+}
+
+static json format_detokenized_response(std::string content)
+{
+    return json {
+        {"content", content}
+    };
+}
+
+
+static void log_server_request(const httplib::Request &req, const httplib::Response &res)
+{
+    // skip GH copilot requests when using default port
+    if (req.path == "/v1/health" || req.path == "/v1/completions")
+    {
+        return;
+    }
+
+    LOG_INFO("request", {
+        {"remote_addr", req.remote_addr},
+        {"remote_port", req.remote_port},
+        {"status",      res.status},
+        {"method",      req.method},
+        {"path",        req.path},
+        {"params",      req.params},
+    });
+
+    LOG_VERBOSE("request", {
+        {"request",  req.body},
+        {"response", res.body},
+    });
+}
+
+// bodies of rejected requests up to this size are read and dropped, so the connection can be kept alive
+static const size_t request_drain_max = 1 << 20;
+
+// request bodies and Unix socket request frames above this size are refused
+static const size_t request_body_max = (size_t) 256 << 20;
+
+// an image part reserves at most this much of what is left of the body
+static const size_t multipart_image_reserve_max = 64 << 20;
+
+// Read and drop the body of a request rejected before reading it: httplib keeps the connection alive and would
+// parse what is left of the body as the next request. A body too large to drain is left there, the client is
+// asked to close the connection instead.
+static void drain_request_body(const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader)
+{
+    const size_t content_length = std::strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+    if (content_length > request_drain_max || req.has_header("Transfer-Encoding"))
+    {
+        res.set_header("Connection", "close");
+        return;
+    }
+
+    const auto discard = [](const char *, size_t) { return true; };
+    if (req.is_multipart_form_data())
+    {
+        content_reader([](const httplib::MultipartFormData &) { return true; }, discard);
+    }
+    else
+    {
+        content_reader(discard);
+    }
+}
+
+// Read a /completion or /embedding body into request. Besides json, multipart/form-data is accepted: the part
+// named "json" holds the parameters and every other part is a raw image, received straight into request.images
+// and appended to image_data. A part named img-<id> gets that id for [img-<id>] in the prompt, others their
+// index in image_data. False when the body couldn't be read.
+static bool read_server_request(const httplib::Request &req, const httplib::ContentReader &content_reader, server_request &request, const std::string &prompt_name = "prompt")
+{
+    std::string body;
+    if (!req.is_multipart_form_data())
+    {
+        const bool ok = content_reader([&](const char *data, size_t data_length)
+        {
+            body.append(data, data_length);
+            return true;
+        });
+        return ok && parse_server_request(body, request, prompt_name);
+    }
+
+    // an image part is received into a vector sized for the rest of the body, so it is copied once; the size comes
+    // from the client, so it is capped
+    const size_t content_length = std::strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+    size_t received = 0;
+
+    std::vector<std::pair<int, std::vector<uint8_t>>> images;
+    std::vector<uint8_t> *image = nullptr;
+    bool json_part = false;
+    const bool ok = content_reader(
+        [&](const httplib::MultipartFormData &part)
+        {
+            json_part = part.name == "json";
+            image     = nullptr;
+            if (!json_part)
+            {
+                int id = -1;
+                if (part.name.compare(0, 4, "img-") == 0 && part.name.size() > 4)
+                {
+                    char *end = nullptr;
+                    const long value = std::strtol(part.name.c_str() + 4, &end, 10);
+                    if (*end == '\0' && value >= 0 && value <= INT32_MAX)
+                    {
+                        id = (int) value;
+                    }
+                }
+                images.emplace_back(id, std::vector<uint8_t>());
+                image = &images.back().second;
+                image->reserve(std::min(content_length > received ? content_length - received : 0, multipart_image_reserve_max));
+            }
+            return true;
+        },
+        [&](const char *data, size_t data_length)
+        {
+            received += data_length;
+            if (image != nullptr)
+            {
+                image->insert(image->end(), data, data + data_length);
+            }
+            else if (json_part)
+            {
+                body.append(data, data_length);
+            }
+            return true;
+        });
+    if (!ok || (!body.empty() && !parse_server_request(body, request, prompt_name)))
+    {
+        return false;
+    }
+    if (images.empty())
+    {
+        return true;
+    }
+
+    json &image_data = request.data["image_data"];
+    if (!image_data.is_array())
+    {
+        image_data = json::array();
+    }
+    for (auto &img : images)
+    {
+        const size_t index = image_data.size();
+        image_data.push_back({{"data", ""}, {"id", img.first >= 0 ? img.first : (int) index}});
+        if (request.images.size() <= index)
+        {
+            request.images.resize(index + 1);
+            request.images_decoded.resize(index + 1, false);
+        }
+        request.images[index]         = std::move(img.second);
+        request.images_decoded[index] = true;
+    }
+    return true;
+}
+
+//
+// HTTP endpoints, served by httplib's thread pool, or by server_frontend on Linux
+//
+
+// The part of a response that comes from a task on the server loop: start queues the task, on_result adds one of
+// its results to the response and returns true once it is complete. A streamed response is sent with status 200
+// and content_type before the first result, then what each result appends to the body; any other response is sent
+// as the last on_result leaves it.
+struct http_task
+{
+    int  task_id = -1; // -1 when the handler completed the response itself
+    bool stream  = false;
+    std::string content_type;
+    std::function<void()> start;
+    std::function<bool(const task_result &, httplib::Response &)> on_result;
+};
+
+// A handler runs on an HTTP thread and doesn't wait on the server loop, it hands back a task instead, so the front
+// end decides whether a thread blocks on the results
+typedef std::function<void(const httplib::Request &, httplib::Response &, const httplib::ContentReader &, http_task &)> http_handler;
+
+struct http_route
+{
+    std::string  method;
+    std::string  pattern;
+    bool         reads_content; // the handler reads the body with the ContentReader, otherwise it is in req.body
+    bool         api_key;       // checked before the body is read, the body of a rejected request is dropped
+    bool         immediate;     // the handler only queues a task: on Linux it runs on the front end thread, so the
+                                // health and metrics endpoints don't wait behind the workers
+    http_handler handler;
+};
+
+// content of the responses with an error status
+static void http_error_content(httplib::Response &res)
+{
+    if (res.status == 401)
+    {
+        res.set_content("Unauthorized", "text/plain; charset=utf-8");
+    }
+    if (res.status == 400)
+    {
+        res.set_content("Invalid request", "text/plain; charset=utf-8");
+    }
+    else if (res.status == 404)
+    {
+        res.set_content("File Not Found", "text/plain; charset=utf-8");
+        res.status = 404;
+    }
+}
+
+static void http_exception_content(httplib::Response &res, std::exception_ptr ep)
+{
+    const char fmt[] = "500 Internal Server Error\n%s";
+    char buf[BUFSIZ];
+    try
+    {
+        std::rethrow_exception(std::move(ep));
+    }
+    catch (std::exception &e)
+    {
+        snprintf(buf, sizeof(buf), fmt, e.what());
+    }
+    catch (...)
+    {
+        snprintf(buf, sizeof(buf), fmt, "Unknown Exception");
+    }
+    res.set_content(buf, "text/plain; charset=utf-8");
+    res.status = 500;
+}
+
+// start of the endpoints reporting the state of the slots
+static std::function<void()> http_metrics_task(llama_server_context &llama, int task_id)
+{
+    return [&llama, task_id]()
+    {
+        task_server task;
+        task.id        = task_id;
+        task.type      = TASK_TYPE_METRICS;
+        task.target_id = -1;
+        llama.queue_tasks.post(task);
+    };
+}
+
+#if !defined(__linux__)
+// run the task of a handler on the httplib thread: it blocks on the results, a streamed response is sent with a
+// chunked content provider and closing the connection cancels the task
+static void http_task_wait(llama_server_context &llama, const http_task &task, httplib::Response &res)
+{
+    const int task_id = task.task_id;
+    llama.queue_results.add_waiting_task_id(task_id);
+    task.start();
+    if (!task.stream)
+    {
+        while (!task.on_result(llama.queue_results.recv(task_id), res)) {}
+        llama.queue_results.remove_waiting_task_id(task_id);
+        return;
+    }
+
+    const auto on_result = task.on_result;
+    const auto chunked_content_provider = [task_id, on_result, &llama](size_t, httplib::DataSink &sink)
+    {
+        httplib::Response chunk;
+        bool done = false;
+        while (!done)
+        {
+            chunk.body.clear();
+            done = on_result(llama.queue_results.recv(task_id), chunk);
+            if (!chunk.body.empty() && !sink.write(chunk.body.data(), chunk.body.size()))
+            {
+                return false;
+            }
+        }
+        sink.done();
+        return true;
+    };
+
+    auto on_complete = [task_id, &llama] (bool)
+    {
+        // cancel
+        llama.request_cancel(task_id);
+        llama.queue_results.remove_waiting_task_id(task_id);
+    };
+
+    res.set_chunked_content_provider(task.content_type, chunked_content_provider, on_complete);
+}
+
+// register the routes with httplib, whose pool threads wait for the tasks
+static void http_register(httplib::Server &svr, const std::vector<http_route> &routes, llama_server_context &llama,
+                          const std::function<bool(const httplib::Request &, httplib::Response &)> &validate_api_key)
+{
+    for (const http_route &route : routes)
+    {
+        const http_handler handler = route.handler;
+        const bool reads_content   = route.reads_content;
+        const bool api_key         = route.api_key;
+        const auto with_content = [&llama, validate_api_key, handler, reads_content, api_key](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader)
+        {
+            if (api_key && !validate_api_key(req, res))
+            {
+                if (reads_content)
+                {
+                    drain_request_body(req, res, content_reader);
+                }
+                return;
+            }
+            http_task task;
+            handler(req, res, content_reader, task);
+            if (task.task_id >= 0)
+            {
+                http_task_wait(llama, task, res);
+            }
+        };
+        const auto without_content = [with_content](const httplib::Request &req, httplib::Response &res)
+        {
+            with_content(req, res, httplib::ContentReader(nullptr, nullptr));
+        };
+
+        if (route.method == "GET")
+        {
+            svr.Get(route.pattern, without_content);
+        }
+        else if (route.method == "OPTIONS")
+        {
+            svr.Options(route.pattern, without_content);
+        }
+        else if (reads_content)
+        {
+            svr.Post(route.pattern, with_content);
+        }
+        else
+        {
+            svr.Post(route.pattern, without_content);
+        }
+    }
+}
+#endif
+
+static void append_to_generated_text_from_generated_token_probs(llama_server_context &llama, server_slot *slot)
+{
+    auto & gtps = slot->generated_token_probs;
+    auto translator = token_translator{llama.ctx};
+    auto add_strlen = [=](size_t sum, const completion_token_output & cto) { return sum + translator(cto).size(); };
+    const size_t len = std::accumulate(gtps.begin(), gtps.end(), size_t(0), add_strlen);
+    if (slot->generated_text.capacity() < slot->generated_text.size() + len)
+    {
+        slot->generated_text.reserve(slot->generated_text.size() + len);
+    }
+    for (const completion_token_output & cto : gtps)
+    {
+        slot->generated_text += translator(cto);
+    }
+}
+
+#if !defined(_WIN32)
+//
+// Unix domain socket transport: completion requests only, using the binary framing from utils.hpp
+//
+
+static uint32_t unix_socket_frame_size(const char *header)
+{
+    return (uint8_t) header[0] | (uint8_t) header[1] << 8 | (uint8_t) header[2] << 16 | (uint32_t) (uint8_t) header[3] << 24;
+}
+
+static void unix_socket_append_result(std::string &out, const task_result &result)
+{
+    if (result.error)
+    {
+        binary_append_frame(out, BINARY_FRAME_ERROR, result.result_json.dump(-1, ' ', false, json::error_handler_t::replace));
+    }
+    else if (result.stream_text)
+    {
+        binary_append_token(out, result);
+    }
+    else
+    {
+        binary_append_frame(out, BINARY_FRAME_JSON, result.result_json.dump(-1, ' ', false, json::error_handler_t::replace));
+    }
+}
+
+// turn a request frame into completion data; shm_ring tells whether the client asked for a shared memory ring
+static bool unix_socket_parse(const std::string &payload, server_request &request, bool &shm_ring)
+{
+    json &data = request.data;
+    if (!parse_server_request(payload, request, "prompt", false) || !data.is_object())
+    {
+        return false;
+    }
+    data["stream"] = true;
+    shm_ring = json_value(data, "shm_ring", false);
+    data.erase("shm_ring");
+    return true;
+}
+
+// take the connection's shared memory ring the first time one is asked for, appending its announcement to out
+static void unix_socket_take_ring(llama_server_context &llama, int &shm_ring, uint32_t &shm_ring_gen, std::string &out)
+{
+    if (shm_ring >= 0 || !llama.shm_rings.enabled())
+    {
+        return;
+    }
+    shm_ring = llama.shm_rings.acquire(shm_ring_gen);
+    if (shm_ring >= 0)
+    {
+        binary_append_frame(out, BINARY_FRAME_JSON, json{{"shm_ring", shm_ring}}.dump());
+    }
+}
+
+static void unix_socket_append_invalid(std::string &out)
+{
+    binary_append_frame(out, BINARY_FRAME_ERROR, json{{"content", "invalid request"}}.dump());
+}
+
+static int unix_socket_listen(const std::string &path)
+{
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        LOG_ERROR("unix socket path is too long", {{"path", path}});
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        LOG_ERROR("couldn't bind unix socket", {{"path", path}, {"errno", errno}});
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+#if defined(__linux__)
+//
+// Event driven front end of the HTTP server and the Unix socket
+//
+
+// an HTTP request line and headers above this size are refused
+static const size_t http_head_max = 64 * 1024;
+
+// received bytes buffered while a request runs, reading pauses beyond that until it is done
+static const size_t pipelined_input_max = 1 << 20;
+
+// idle HTTP connections are closed after this long
+static const int64_t http_keep_alive_us = 5 * 1000000;
+
+// request bodies and frames being received or handled on all the connections together, a request above it is
+// refused with 503
+static const size_t request_bodies_max = (size_t) 1 << 30;
+
+// parse the request line and headers of an HTTP/1.x request; head ends with the CRLF of its last line
+static bool http_parse_head(const std::string &head, httplib::Request &req)
+{
+    size_t eol = head.find("\r\n");
+    const size_t sp1 = head.find(' ');
+    const size_t sp2 = sp1 < eol ? head.find(' ', sp1 + 1) : std::string::npos;
+    if (sp2 >= eol || head.find(' ', sp2 + 1) < eol || sp1 == 0 || sp2 == sp1 + 1)
+    {
+        return false;
+    }
+    req.method  = head.substr(0, sp1);
+    req.target  = head.substr(sp1 + 1, sp2 - sp1 - 1);
+    req.version = head.substr(sp2 + 1, eol - sp2 - 1);
+    if (req.version.compare(0, 7, "HTTP/1.") != 0)
+    {
+        return false;
+    }
+
+    for (size_t pos = eol + 2; pos < head.size(); pos = eol + 2)
+    {
+        eol = head.find("\r\n", pos);
+        const size_t colon = head.find(':', pos);
+        if (colon >= eol || colon == pos)
+        {
+            return false;
+        }
+        size_t begin = colon + 1;
+        size_t end   = eol;
+        while (begin < end && (head[begin] == ' ' || head[begin] == '\t'))
+        {
+            ++begin;
+        }
+        while (end > begin && (head[end - 1] == ' ' || head[end - 1] == '\t'))
+        {
+            --end;
+        }
+        req.headers.emplace(head.substr(pos, colon - pos), head.substr(begin, end - begin));
+    }
+
+    const size_t query = req.target.find('?');
+    req.path = httplib::detail::decode_url(req.target.substr(0, query), false);
+    if (query != std::string::npos)
+    {
+        httplib::detail::parse_query_text(req.target.substr(query + 1), req.params);
+    }
+    return true;
+}
+
+// how the body of a request is delimited: 0, or the status the request is refused with. A Transfer-Encoding must
+// be chunked alone and a Content-Length a single number, anything else would let the client and a proxy in front
+// disagree on where the next request starts
+static int http_body_framing(const httplib::Request &req, bool &chunked, size_t &body_size)
+{
+    chunked   = false;
+    body_size = 0;
+    const size_t n_lengths = req.get_header_value_count("Content-Length");
+    const auto codings = req.headers.equal_range("Transfer-Encoding");
+    if (codings.first != codings.second)
+    {
+        if (n_lengths > 0)
+        {
+            return 400;
+        }
+        std::vector<std::string> list;
+        for (auto it = codings.first; it != codings.second; ++it)
+        {
+            const std::string &value = it->second;
+            for (size_t pos = 0; pos <= value.size(); )
+            {
+                size_t end = value.find(',', pos);
+                end = end == std::string::npos ? value.size() : end;
+                const size_t begin = value.find_first_not_of(" \t", pos);
+                if (begin < end)
+                {
+                    list.push_back(value.substr(begin, value.find_last_not_of(" \t", end - 1) + 1 - begin));
+                }
+                pos = end + 1;
+            }
+        }
+        if (list.empty() || strcasecmp(list.back().c_str(), "chunked") != 0)
+        {
+            return 400;
+        }
+        // chunked after a coding the server doesn't decode
+        if (list.size() > 1)
+        {
+            return 501;
+        }
+        chunked = true;
+        return 0;
+    }
+
+    if (n_lengths > 1)
+    {
+        return 400;
+    }
+    if (n_lengths == 1)
+    {
+        const std::string length = req.get_header_value("Content-Length");
+        char *length_end = nullptr;
+        const unsigned long long n = std::strtoull(length.c_str(), &length_end, 10);
+        if (!isdigit((unsigned char) length[0]) || *length_end != '\0')
+        {
+            return 400;
+        }
+        if (n > request_body_max)
+        {
+            return 413;
+        }
+        body_size = n;
+    }
+    return 0;
+}
+
+// move the complete chunks of a chunked body from in to body: 1 once the last one is read, 0 to wait for more,
+// -1 for a malformed body or one above request_body_max
+static int http_read_chunks(std::string &in, std::string &body)
+{
+    while (true)
+    {
+        const size_t eol = in.find("\r\n");
+        if (eol == std::string::npos)
+        {
+            return in.size() > 1024 ? -1 : 0;
+        }
+        if (!isxdigit((unsigned char) in[0]))
+        {
+            return -1;
+        }
+        const unsigned long long size = std::strtoull(in.c_str(), nullptr, 16);
+        if (size == 0)
+        {
+            // the trailers, if any, are dropped
+            const size_t end = in.find("\r\n\r\n", eol);
+            if (end == std::string::npos)
+            {
+                return in.size() > http_head_max ? -1 : 0;
+            }
+            in.erase(0, end + 4);
+            return 1;
+        }
+        if (size > request_body_max - body.size())
+        {
+            return -1;
+        }
+        if (in.size() < eol + 2 + size + 2)
+        {
+            return 0;
+        }
+        if (in.compare(eol + 2 + size, 2, "\r\n") != 0)
+        {
+            return -1;
+        }
+        body.append(in, eol + 2, size);
+        in.erase(0, eol + 2 + size + 2);
+    }
+}
+
+static bool http_keep_alive(const httplib::Request &req, const httplib::Response &res)
+{
+    const std::string connection = req.get_header_value("Connection");
+    if (res.get_header_value("Connection") == "close" || strcasecmp(connection.c_str(), "close") == 0)
+    {
+        return false;
+    }
+    return req.version != "HTTP/1.0" || strcasecmp(connection.c_str(), "keep-alive") == 0;
+}
+
+// how the end of a response body is told: HTTP/1.0 clients don't know chunks, a stream ends with the connection
+enum http_framing
+{
+    HTTP_FRAMING_LENGTH,
+    HTTP_FRAMING_CHUNKED,
+    HTTP_FRAMING_CLOSE,
+};
+
+// status line and headers, with the length of the body when it is framed by it
+static void http_append_head(std::string &out, const httplib::Response &res, bool keep_alive, http_framing framing)
+{
+    out += "HTTP/1.1 ";
+    out += std::to_string(res.status);
+    out += ' ';
+    out += httplib::detail::status_message(res.status);
+    out += "\r\n";
+    if (!res.has_header("Server"))
+    {
+        out += "Server: llama.cpp\r\n";
+    }
+    for (const auto &header : res.headers)
+    {
+        if (header.first != "Connection")
+        {
+            out += header.first;
+            out += ": ";
+            out += header.second;
+            out += "\r\n";
+        }
+    }
+    if (framing == HTTP_FRAMING_CHUNKED)
+    {
+        out += "Transfer-Encoding: chunked\r\n";
+    }
+    else if (framing == HTTP_FRAMING_LENGTH)
+    {
+        out += "Content-Length: " + std::to_string(res.body.size()) + "\r\n";
+    }
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+static void http_append_chunk(std::string &out, const std::string &data)
+{
+    if (data.empty())
+    {
+        return;
+    }
+    char size[24];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    out += size;
+    out += data;
+    out += "\r\n";
+}
+
+// append the whole response, the way httplib's error handler and logger would have seen it; false when the
+// connection closes after it
+static bool http_append_response(std::string &out, const httplib::Request &req, httplib::Response &res)
+{
+    if (res.status >= 400)
+    {
+        http_error_content(res);
+    }
+    const bool keep_alive = http_keep_alive(req, res);
+    http_append_head(out, res, keep_alive, HTTP_FRAMING_LENGTH);
+    if (req.method != "HEAD")
+    {
+        out += res.body;
+    }
+    log_server_request(req, res);
+    return keep_alive;
+}
+
+// the file under base_dir a GET request is for, like httplib's set_base_dir: index.html for a directory. Empty
+// when there is none
+static std::string http_public_file(const std::string &base_dir, const httplib::Request &req)
+{
+    if (base_dir.empty() || (req.method != "GET" && req.method != "HEAD") ||
+        req.path.empty() || req.path[0] != '/' || !httplib::detail::is_valid_path(req.path))
+    {
+        return std::string();
+    }
+    std::string path = base_dir + req.path;
+    if (path.back() == '/')
+    {
+        path += "index.html";
+    }
+    return httplib::detail::is_file(path) ? path : std::string();
+}
+
+static bool http_serve_file(const std::string &base_dir, const httplib::Request &req, httplib::Response &res)
+{
+    const std::string path = http_public_file(base_dir, req);
+    if (path.empty())
+    {
+        return false;
+    }
+    httplib::detail::read_file(path, res.body);
+    const char *type = httplib::detail::find_content_type(path, std::map<std::string, std::string>());
+    if (type != nullptr)
+    {
+        res.set_header("Content-Type", type);
+    }
+    res.status = 200;
+    return true;
+}
+
+// read a buffered multipart/form-data body: each part goes to receiver in one piece straight from body, where
+// httplib's parser would copy it through its own buffer first
+static bool http_read_multipart(const std::string &body, const std::string &boundary,
+                                const httplib::MultipartContentHeader &header, const httplib::ContentReceiver &receiver)
+{
+    static const std::regex re_content_disposition(
+        R"~(^Content-Disposition:\s*form-data;\s*name="(.*?)"(?:;\s*filename="(.*?)")?(?:;\s*filename\*=\S+)?\s*$)~",
+        std::regex_constants::icase);
+    static const char content_type[] = "Content-Type:";
+
+    const std::string delimiter = "\r\n--" + boundary;
+    size_t pos;
+    if (body.compare(0, delimiter.size() - 2, delimiter, 2, std::string::npos) == 0)
+    {
+        pos = delimiter.size() - 2;
+    }
+    else if ((pos = body.find(delimiter)) != std::string::npos)
+    {
+        pos += delimiter.size();
+    }
+    else
+    {
+        return false;
+    }
+
+    while (body.compare(pos, 2, "--") != 0) // the epilogue after the close delimiter is ignored
+    {
+        if (body.compare(pos, 2, "\r\n") != 0)
+        {
+            return false;
+        }
+        pos += 2;
+        const size_t headers_end = body.find("\r\n\r\n", pos - 2);
+        if (headers_end == std::string::npos)
+        {
+            return false;
+        }
+
+        httplib::MultipartFormData part;
+        bool named = false;
+        for (size_t line = pos, eol; line < headers_end; line = eol + 2)
+        {
+            eol = body.find("\r\n", line);
+            const std::string field = body.substr(line, eol - line);
+            std::smatch m;
+            if (strncasecmp(field.c_str(), content_type, sizeof(content_type) - 1) == 0)
+            {
+                part.content_type = httplib::detail::trim_copy(field.substr(sizeof(content_type) - 1));
+            }
+            else if (std::regex_match(field, m, re_content_disposition))
+            {
+                part.name     = m[1];
+                part.filename = m[2];
+                named = true;
+            }
+        }
+
+        const size_t content = headers_end + 4;
+        const size_t end     = body.find(delimiter, content);
+        if (!named || end == std::string::npos || !header(part) || !receiver(body.data() + content, end - content))
+        {
+            return false;
+        }
+        pos = end + delimiter.size();
+    }
+    return true;
+}
+
+// take the first n bytes of in into out, copying whichever of them and the rest of in is smaller: a body that
+// arrived alone isn't copied at all
+static void http_take_front(std::string &in, size_t n, std::string &out)
+{
+    if (n <= in.size() - n)
+    {
+        out.assign(in, 0, n);
+        in.erase(0, n);
+        return;
+    }
+    out.swap(in);
+    in.assign(out, n, std::string::npos);
+    out.resize(n);
+}
+
+// what a worker hands back for a request: bytes to send right away, and the task the rest of the response comes
+// from. start runs on the front end thread, so the task can't outlive its connection unnoticed
+struct frontend_reply
+{
+    std::string out;
+    bool close   = false; // once the response is complete
+    int  task_id = -1;
+    std::function<void()> start;
+    std::function<bool(const task_result &, std::string &)> on_result; // append a result to out, true for the last
+};
+
+// an HTTP request handed to a worker
+struct frontend_http_request
+{
+    httplib::Request  req;
+    std::string       body;
+    const http_route *route    = nullptr;
+    size_t            reserved = 0; // of server_frontend::body_bytes
+};
+
+// a connection of server_frontend
+struct frontend_conn
+{
+    int  fd   = -1;
+    bool http = false; // otherwise the binary framing of the Unix socket
+    std::string remote_addr;
+    int         remote_port = -1;
+
+    std::string in;               // received bytes not parsed yet
+    std::string out;              // bytes not written yet
+    uint32_t    events   = 0;     // armed epoll events
+    bool        busy     = false; // a request is with a worker or running, the next one waits in `in`
+    bool        closing  = false; // closed once out is written
+    int64_t     t_active  = 0;    // last received bytes or completed request
+    int64_t     t_blocked = 0;    // since when out is waiting without progress, 0 when it is empty
+
+    // the running request
+    int  task_id         = -1;
+    bool close_when_done = false;
+    std::function<bool(const task_result &, std::string &)> on_result;
+
+    // the HTTP request whose body is being received
+    bool              head_done = false;
+    httplib::Request  req;
+    const http_route *route     = nullptr;
+    bool              chunked   = false;
+    size_t            body_size = 0;
+    std::string       body;
+    size_t            discard   = 0; // bytes of a rejected body still to drop
+    size_t            body_reserved = 0; // of server_frontend::body_bytes, by the request or frame being received
+
+    int      shm_ring     = -1;
+    uint32_t shm_ring_gen = 0;
+
+    // replies of the workers and results of the loop thread, taken by the front end thread
+    std::mutex mutex;
+    std::vector<frontend_reply> replies;
+    std::vector<task_result>    results;
+    bool queued = false; // in server_frontend::ready
+};
+
+// One thread multiplexes the HTTP and Unix socket connections with epoll, so open streams and idle keep-alive
+// connections don't hold a thread each. Handlers, which tokenize, read images and compile schemas, run on a few
+// workers and hand back the task the response waits on; the front end starts it and the loop thread pushes its
+// results into the connection through a queue_results callback. An eventfd wakes the front end once for all the
+// connections that got something.
+struct server_frontend
+{
+    llama_server_context &llama;
+    const std::vector<http_route> &routes;
+    std::vector<std::regex> patterns; // of routes
+    std::function<bool(const httplib::Request &, httplib::Response &)> validate_api_key;
+    std::string public_path; // empty when not a directory
+    int64_t read_timeout_us  = 0;
+    int64_t write_timeout_us = 0;
+
+    int http_fd  = -1;
+    int unix_fd  = -1;
+    int epoll_fd = -1;
+    int wake_fd  = -1;
+
+    std::unordered_map<int, std::shared_ptr<frontend_conn>> conns; // by fd, front end thread only
+    bool    accept_paused = false; // the listeners are out of epoll after running out of descriptors
+    int64_t t_last_sweep  = 0;
+
+    std::mutex mutex_ready;
+    std::vector<std::shared_ptr<frontend_conn>> ready; // connections with replies or results
+
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    std::atomic<size_t> body_bytes{0}; // reserved against request_bodies_max
+
+    std::mutex mutex_jobs;
+    std::condition_variable condition_jobs;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+
+    server_frontend(llama_server_context &llama, const std::vector<http_route> &routes) : llama(llama), routes(routes) {}
+
+    bool listen_http(const std::string &hostname, int port)
+    {
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        addrinfo *result  = nullptr;
+        if (getaddrinfo(hostname.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+        {
+            return false;
+        }
+        for (addrinfo *ai = result; ai != nullptr && http_fd < 0; ai = ai->ai_next)
+        {
+            const int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0)
+            {
+                continue;
+            }
+            const int yes = 1;
+            const int no  = 0;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (ai->ai_family == AF_INET6)
+            {
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+            }
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            {
+                http_fd = fd;
+            }
+            else
+            {
+                close(fd);
+            }
+        }
+        freeaddrinfo(result);
+        return http_fd >= 0;
+    }
+
+    // routes can't change from here on
+    bool start(int n_workers)
+    {
+        for (const http_route &route : routes)
+        {
+            patterns.emplace_back(route.pattern);
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (epoll_fd < 0 || wake_fd < 0)
+        {
+            LOG_ERROR("couldn't set up the event loop", {{"errno", errno}});
+            return false;
+        }
+        if (unix_fd >= 0)
+        {
+            fcntl(unix_fd, F_SETFL, fcntl(unix_fd, F_GETFL) | O_NONBLOCK);
+        }
+        watch_listeners(true);
+
+        epoll_event ev = {};
+        ev.events  = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+        for (int i = 0; i < n_workers; ++i)
+        {
+            workers.emplace_back(&server_frontend::work, this);
+        }
+        thread = std::thread(&server_frontend::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        stopping = true;
+        wake();
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+        }
+        condition_jobs.notify_all();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+        while (!conns.empty())
+        {
+            const std::shared_ptr<frontend_conn> conn = conns.begin()->second;
+            close_conn(conn);
+        }
+        for (int fd : {http_fd, epoll_fd, wake_fd})
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    void run()
+    {
+        std::vector<epoll_event> events(256);
+        while (!stopping)
+        {
+            // wakes up at least every second to close the connections that timed out
+            const int n = epoll_wait(epoll_fd, events.data(), (int) events.size(), 1000);
+            if (n < 0 && errno != EINTR)
+            {
+                LOG_ERROR("event loop failed", {{"errno", errno}});
+                break;
+            }
+
+            for (int i = 0; i < n; ++i)
+            {
+                const int fd = events[i].data.fd;
+                if (fd == http_fd || fd == unix_fd)
+                {
+                    accept_all(fd);
+                }
+                else if (fd == wake_fd)
+                {
+                    uint64_t count;
+                    while (read(wake_fd, &count, sizeof(count)) > 0) {}
+                    on_wake();
+                }
+                else
+                {
+                    auto it = conns.find(fd);
+                    if (it == conns.end())
+                    {
+                        continue;
+                    }
+                    std::shared_ptr<frontend_conn> conn = it->second;
+                    bool ok;
+                    if (events[i].events & EPOLLIN)
+                    {
+                        ok = on_readable(conn);
+                    }
+                    else
+                    {
+                        // hung up while its input is paused
+                        ok = !(events[i].events & (EPOLLHUP | EPOLLERR));
+                    }
+                    if (!ok || !settle(conn))
+                    {
+                        close_conn(conn);
+                    }
+                }
+            }
+
+            const int64_t now = ggml_time_us();
+            if (now - t_last_sweep >= 1000000)
+            {
+                t_last_sweep = now;
+                sweep(now);
+            }
+        }
+    }
+
+    void watch_listeners(bool watch)
+    {
+        for (int fd : {http_fd, unix_fd})
+        {
+            if (fd < 0)
+            {
+                continue;
+            }
+            epoll_event ev = {};
+            ev.events  = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev);
+        }
+        accept_paused = !watch;
+    }
+
+    void accept_all(int listen_fd)
+    {
+        while (true)
+        {
+            sockaddr_storage addr = {};
+            socklen_t addr_len = sizeof(addr);
+            const int fd = accept4(listen_fd, (sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    // the listeners would stay readable, they are watched again on the next sweep
+                    LOG_ERROR("accept failed", {{"errno", errno}});
+                    watch_listeners(false);
+                }
+                return;
+            }
+
+            std::shared_ptr<frontend_conn> conn = std::make_shared<frontend_conn>();
+            conn->fd       = fd;
+            conn->http     = listen_fd == http_fd;
+            conn->t_active = ggml_time_us();
+            if (conn->http)
+            {
+                const int yes = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+                char host[NI_MAXHOST];
+                char port[NI_MAXSERV];
+                if (getnameinfo((const sockaddr *) &addr, addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+                {
+                    conn->remote_addr = host;
+                    conn->remote_port = atoi(port);
+                }
+            }
+            conns[fd] = conn;
+
+            epoll_event ev = {};
+            ev.events  = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            conn->events = EPOLLIN;
+        }
+    }
+
+    // a client sending ahead of its running request isn't read further until the request is done
+    static bool input_paused(const frontend_conn &conn)
+    {
+        return conn.closing || (conn.busy && conn.in.size() >= pipelined_input_max);
+    }
+
+    bool on_readable(const std::shared_ptr<frontend_conn> &conn)
+    {
+        char buf[64 * 1024];
+        while (!input_paused(*conn))
+        {
+            const ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+            if (n > 0)
+            {
+                conn->in.append(buf, n);
+                conn->t_active = ggml_time_us();
+                // the size limits are checked as the bytes come, not once the socket is drained
+                if (conn->in.size() >= pipelined_input_max && !process_input(conn))
+                {
+                    return false;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return false; // closed by the peer or failed
+        }
+        return true;
+    }
+
+    // start the next request, write what can be written and rearm; false when the connection is to be closed
+    bool settle(const std::shared_ptr<frontend_conn> &conn)
+    {
+        if (!process_input(conn) || !flush(conn) || (conn->closing && conn->out.empty()))
+        {
+            return false;
+        }
+        uint32_t events = conn->out.empty() ? 0 : (uint32_t) EPOLLOUT;
+        if (!input_paused(*conn))
+        {
+            events |= EPOLLIN;
+        }
+        if (events != conn->events)
+        {
+            epoll_event ev = {};
+            ev.events  = events;
+            ev.data.fd = conn->fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+            conn->events = events;
+        }
+        return true;
+    }
+
+    bool process_input(const std::shared_ptr<frontend_conn> &conn)
+    {
+        if (conn->http)
+        {
+            process_http(conn);
+            return true;
+        }
+        return process_frame(conn);
+    }
+
+    // requests sent ahead wait in conn->in until the previous one is done
+    bool process_frame(const std::shared_ptr<frontend_conn> &conn)
+    {
+        if (conn->busy || conn->closing || conn->in.size() < 5)
+        {
+            return true;
+        }
+
+        const uint32_t size = unix_socket_frame_size(conn->in.data());
+        if (size == 0 || size - 1 > request_body_max || conn->in[4] != BINARY_FRAME_REQUEST)
+        {
+            LOG_ERROR("unexpected frame on unix socket", {{"type", (int) conn->in[4]}, {"size", size}});
+            return false;
+        }
+        if (!reserve_body(*conn, size))
+        {
+            binary_append_frame(conn->out, BINARY_FRAME_ERROR, json{{"content", "too many requests in flight"}}.dump());
+            conn->closing = true;
+            return true;
+        }
+        if (conn->in.size() < 4 + (size_t) size)
+        {
+            conn->in.reserve(4 + (size_t) size);
+            return true;
+        }
+
+        std::shared_ptr<std::string> payload = std::make_shared<std::string>();
+        http_take_front(conn->in, 4 + (size_t) size, *payload);
+        payload->erase(0, 5);
+        const size_t reserved = conn->body_reserved;
+        conn->body_reserved = 0;
+        conn->busy = true;
+        post_job([this, conn, payload, reserved]()
+        {
+            handle_frame(conn, *payload);
+            release_body(*payload, reserved);
+        });
+        return true;
+    }
+
+    void process_http(const std::shared_ptr<frontend_conn> &conn)
+    {
+        while (!conn->busy && !conn->closing)
+        {
+            if (conn->discard > 0)
+            {
+                const size_t n = std::min(conn->discard, conn->in.size());
+                conn->in.erase(0, n);
+                conn->discard -= n;
+                if (conn->discard > 0)
+                {
+                    return;
+                }
+            }
+
+            if (!conn->head_done)
+            {
+                const size_t end = conn->in.find("\r\n\r\n");
+                if (end == std::string::npos || end + 4 > http_head_max)
+                {
+                    if (end != std::string::npos || conn->in.size() > http_head_max)
+                    {
+                        refuse(conn, 431);
+                    }
+                    return;
+                }
+
+                httplib::Request req;
+                if (!http_parse_head(conn->in.substr(0, end + 2), req))
+                {
+                    refuse(conn, 400);
+                    return;
+                }
+                conn->in.erase(0, end + 4);
+                req.remote_addr = conn->remote_addr;
+                req.remote_port = conn->remote_port;
+
+                const int status = http_body_framing(req, conn->chunked, conn->body_size);
+                if (status != 0)
+                {
+                    refuse(conn, status);
+                    return;
+                }
+
+                conn->route = find_route(req);
+                httplib::Response res;
+                if (conn->route != nullptr && conn->route->api_key && !validate_api_key(req, res))
+                {
+                    // the body is dropped as it comes, unless it is too large to bother
+                    const bool drain = !conn->chunked && conn->body_size <= request_drain_max;
+                    if (!drain)
+                    {
+                        res.set_header("Connection", "close");
+                    }
+                    if (http_append_response(conn->out, req, res))
+                    {
+                        conn->discard = conn->body_size;
+                    }
+                    else
+                    {
+                        conn->closing = true;
+                    }
+                    continue;
+                }
+
+                if (!reserve_body(*conn, conn->body_size))
+                {
+                    refuse(conn, 503);
+                    return;
+                }
+                if (conn->in.size() < conn->body_size)
+                {
+                    conn->in.reserve(conn->body_size);
+                }
+                if (strcasecmp(req.get_header_value("Expect").c_str(), "100-continue") == 0 &&
+                    (conn->chunked || conn->in.size() < conn->body_size))
+                {
+                    conn->out += "HTTP/1.1 100 Continue\r\n\r\n";
+                }
+                conn->req       = std::move(req);
+                conn->head_done = true;
+                conn->body.clear();
+            }
+
+            if (conn->chunked)
+            {
+                const int status = http_read_chunks(conn->in, conn->body);
+                if (status < 0)
+                {
+                    refuse(conn, conn->body.size() + conn->in.size() > request_body_max ? 413 : 400);
+                    return;
+                }
+                if (!reserve_body(*conn, conn->body.size() + conn->in.size()))
+                {
+                    refuse(conn, 503);
+                    return;
+                }
+                if (status == 0)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                if (conn->in.size() < conn->body_size)
+                {
+                    return;
+                }
+                http_take_front(conn->in, conn->body_size, conn->body);
+            }
+
+            std::shared_ptr<frontend_http_request> request = std::make_shared<frontend_http_request>();
+            request->req      = std::move(conn->req);
+            request->route    = conn->route;
+            request->reserved = conn->body_reserved;
+            request->body.swap(conn->body);
+            conn->req           = httplib::Request();
+            conn->head_done     = false;
+            conn->body_reserved = 0;
+            conn->busy          = true;
+
+            // a 404 and the endpoints that only queue a task are answered here, the rest waits for a worker
+            const http_route *route = request->route;
+            if ((route == nullptr || route->immediate) && http_public_file(public_path, request->req).empty())
+            {
+                handle_http(conn, *request);
+                release_body(request->body, request->reserved);
+                continue;
+            }
+            post_job([this, conn, request]()
+            {
+                handle_http(conn, *request);
+                release_body(request->body, request->reserved);
+            });
+        }
+    }
+
+    // count the bytes of the request or frame being received on conn against request_bodies_max
+    bool reserve_body(frontend_conn &conn, size_t size)
+    {
+        if (size <= conn.body_reserved)
+        {
+            return true;
+        }
+        const size_t more = size - conn.body_reserved;
+        if (body_bytes.fetch_add(more) + more > request_bodies_max)
+        {
+            body_bytes -= more;
+            return false;
+        }
+        conn.body_reserved = size;
+        return true;
+    }
+
+    // once a request or frame is handled
+    void release_body(std::string &body, size_t reserved)
+    {
+        std::string().swap(body);
+        body_bytes -= reserved;
+    }
+
+    // answer a request that can't be read and close the connection
+    void refuse(const std::shared_ptr<frontend_conn> &conn, int status)
+    {
+        httplib::Request req;
+        req.remote_addr = conn->remote_addr;
+        req.remote_port = conn->remote_port;
+        httplib::Response res;
+        res.status = status;
+        res.set_header("Connection", "close");
+        http_append_response(conn->out, req, res);
+        conn->closing = true;
+    }
+
+    const http_route *find_route(const httplib::Request &req) const
+    {
+        const std::string method = req.method == "HEAD" ? "GET" : req.method;
+        for (size_t i = 0; i < routes.size(); ++i)
+        {
+            if (routes[i].method == method && std::regex_match(req.path, patterns[i]))
+            {
+                return &routes[i];
+            }
+        }
+        return nullptr;
+    }
+
+    void post_job(std::function<void()> &&job)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            jobs.push_back(std::move(job));
+        }
+        condition_jobs.notify_one();
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_jobs);
+                condition_jobs.wait(lock, [&]{ return !jobs.empty() || stopping; });
+                if (jobs.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    // on a worker
+    void handle_http(const std::shared_ptr<frontend_conn> &conn, frontend_http_request &request)
+    {
+        httplib::Request &req = request.req;
+        std::shared_ptr<httplib::Response> res = std::make_shared<httplib::Response>();
+        http_task task;
+
+        const std::string &body = request.body;
+        const httplib::ContentReader content_reader(
+            [&body](httplib::ContentReceiver receiver)
+            {
+                return body.empty() || receiver(body.data(), body.size());
+            },
+            [&body, &req](httplib::MultipartContentHeader header, httplib::ContentReceiver receiver)
+            {
+                std::string boundary;
+                if (!httplib::detail::parse_multipart_boundary(req.get_header_value("Content-Type"), boundary))
+                {
+                    return false;
+                }
+                return http_read_multipart(body, boundary, header, receiver);
+            });
+
+        // like httplib, a file of the public path goes before the routes
+        const bool file = http_serve_file(public_path, req, *res);
+        if (!file && request.route == nullptr)
+        {
+            res->status = 404;
+        }
+        else if (!file)
+        {
+            if (!request.route->reads_content)
+            {
+                req.body.swap(request.body);
+            }
+#ifndef CPPHTTPLIB_NO_EXCEPTIONS
+            try
+            {
+                request.route->handler(req, *res, content_reader, task);
+            }
+            catch (...)
+            {
+                *res = httplib::Response();
+                http_exception_content(*res, std::current_exception());
+                task = http_task();
+            }
+#else
+            request.route->handler(req, *res, content_reader, task);
+#endif
+        }
+        if (res->status == -1)
+        {
+            res->status = 200;
+        }
+
+        frontend_reply reply;
+        if (task.task_id < 0)
+        {
+            reply.close = !http_append_response(reply.out, req, *res);
+            deliver(conn, std::move(reply));
+            return;
+        }
+
+        // a stream to an HTTP/1.0 client isn't chunked, it ends when the connection closes
+        const bool chunked    = req.version != "HTTP/1.0";
+        const bool keep_alive = (chunked || !task.stream) && http_keep_alive(req, *res);
+        reply.close   = !keep_alive;
+        reply.task_id = task.task_id;
+        reply.start   = task.start;
+
+        std::shared_ptr<httplib::Request> done_req = std::make_shared<httplib::Request>(std::move(req));
+        const auto on_result = task.on_result;
+        if (task.stream)
+        {
+            res->set_header("Content-Type", task.content_type);
+            http_append_head(reply.out, *res, keep_alive, chunked ? HTTP_FRAMING_CHUNKED : HTTP_FRAMING_CLOSE);
+            reply.on_result = [done_req, res, on_result, chunked](const task_result &result, std::string &out)
+            {
+                res->body.clear();
+                const bool done = on_result(result, *res);
+                if (!chunked)
+                {
+                    out += res->body;
+                }
+                else
+                {
+                    http_append_chunk(out, res->body);
+                }
+                if (done)
+                {
+                    if (chunked)
+                    {
+                        out += "0\r\n\r\n";
+                    }
+                    res->body.clear();
+                    log_server_request(*done_req, *res);
+                }
+                return done;
+            };
+        }
+        else
+        {
+            reply.on_result = [done_req, res, on_result](const task_result &result, std::string &out)
+            {
+                if (!on_result(result, *res))
+                {
+                    return false;
+                }
+                http_append_response(out, *done_req, *res);
+                return true;
+            };
+        }
+        deliver(conn, std::move(reply));
+    }
+
+    // on a worker
+    void handle_frame(const std::shared_ptr<frontend_conn> &conn, const std::string &payload)
+    {
+        frontend_reply reply;
+        std::shared_ptr<server_request> request = std::make_shared<server_request>();
+        bool want_ring = false;
+        if (!unix_socket_parse(payload, *request, want_ring))
+        {
+            unix_socket_append_invalid(reply.out);
+            reply.close = true;
+            deliver(conn, std::move(reply));
+            return;
+        }
+        llama.compile_json_schema(*request);
+
+        const int task_id = llama.queue_tasks.get_new_id();
+        reply.task_id = task_id;
+        reply.start = [this, conn, request, want_ring, task_id]()
+        {
+            if (want_ring)
+            {
+                unix_socket_take_ring(llama, conn->shm_ring, conn->shm_ring_gen, conn->out);
+            }
+            llama.request_completion(task_id, std::move(*request), false, false, conn->shm_ring, conn->shm_ring_gen);
+        };
+        reply.on_result = [](const task_result &result, std::string &out)
+        {
+            unix_socket_append_result(out, result);
+            return result.error || result.stop;
+        };
+        deliver(conn, std::move(reply));
+    }
+
+    // called by the workers
+    void deliver(const std::shared_ptr<frontend_conn> &conn, frontend_reply &&reply)
+    {
+        std::unique_lock<std::mutex> lock(conn->mutex);
+        conn->replies.push_back(std::move(reply));
+        enqueue(conn);
+    }
+
+    // called by the loop thread
+    void push(const std::shared_ptr<frontend_conn> &conn, task_result &&result)
+    {
+        std::unique_lock<std::mutex> lock(conn->mutex);
+        conn->results.push_back(std::move(result));
+        enqueue(conn);
+    }
+
+    // with conn->mutex held
+    void enqueue(const std::shared_ptr<frontend_conn> &conn)
+    {
+        if (conn->queued)
+        {
+            return;
+        }
+        conn->queued = true;
+
+        bool first;
+        {
+            std::unique_lock<std::mutex> lock(mutex_ready);
+            first = ready.empty();
+            ready.push_back(conn);
+        }
+        if (first)
+        {
+            wake();
+        }
+    }
+
+    void wake()
+    {
+        const uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            LOG_ERROR("couldn't wake the event loop", {{"errno", errno}});
+        }
+    }
+
+    void on_wake()
+    {
+        std::vector<std::shared_ptr<frontend_conn>> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_ready);
+            batch.swap(ready);
+        }
+
+        std::vector<frontend_reply> replies;
+        std::vector<task_result> results;
+        for (const std::shared_ptr<frontend_conn> &conn : batch)
+        {
+            replies.clear();
+            results.clear();
+            {
+                std::unique_lock<std::mutex> lock(conn->mutex);
+                replies.swap(conn->replies);
+                results.swap(conn->results);
+                conn->queued = false;
+            }
+            if (conn->fd < 0)
+            {
+                continue; // closed in the meantime
+            }
+
+            for (frontend_reply &reply : replies)
+            {
+                start_reply(conn, reply);
+            }
+            for (const task_result &result : results)
+            {
+                if (conn->task_id >= 0 && result.id == conn->task_id && conn->on_result(result, conn->out))
+                {
+                    finish_request(conn);
+                }
+            }
+
+            if (!settle(conn))
+            {
+                close_conn(conn);
+            }
+        }
+    }
+
+    void start_reply(const std::shared_ptr<frontend_conn> &conn, frontend_reply &reply)
+    {
+        conn->out += reply.out;
+        if (reply.task_id < 0)
+        {
+            conn->busy     = false;
+            conn->closing  = conn->closing || reply.close;
+            conn->t_active = ggml_time_us();
+            return;
+        }
+
+        const int task_id = reply.task_id;
+        conn->task_id         = task_id;
+        conn->close_when_done = reply.close;
+        conn->on_result       = std::move(reply.on_result);
+        // the waiting id lets a multi-prompt request gather its subtasks, its combined result goes to the callback
+        llama.queue_results.add_waiting_task_id(task_id);
+        llama.queue_results.add_task_callback(task_id, [this, conn](task_result &&result) {
+            push(conn, std::move(result));
+        });
+        reply.start();
+    }
+
+    void finish_request(const std::shared_ptr<frontend_conn> &conn)
+    {
+        llama.queue_results.remove_task_callback(conn->task_id);
+        llama.queue_results.remove_waiting_task_id(conn->task_id);
+        conn->task_id   = -1;
+        conn->on_result = nullptr;
+        conn->busy      = false;
+        conn->closing   = conn->closing || conn->close_when_done;
+        conn->t_active  = ggml_time_us();
+    }
+
+    bool flush(const std::shared_ptr<frontend_conn> &conn)
+    {
+        size_t off = 0;
+        while (off < conn->out.size())
+        {
+            const ssize_t n = send(conn->fd, conn->out.data() + off, conn->out.size() - off, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                off += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return false;
+        }
+        conn->out.erase(0, off);
+
+        if (conn->out.empty())
+        {
+            conn->t_blocked = 0;
+        }
+        else if (off > 0 || conn->t_blocked == 0)
+        {
+            conn->t_blocked = ggml_time_us();
+        }
+        return true;
+    }
+
+    // a connection whose client stopped reading, or stopped sending in the middle of a request or, for HTTP, is
+    // idle for too long
+    bool expired(const frontend_conn &conn, int64_t now) const
+    {
+        if (conn.t_blocked > 0)
+        {
+            return now - conn.t_blocked > write_timeout_us;
+        }
+        if (conn.busy)
+        {
+            return false;
+        }
+        if (!conn.in.empty() || conn.head_done || conn.discard > 0)
+        {
+            return now - conn.t_active > read_timeout_us;
+        }
+        return conn.http && now - conn.t_active > http_keep_alive_us;
+    }
+
+    void sweep(int64_t now)
+    {
+        if (accept_paused)
+        {
+            watch_listeners(true);
+        }
+
+        std::vector<std::shared_ptr<frontend_conn>> expired_conns;
+        for (const auto &it : conns)
+        {
+            if (expired(*it.second, now))
+            {
+                expired_conns.push_back(it.second);
+            }
+        }
+        for (const std::shared_ptr<frontend_conn> &conn : expired_conns)
+        {
+            close_conn(conn);
+        }
+    }
+
+    void close_conn(const std::shared_ptr<frontend_conn> &conn)
+    {
+        if (conn->fd < 0)
+        {
+            return;
+        }
+        if (conn->task_id >= 0)
+        {
+            llama.request_cancel(conn->task_id);
+            finish_request(conn);
+        }
+        if (conn->shm_ring >= 0)
+        {
+            llama.shm_rings.release(conn->shm_ring);
+            conn->shm_ring = -1;
+        }
+        body_bytes -= conn->body_reserved;
+        conn->body_reserved = 0;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        close(conn->fd);
+        conns.erase(conn->fd);
+        conn->fd = -1;
+    }
+};
+#endif
+
+#if !defined(__linux__)
+// without epoll, every connection gets a thread that blocks on its results
+
+static bool unix_socket_read(int fd, char *buf, size_t size)
+{
+    while (size > 0)
     {
-        res["completion_probabilities"] = probs_vector_to_json(llama.ctx, probs);
+        const ssize_t n = recv(fd, buf, size, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        buf  += n;
+        size -= n;
     }
-
-    return res;
+    return true;
 }
 
-static json format_tokenizer_response(const std::vector<llama_token> &tokens)
+static bool unix_socket_write(int fd, const std::string &data)
 {
-    return json {
-        {"tokens", tokens}
-    };
+#if defined(MSG_NOSIGNAL)
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    size_t off = 0;
+    while (off < data.size())
+    {
+        const ssize_t n = send(fd, data.data() + off, data.size() - off, flags);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        off += n;
+    }
+    return true;
 }
 
-static json format_detokenized_response(std::string content)
+// serve the requests of one connection one after the other, until the peer closes it
+// closing the connection while a request is running cancels it
+static void unix_socket_connection(llama_server_context &llama, int fd)
 {
-    return json {
-        {"content", content}
-    };
-}
+    // reused for every frame of this connection
+    std::string frame;
+    frame.reserve(256);
+    std::string payload;
 
+    // shared memory ring of this connection, taken on the first request asking for one
+    int      shm_ring     = -1;
+    uint32_t shm_ring_gen = 0;
 
-static void log_server_request(const httplib::Request &req, const httplib::Response &res)
-{
-    // skip GH copilot requests when using default port
-    if (req.path == "/v1/health" || req.path == "/v1/completions")
+    while (true)
     {
-        return;
-    }
+        char header[5];
+        if (!unix_socket_read(fd, header, sizeof(header)))
+        {
+            break;
+        }
+        const uint32_t size = unix_socket_frame_size(header);
+        if (size == 0 || size - 1 > request_body_max || header[4] != BINARY_FRAME_REQUEST)
+        {
+            LOG_ERROR("unexpected frame on unix socket", {{"type", (int) header[4]}, {"size", size}});
+            break;
+        }
+        payload.resize(size - 1);
+        if (!unix_socket_read(fd, &payload[0], payload.size()))
+        {
+            break;
+        }
 
-    LOG_INFO("request", {
-        {"remote_addr", req.remote_addr},
-        {"remote_port", req.remote_port},
-        {"status",      res.status},
-        {"method",      req.method},
-        {"path",        req.path},
-        {"params",      req.params},
-    });
+        server_request request;
+        bool want_ring = false;
+        frame.clear();
+        const bool valid = unix_socket_parse(payload, request, want_ring);
+        if (!valid)
+        {
+            unix_socket_append_invalid(frame);
+        }
+        else if (want_ring)
+        {
+            unix_socket_take_ring(llama, shm_ring, shm_ring_gen, frame);
+        }
+        if (!unix_socket_write(fd, frame) || !valid)
+        {
+            break;
+        }
 
-    LOG_VERBOSE("request", {
-        {"request",  req.body},
-        {"response", res.body},
-    });
-}
+        const int task_id = llama.queue_tasks.get_new_id();
+        llama.queue_results.add_waiting_task_id(task_id);
+        llama.request_completion(task_id, std::move(request), false, false, shm_ring, shm_ring_gen);
 
-static void append_to_generated_text_from_generated_token_probs(llama_server_context &llama, server_slot *slot)
-{
-    auto & gtps = slot->generated_token_probs;
-    auto translator = token_translator{llama.ctx};
-    auto add_strlen = [=](size_t sum, const completion_token_output & cto) { return sum + translator(cto).size(); };
-    const size_t len = std::accumulate(gtps.begin(), gtps.end(), size_t(0), add_strlen);
-    if (slot->generated_text.capacity() < slot->generated_text.size() + len)
+        bool connected = true;
+        while (true)
+        {
+            task_result result = llama.queue_results.recv(task_id);
+            frame.clear();
+            unix_socket_append_result(frame, result);
+
+            if (!unix_socket_write(fd, frame))
+            {
+                llama.request_cancel(task_id);
+                connected = false;
+                break;
+            }
+            if (result.error || result.stop)
+            {
+                break;
+            }
+        }
+        llama.queue_results.remove_waiting_task_id(task_id);
+
+        if (!connected)
+        {
+            break;
+        }
+    }
+
+    if (shm_ring >= 0)
     {
-        slot->generated_text.reserve(slot->generated_text.size() + len);
+        llama.shm_rings.release(shm_ring);
     }
-    for (const completion_token_output & cto : gtps)
+    close(fd);
+}
+
+static void unix_socket_serve(llama_server_context &llama, int listen_fd)
+{
+    while (true)
     {
-        slot->generated_text += translator(cto);
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        std::thread(unix_socket_connection, std::ref(llama), fd).detach();
     }
 }
+#endif
+#endif
 
 std::function<void(int)> shutdown_handler;
 std::atomic_flag is_terminating = ATOMIC_FLAG_INIT;
@@ -2826,56 +7210,51 @@ int main(int argc, char **argv) {
                                 {"system_info", llama_print_system_info()},
                             });
 
-    httplib::Server svr;
-
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
 
-    svr.set_default_headers({{"Server", "llama.cpp"}});
+    // the endpoints, served by server_frontend on Linux and by httplib's thread pool elsewhere
+    std::vector<http_route> routes;
 
     // CORS preflight
-    svr.Options(R"(.*)", [](const httplib::Request &req, httplib::Response &res) {
+    routes.push_back({"OPTIONS", R"(.*)", false, false, true, [](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &, http_task &) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         res.set_header("Access-Control-Allow-Credentials", "true");
         res.set_header("Access-Control-Allow-Methods", "POST");
         res.set_header("Access-Control-Allow-Headers", "*");
-    });
+    }});
 
-    svr.Get("/health", [&](const httplib::Request& req, httplib::Response& res) {
+    routes.push_back({"GET", "/health", false, false, true, [&](const httplib::Request& req, httplib::Response& res, const httplib::ContentReader &, http_task &task) {
         server_state current_state = state.load();
         switch(current_state) {
             case SERVER_STATE_READY: {
                 // request slots data using task queue
-                task_server task;
-                task.id   = llama.queue_tasks.get_new_id();
-                task.type = TASK_TYPE_METRICS;
-                task.target_id = -1;
-
-                llama.queue_results.add_waiting_task_id(task.id);
-                llama.queue_tasks.post(task);
-
-                // get the result
-                task_result result = llama.queue_results.recv(task.id);
-                llama.queue_results.remove_waiting_task_id(task.id);
-
-                int n_idle_slots       = result.result_json["idle"];
-                int n_processing_slots = result.result_json["processing"];
-
-                json health = {
-                        {"status",           "ok"},
-                        {"slots_idle",       n_idle_slots},
-                        {"slots_processing", n_processing_slots}};
-                res.status = 200; // HTTP OK
-                if (sparams.slots_endpoint && req.has_param("include_slots")) {
-                    health["slots"] = result.result_json["slots"];
-                }
+                task.task_id = llama.queue_tasks.get_new_id();
+                task.start   = http_metrics_task(llama, task.task_id);
+
+                const bool include_slots   = sparams.slots_endpoint && req.has_param("include_slots");
+                const bool fail_on_no_slot = req.has_param("fail_on_no_slot");
+                task.on_result = [include_slots, fail_on_no_slot](const task_result &result, httplib::Response &res) {
+                    int n_idle_slots       = result.result_json["idle"];
+                    int n_processing_slots = result.result_json["processing"];
+
+                    json health = {
+                            {"status",           "ok"},
+                            {"slots_idle",       n_idle_slots},
+                            {"slots_processing", n_processing_slots}};
+                    res.status = 200; // HTTP OK
+                    if (include_slots) {
+                        health["slots"] = result.result_json["slots"];
+                    }
 
-                if (n_idle_slots == 0) {
-                    health["status"] = "no slot available";
-                    if (req.has_param("fail_on_no_slot")) {
-                        res.status = 503; // HTTP Service Unavailable
+                    if (n_idle_slots == 0) {
+                        health["status"] = "no slot available";
+                        if (fail_on_no_slot) {
+                            res.status = 503; // HTTP Service Unavailable
+                        }
                     }
-                }
-                res.set_content(health.dump(), "application/json");
+                    res.set_content(health.dump(), "application/json");
+                    return true;
+                };
                 break;
             }
             case SERVER_STATE_LOADING_MODEL:
@@ -2887,152 +7266,203 @@ int main(int argc, char **argv) {
                 res.status = 500; // HTTP Internal Server Error
                 break;
         }
-    });
+    }});
 
     if (sparams.slots_endpoint) {
-        svr.Get("/slots", [&](const httplib::Request&, httplib::Response& res) {
+        routes.push_back({"GET", "/slots", false, false, true, [&](const httplib::Request&, httplib::Response&, const httplib::ContentReader &, http_task &task) {
             // request slots data using task queue
-            task_server task;
-            task.id = llama.queue_tasks.get_new_id();
-            task.type = TASK_TYPE_METRICS;
-            task.target_id = -1;
-
-            llama.queue_results.add_waiting_task_id(task.id);
-            llama.queue_tasks.post(task);
-
-            // get the result
-            task_result result = llama.queue_results.recv(task.id);
-            llama.queue_results.remove_waiting_task_id(task.id);
-
-            res.set_content(result.result_json["slots"].dump(), "application/json");
-            res.status = 200; // HTTP OK
-        });
+            task.task_id   = llama.queue_tasks.get_new_id();
+            task.start     = http_metrics_task(llama, task.task_id);
+            task.on_result = [](const task_result &result, httplib::Response &res) {
+                res.set_content(result.result_json["slots"].dump(), "application/json");
+                res.status = 200; // HTTP OK
+                return true;
+            };
+        }});
     }
 
     if (sparams.metrics_endpoint) {
-        svr.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
+        routes.push_back({"GET", "/metrics", false, false, true, [&](const httplib::Request&, httplib::Response&, const httplib::ContentReader &, http_task &task) {
             // request slots data using task queue
-            task_server task;
-            task.id = llama.queue_tasks.get_new_id();
-            task.type = TASK_TYPE_METRICS;
-            task.target_id = -1;
+            task.task_id = llama.queue_tasks.get_new_id();
+            task.start   = http_metrics_task(llama, task.task_id);
+
+            const int32_t n_ctx = params.n_ctx;
+            task.on_result = [n_ctx](const task_result &result, httplib::Response &res) {
+                json data = result.result_json;
+
+                uint64_t n_prompt_tokens_processed = data["n_prompt_tokens_processed"];
+                uint64_t t_prompt_processing       = data["t_prompt_processing"];
+
+                uint64_t n_tokens_predicted       = data["n_tokens_predicted"];
+                uint64_t t_tokens_generation      = data["t_tokens_generation"];
+
+                int32_t kv_cache_used_cells = data["kv_cache_used_cells"];
+
+                uint64_t n_grammar_cache_hits   = data["n_grammar_cache_hits"];
+                uint64_t n_grammar_cache_misses = data["n_grammar_cache_misses"];
+                double   t_grammar_parse        = data["t_grammar_parse"];
+
+                uint64_t n_completion_cache_hits   = data["n_completion_cache_hits"];
+                uint64_t n_completion_cache_misses = data["n_completion_cache_misses"];
+
+                uint64_t n_image_cache_hits   = data["n_image_cache_hits"];
+                uint64_t n_image_cache_misses = data["n_image_cache_misses"];
+
+                uint64_t n_embedding_cache_hits   = data["n_embedding_cache_hits"];
+                uint64_t n_embedding_cache_misses = data["n_embedding_cache_misses"];
+
+                // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
+                json all_metrics_def = json {
+                        {"counter", {{
+                                {"name",  "prompt_tokens_total"},
+                                {"help",  "Number of prompt tokens processed."},
+                                {"value",  data["n_prompt_tokens_processed_total"]}
+                        }, {
+                                {"name",  "tokens_predicted_total"},
+                                {"help",  "Number of generation tokens processed."},
+                                {"value",  data["n_tokens_predicted_total"]}
+                        }, {
+                                {"name",  "grammar_cache_hits_total"},
+                                {"help",  "Number of requests whose grammar was already compiled."},
+                                {"value",  n_grammar_cache_hits}
+                        }, {
+                                {"name",  "grammar_cache_misses_total"},
+                                {"help",  "Number of grammars parsed and compiled."},
+                                {"value",  n_grammar_cache_misses}
+                        }, {
+                                {"name",  "grammar_parse_seconds_total"},
+                                {"help",  "Time spent parsing and compiling grammars."},
+                                {"value",  t_grammar_parse / 1e3}
+                        }, {
+                                {"name",  "requests_deduplicated_total"},
+                                {"help",  "Number of requests that followed an identical running request instead of being processed."},
+                                {"value",  data["n_deduplicated"]}
+                        }, {
+                                {"name",  "completion_cache_hits_total"},
+                                {"help",  "Number of deterministic completions replayed from the completion cache."},
+                                {"value",  n_completion_cache_hits}
+                        }, {
+                                {"name",  "completion_cache_misses_total"},
+                                {"help",  "Number of deterministic completions that had to be generated."},
+                                {"value",  n_completion_cache_misses}
+                        }, {
+                                {"name",  "image_cache_hits_total"},
+                                {"help",  "Number of images whose CLIP embedding was found in the image cache."},
+                                {"value",  n_image_cache_hits}
+                        }, {
+                                {"name",  "image_cache_misses_total"},
+                                {"help",  "Number of images that had to be loaded and encoded with CLIP."},
+                                {"value",  n_image_cache_misses}
+                        }, {
+                                {"name",  "embedding_cache_hits_total"},
+                                {"help",  "Number of embedding inputs answered from the embedding cache."},
+                                {"value",  n_embedding_cache_hits}
+                        }, {
+                                {"name",  "embedding_cache_misses_total"},
+                                {"help",  "Number of embedding inputs that had to be decoded."},
+                                {"value",  n_embedding_cache_misses}
+                        }}},
+                        {"gauge", {{
+                                {"name",  "prompt_tokens_seconds"},
+                                {"help",  "Average prompt throughput in tokens/s."},
+                                {"value",  n_prompt_tokens_processed ? 1e3 / t_prompt_processing * n_prompt_tokens_processed : 0}
+                        },{
+                                {"name",  "predicted_tokens_seconds"},
+                                {"help",  "Average generation throughput in tokens/s."},
+                                {"value",  n_tokens_predicted ? 1e3 / t_tokens_generation * n_tokens_predicted : 0}
+                         },{
+                                {"name",  "kv_cache_usage_ratio"},
+                                {"help",  "KV-cache usage. 1 means 100 percent usage."},
+                                {"value",  1. * kv_cache_used_cells / n_ctx}
+                         },{
+                                {"name",  "kv_cache_tokens"},
+                                {"help",  "KV-cache tokens."},
+                                {"value",  data["kv_cache_tokens_count"]}
+                        },{
+                                {"name",  "requests_processing"},
+                                {"help",  "Number of request processing."},
+                                {"value",  data["processing"]}
+                      },{
+                                {"name",  "requests_deferred"},
+                                {"help",  "Number of request deferred."},
+                                {"value",  data["deferred"]}
+                      },{
+                                {"name",  "grammar_cache_hit_ratio"},
+                                {"help",  "Share of grammar requests served from the compiled grammar cache."},
+                                {"value",  n_grammar_cache_hits + n_grammar_cache_misses ? 1. * n_grammar_cache_hits / (n_grammar_cache_hits + n_grammar_cache_misses) : 0}
+                      },{
+                                {"name",  "embedding_cache_hit_ratio"},
+                                {"help",  "Share of embedding inputs served from the embedding cache."},
+                                {"value",  n_embedding_cache_hits + n_embedding_cache_misses ? 1. * n_embedding_cache_hits / (n_embedding_cache_hits + n_embedding_cache_misses) : 0}
+                      }}}
+                };
+
+                std::stringstream prometheus;
+                for (const auto& el : all_metrics_def.items()) {
+                    const auto& type = el.key();
+                    const auto& metrics_def = el.value();
+                    for (const auto& metric_def : metrics_def) {
+                        std::string name = metric_def["name"];
+                        std::string help = metric_def["help"];
+                        // counters are written as integers, ratios and seconds as the shortest double that round-trips
+                        const json &value = metric_def.at("value");
+                        std::string text = "0";
+                        if (value.is_number_float() && !std::isfinite(value.get<double>())) {
+                            text = std::isnan(value.get<double>()) ? "NaN" : value.get<double>() > 0 ? "+Inf" : "-Inf";
+                        } else if (value.is_number()) {
+                            text = value.dump();
+                        }
+                        prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
+                                   << "# TYPE llamacpp:" << name << " " << type  << "\n"
+                                   << "llamacpp:"        << name << " " << text  << "\n";
+                    }
+                }
 
-            llama.queue_results.add_waiting_task_id(task.id);
-            llama.queue_tasks.post(task);
-
-            // get the result
-            task_result result = llama.queue_results.recv(task.id);
-            llama.queue_results.remove_waiting_task_id(task.id);
-
-            json data = result.result_json;
-
-            uint64_t n_prompt_tokens_processed = data["n_prompt_tokens_processed"];
-            uint64_t t_prompt_processing       = data["t_prompt_processing"];
-
-            uint64_t n_tokens_predicted       = data["n_tokens_predicted"];
-            uint64_t t_tokens_generation      = data["t_tokens_generation"];
-
-            int32_t kv_cache_used_cells = data["kv_cache_used_cells"];
-
-            // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
-            json all_metrics_def = json {
-                    {"counter", {{
-                            {"name",  "prompt_tokens_total"},
-                            {"help",  "Number of prompt tokens processed."},
-                            {"value",  data["n_prompt_tokens_processed_total"]}
-                    }, {
-                            {"name",  "tokens_predicted_total"},
-                            {"help",  "Number of generation tokens processed."},
-                            {"value",  data["n_tokens_predicted_total"]}
-                    }}},
-                    {"gauge", {{
-                            {"name",  "prompt_tokens_seconds"},
-                            {"help",  "Average prompt throughput in tokens/s."},
-                            {"value",  n_prompt_tokens_processed ? 1e3 / t_prompt_processing * n_prompt_tokens_processed : 0}
-                    },{
-                            {"name",  "predicted_tokens_seconds"},
-                            {"help",  "Average generation throughput in tokens/s."},
-                            {"value",  n_tokens_predicted ? 1e3 / t_tokens_generation * n_tokens_predicted : 0}
-                     },{
-                            {"name",  "kv_cache_usage_ratio"},
-                            {"help",  "KV-cache usage. 1 means 100 percent usage."},
-                            {"value",  1. * kv_cache_used_cells / params.n_ctx}
-                     },{
-                            {"name",  "kv_cache_tokens"},
-                            {"help",  "KV-cache tokens."},
-                            {"value",  data["kv_cache_tokens_count"]}
-                    },{
-                            {"name",  "requests_processing"},
-                            {"help",  "Number of request processing."},
-                            {"value",  data["processing"]}
-                  },{
-                            {"name",  "requests_deferred"},
-                            {"help",  "Number of request deferred."},
-                            {"value",  data["deferred"]}
-                  }}}
+                res.set_content(prometheus.str(), "text/plain; version=0.0.4");
+                res.status = 200; // HTTP OK
+                return true;
             };
+        }});
+    }
 
-            std::stringstream prometheus;
-            for (const auto& el : all_metrics_def.items()) {
-                const auto& type = el.key();
-                const auto& metrics_def = el.value();
-                for (const auto& metric_def : metrics_def) {
-                    std::string name = metric_def["name"];
-                    std::string help = metric_def["help"];
-                    auto value = json_value(metric_def, "value", 0);
-                    prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                               << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                               << "llamacpp:"        << name << " " << value << "\n";
-                }
-            }
+#if defined(__linux__)
+    server_frontend frontend(llama, routes);
+    frontend.read_timeout_us  = (int64_t) sparams.read_timeout  * 1000000;
+    frontend.write_timeout_us = (int64_t) sparams.write_timeout * 1000000;
 
-            res.set_content(prometheus.str(), "text/plain; version=0.0.4");
-            res.status = 200; // HTTP OK
-        });
+    if (!frontend.listen_http(sparams.hostname, sparams.port))
+    {
+        fprintf(stderr, "\ncouldn't bind to server socket: hostname=%s port=%d\n\n", sparams.hostname.c_str(), sparams.port);
+        return 1;
+    }
+
+    // Set the base directory for serving static files
+    if (httplib::detail::is_dir(sparams.public_path))
+    {
+        frontend.public_path = sparams.public_path;
     }
+#else
+    httplib::Server svr;
+
+    svr.set_default_headers({{"Server", "llama.cpp"}});
 
     svr.set_logger(log_server_request);
 
     svr.set_exception_handler([](const httplib::Request &, httplib::Response &res, std::exception_ptr ep)
             {
-                const char fmt[] = "500 Internal Server Error\n%s";
-                char buf[BUFSIZ];
-                try
-                {
-                    std::rethrow_exception(std::move(ep));
-                }
-                catch (std::exception &e)
-                {
-                    snprintf(buf, sizeof(buf), fmt, e.what());
-                }
-                catch (...)
-                {
-                    snprintf(buf, sizeof(buf), fmt, "Unknown Exception");
-                }
-                res.set_content(buf, "text/plain; charset=utf-8");
-                res.status = 500;
+                http_exception_content(res, std::move(ep));
             });
 
     svr.set_error_handler([](const httplib::Request &, httplib::Response &res)
             {
-                if (res.status == 401)
-                {
-                    res.set_content("Unauthorized", "text/plain; charset=utf-8");
-                }
-                if (res.status == 400)
-                {
-                    res.set_content("Invalid request", "text/plain; charset=utf-8");
-                }
-                else if (res.status == 404)
-                {
-                    res.set_content("File Not Found", "text/plain; charset=utf-8");
-                    res.status = 404;
-                }
+                http_error_content(res);
             });
 
     // set timeouts and change hostname and port
     svr.set_read_timeout (sparams.read_timeout);
     svr.set_write_timeout(sparams.write_timeout);
+    svr.set_payload_max_length(request_body_max);
 
     if (!svr.bind_to_port(sparams.hostname, sparams.port))
     {
@@ -3042,6 +7472,7 @@ int main(int argc, char **argv) {
 
     // Set the base directory for serving static files
     svr.set_base_dir(sparams.public_path);
+#endif
 
     std::unordered_map<std::string, std::string> log_data;
     log_data["hostname"] = sparams.hostname;
@@ -3063,6 +7494,22 @@ int main(int argc, char **argv) {
         state.store(SERVER_STATE_READY);
         LOG_INFO("model loaded", {});
     }
+
+    llama.completions.n_bytes_max      = (size_t) std::max(sparams.completion_cache_mb, 0) << 20;
+    llama.image_embeddings.n_bytes_max = (size_t) std::max(sparams.image_cache_mb, 0) << 20;
+
+    if (llama.multimodal)
+    {
+        llama.start_image_encoder(sparams.image_threads > 0 ? sparams.image_threads : std::max(params.n_threads / 2, 1));
+    }
+
+    if (params.embedding && sparams.embedding_cache_mb > 0)
+    {
+        // the same tokens embed differently with another model file or pooling
+        const uint64_t sizes[3] = { llama_model_size(llama.model), llama_model_n_params(llama.model), (uint64_t) params.pooling_type };
+        const uint64_t model_id = embedding_cache::hash_bytes(sizes, sizeof(sizes), embedding_cache::hash_bytes(params.model.data(), params.model.size()));
+        llama.embd_cache.init((size_t) sparams.embedding_cache_mb << 20, llama_n_embd(llama.model), model_id, sparams.embedding_cache_file);
+    }
     const auto model_meta = llama.model_meta();
 
     if (sparams.chat_template.empty()) { // custom chat template is not supplied
@@ -3097,91 +7544,71 @@ int main(int argc, char **argv) {
     };
 
     // this is only called if no index.html is found in the public --path
-    svr.Get("/", [](const httplib::Request &, httplib::Response &res)
+    routes.push_back({"GET", "/", false, false, true, [](const httplib::Request &, httplib::Response &res, const httplib::ContentReader &, http_task &)
             {
                 res.set_content("server running", "text/plain; charset=utf-8");
                 res.status = 200; // Unauthorized
-                return true;
-            });
+            }});
 
-    svr.Post("/completion", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+    // the api key is checked before anything is stored, the body of a rejected request is dropped
+    routes.push_back({"POST", "/completion", true, true, false, [&llama](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader, http_task &task)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-                if (!validate_api_key(req, res)) {
+                std::shared_ptr<server_request> request = std::make_shared<server_request>();
+                if (!read_server_request(req, content_reader, *request)) {
+                    res.status = 400;
                     return;
                 }
-                json data = json::parse(req.body);
+                llama.compile_json_schema(*request);
+
                 const int task_id = llama.queue_tasks.get_new_id();
-                llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, data, false, false, -1);
-                if (!json_value(data, "stream", false)) {
-                    std::string completion_text;
-                    task_result result = llama.queue_results.recv(task_id);
-                    if (!result.error && result.stop) {
-                        res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
-                    }
-                    else
-                    {
-                        res.status = 404;
-                        res.set_content(result.result_json["content"], "text/plain; charset=utf-8");
-                    }
-                    llama.queue_results.remove_waiting_task_id(task_id);
-                } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink & sink)
-                    {
-                        while (true)
+                task.task_id      = task_id;
+                task.stream       = json_value(request->data, "stream", false);
+                task.content_type = "text/event-stream";
+                task.start = [&llama, task_id, request]() {
+                    llama.request_completion(task_id, std::move(*request), false, false);
+                };
+                if (!task.stream) {
+                    task.on_result = [](const task_result &result, httplib::Response &res) {
+                        if (!result.error && result.stop) {
+                            res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
+                        }
+                        else
                         {
-                            task_result result = llama.queue_results.recv(task_id);
-                            if (!result.error) {
-                                const std::string str =
-                                    "data: " +
-                                    result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {
-                                    { "to_send", str }
-                                });
-                                if (!sink.write(str.c_str(), str.size()))
-                                {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                if (result.stop) {
-                                    break;
-                                }
-                            } else {
-                                const std::string str =
-                                    "error: " +
-                                    result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {
-                                    { "to_send", str }
-                                });
-                                if (!sink.write(str.c_str(), str.size()))
-                                {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                break;
-                            }
+                            res.status = 404;
+                            res.set_content(json_value(result.result_json, "content", std::string()), "text/plain; charset=utf-8");
                         }
-
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                        sink.done();
                         return true;
                     };
-
-                    auto on_complete = [task_id, &llama] (bool)
-                    {
-                        // cancel
-                        llama.request_cancel(task_id);
-                        llama.queue_results.remove_waiting_task_id(task_id);
+                } else {
+                    task.on_result = [&llama](const task_result &result, httplib::Response &res) {
+                        std::string &str = res.body;
+                        if (!result.error) {
+                            if (result.stream_text && !result.with_probs)
+                            {
+                                sse_append_text(str, result, llama.multimodal);
+                            }
+                            else
+                            {
+                                const json &result_json = result.stream_text ? llama.stream_result_to_json(result) : result.result_json;
+                                str += "data: ";
+                                str += result_json.dump(-1, ' ', false, json::error_handler_t::replace);
+                                str += "\n\n";
+                            }
+                        } else {
+                            str += "error: ";
+                            str += result.result_json.dump(-1, ' ', false, json::error_handler_t::replace);
+                            str += "\n\n";
+                        }
+                        LOG_VERBOSE("data stream", {
+                            { "to_send", str }
+                        });
+                        return result.error || result.stop;
                     };
-
-                    res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
                 }
-            });
+            }});
 
-    svr.Post("/tokenize", [&llama](const httplib::Request &req, httplib::Response &res)
+    routes.push_back({"POST", "/tokenize", false, false, false, [&llama](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &, http_task &)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
                 const json body = json::parse(req.body);
@@ -3191,10 +7618,10 @@ int main(int argc, char **argv) {
                     tokens = llama.tokenize(body["content"], false);
                 }
                 const json data = format_tokenizer_response(tokens);
-                return res.set_content(data.dump(), "application/json; charset=utf-8");
-            });
+                res.set_content(data.dump(), "application/json; charset=utf-8");
+            }});
 
-    svr.Post("/detokenize", [&llama](const httplib::Request &req, httplib::Response &res)
+    routes.push_back({"POST", "/detokenize", false, false, false, [&llama](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &, http_task &)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
                 const json body = json::parse(req.body);
@@ -3206,44 +7633,57 @@ int main(int argc, char **argv) {
                 }
 
                 const json data = format_detokenized_response(content);
-                return res.set_content(data.dump(), "application/json; charset=utf-8");
-            });
+                res.set_content(data.dump(), "application/json; charset=utf-8");
+            }});
 
-    svr.Post("/embedding", [&llama](const httplib::Request &req, httplib::Response &res)
+    routes.push_back({"POST", "/embedding", true, false, false, [&llama](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader, http_task &task)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-                const json body = json::parse(req.body);
-                json prompt;
-                if (body.count("content") != 0)
-                {
-                    prompt = body["content"];
+                std::shared_ptr<server_request> request = std::make_shared<server_request>();
+                if (!read_server_request(req, content_reader, *request, "content")) {
+                    res.status = 400;
+                    return;
                 }
-                else
+                json &body = request->data;
+                json data = { { "n_predict", 0} };
+                data["prompt"]     = body.count("content") != 0 ? std::move(body["content"]) : json("");
+                data["image_data"] = body.count("image_data") != 0 ? std::move(body["image_data"]) : json("");
+                for (const char *option : {"encoding", "normalize", "dimensions"})
                 {
-                    prompt = "";
+                    if (body.count(option) != 0)
+                    {
+                        data[option] = std::move(body[option]);
+                    }
                 }
+                body = std::move(data);
 
-                json image_data;
-                if (body.count("image_data") != 0) {
-                    image_data = body["image_data"];
-                }
-                else
+                const bool text = llama.params.embedding && !(body["image_data"].is_array() && !body["image_data"].empty());
+
+                json cached;
+                if (text && llama.embedding_from_cache(*request, cached))
                 {
-                    image_data = "";
+                    res.set_content(cached.dump(), "application/json; charset=utf-8");
+                    return;
                 }
 
-                // create and queue the task
+                // create the task, queued by the front end
                 const int task_id = llama.queue_tasks.get_new_id();
-                llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, { {"prompt", prompt}, { "n_predict", 0}, {"image_data", image_data} }, false, true, -1);
-
-                // get the result
-                task_result result = llama.queue_results.recv(task_id);
-                llama.queue_results.remove_waiting_task_id(task_id);
-
-                // send the result
-                return res.set_content(result.result_json.dump(), "application/json; charset=utf-8");
-            });
+                task.task_id = task_id;
+                task.start = [&llama, task_id, request, text]() {
+                    if (text)
+                    {
+                        llama.request_embedding(task_id, std::move(*request));
+                    }
+                    else
+                    {
+                        llama.request_completion(task_id, std::move(*request), false, true);
+                    }
+                };
+                task.on_result = [](const task_result &result, httplib::Response &res) {
+                    res.set_content(result.result_json.dump(), "application/json; charset=utf-8");
+                    return true;
+                };
+            }});
 
     // GG: if I put the main loop inside a thread, it crashes on the first request when build in Debug!?
     //     "Bus error: 10" - this is on macOS, it does not crash on Linux
@@ -3258,13 +7698,65 @@ int main(int argc, char **argv) {
     //);
 
     if (sparams.n_threads_http < 1) {
+#if defined(__linux__)
+        // the workers only run handlers, open streams and idle connections don't take one; a request per slot can
+        // be tokenized at once, the health and metrics endpoints don't need a worker
+        sparams.n_threads_http = std::max(params.n_parallel, (int32_t) 2);
+#else
         // +2 threads for monitoring endpoints
         sparams.n_threads_http = std::max(params.n_parallel + 2, (int32_t) std::thread::hardware_concurrency() - 1);
+#endif
     }
     log_data["n_threads_http"] =  std::to_string(sparams.n_threads_http);
+#if !defined(__linux__)
+    http_register(svr, routes, llama, validate_api_key);
     svr.new_task_queue = [&sparams] { return new httplib::ThreadPool(sparams.n_threads_http); };
+#endif
 
     LOG_INFO("HTTP server listening", log_data);
+
+#if !defined(_WIN32)
+    int unix_socket_fd = -1;
+    if (!sparams.unix_socket.empty())
+    {
+        if (!sparams.shm_path.empty())
+        {
+            // a couple of rings per slot, so queued requests and closing connections don't run out
+            const uint32_t n_rings = std::max(2 * params.n_parallel, 16);
+            if (sparams.shm_eventfd < 0 || !llama.shm_rings.init(sparams.shm_path, n_rings, 64 * 1024, sparams.shm_eventfd))
+            {
+                LOG_ERROR("couldn't set up shared memory rings", {{"path", sparams.shm_path}});
+                return 1;
+            }
+            LOG_INFO("shared memory rings", {{"path", sparams.shm_path}, {"n_rings", n_rings}});
+        }
+
+        unix_socket_fd = unix_socket_listen(sparams.unix_socket);
+        if (unix_socket_fd < 0)
+        {
+            return 1;
+        }
+        LOG_INFO("unix socket listening", {{"path", sparams.unix_socket}});
+#if !defined(__linux__)
+        std::thread(unix_socket_serve, std::ref(llama), unix_socket_fd).detach();
+#endif
+    }
+#else
+    if (!sparams.unix_socket.empty())
+    {
+        LOG_WARNING("--unix-socket is not supported on this platform, ignoring", {});
+    }
+#endif
+
+#if defined(__linux__)
+    // one thread serves the HTTP and Unix socket connections
+    frontend.unix_fd          = unix_socket_fd;
+    frontend.validate_api_key = validate_api_key;
+    if (!frontend.start(sparams.n_threads_http))
+    {
+        return 1;
+    }
+#else
     // run the HTTP server in a thread - see comment below
     std::thread t([&]()
             {
@@ -3276,13 +7768,14 @@ int main(int argc, char **argv) {
 
                 return 0;
             });
+#endif
 
     llama.queue_tasks.on_new_task(std::bind(
         &llama_server_context::process_single_task, &llama, std::placeholders::_1));
     llama.queue_tasks.on_finish_multitask(std::bind(
         &llama_server_context::on_finish_multitask, &llama, std::placeholders::_1));
     llama.queue_tasks.on_run_slots(std::bind(
-        &llama_server_context::update_slots, &llama));
+        &llama_server_context::run_slots, &llama));
     llama.queue_results.on_multitask_update(std::bind(
         &llama_server_queue::update_multitask,
         &llama.queue_tasks,
@@ -3313,8 +7806,21 @@ int main(int argc, char **argv) {
     delete[] argv;
 #endif
     llama.queue_tasks.start_loop();
+#if defined(__linux__)
+    frontend.stop();
+#else
     svr.stop();
     t.join();
+#endif
+
+#if !defined(_WIN32)
+    if (unix_socket_fd >= 0)
+    {
+        shutdown(unix_socket_fd, SHUT_RDWR);
+        close(unix_socket_fd);
+        unlink(sparams.unix_socket.c_str());
+    }
+#endif
 
     llama_backend_free();
     return 0;
@@ -24,10 +24,20 @@
 
 #include <string>
 #include <vector>
+#include <array>
 #include <set>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <unordered_map>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "json.hpp"
 
@@ -69,9 +79,13 @@ enum task_type {
     TASK_TYPE_COMPLETION,
     TASK_TYPE_CANCEL,
     TASK_TYPE_NEXT_RESPONSE,
-    TASK_TYPE_METRICS
+    TASK_TYPE_METRICS,
+    TASK_TYPE_EMBEDDING
 };
 
+struct server_request;
+struct json_schema_automaton;
+
 struct task_server {
     int id = -1; // to be filled by llama_server_queue
     int target_id;
@@ -80,6 +94,23 @@ struct task_server {
     bool infill_mode = false;
     bool embedding_mode = false;
     int multitask_id = -1;
+    int shm_ring = -1; // shared memory ring for the streamed tokens, see shm_token_rings
+    uint32_t shm_ring_gen = 0;
+    std::shared_ptr<const server_request> request; // token prompt and decoded images parsed out of data, may be null
+};
+
+// completion token output with probabilities
+struct completion_token_output {
+    struct token_prob
+    {
+        llama_token tok;
+        float prob;
+    };
+
+    std::vector<token_prob> probs;
+    llama_token tok;
+    std::string text_to_send;
+    size_t text_pos = 0; // where the text of the token starts in the slot's generated_text
 };
 
 struct task_result {
@@ -88,6 +119,15 @@ struct task_result {
     bool stop;
     bool error;
     json result_json;
+
+    // streamed text skips result_json: the transport serializes it straight from these fields
+    // (see sse_append_text and binary_append_token)
+    bool stream_text = false;
+    std::string text;
+    llama_token tok = -1; // last token covered by text
+    int slot_id = -1;
+    bool with_probs = false;
+    std::vector<completion_token_output> probs;
 };
 
 struct task_multi {
@@ -96,19 +136,6 @@ struct task_multi {
     std::vector<task_result> results{};
 };
 
-// completion token output with probabilities
-struct completion_token_output {
-    struct token_prob
-    {
-        llama_token tok;
-        float prob;
-    };
-
-    std::vector<token_prob> probs;
-    llama_token tok;
-    std::string text_to_send;
-};
-
 struct token_translator {
     llama_context * ctx;
     std::string operator()(llama_token tok)                    const { return llama_token_to_piece(ctx, tok); }
@@ -308,7 +335,7 @@ struct llama_server_queue {
                         lock.unlock();
                         break;
                     }
-                    task_server task = queue_tasks.front();
+                    task_server task = std::move(queue_tasks.front());
                     queue_tasks.erase(queue_tasks.begin());
                     lock.unlock();
                     LOG_VERBOSE("callback_new_task", {{"task_id", task.id}});
@@ -385,6 +412,12 @@ struct llama_server_queue {
 struct llama_server_response {
     typedef std::function<void(int, int, task_result&)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
+    // tasks whose results are handed to a callback instead of being queued for recv()
+    // the callbacks run in the sending thread with mutex_results held, so they must be quick
+    typedef std::function<void(task_result&&)> callback_result_t;
+    std::unordered_map<int, callback_result_t> task_callbacks;
+    // duplicates of a running task, {task id, multitask id}, that get a copy of each of its results until the last
+    std::unordered_map<int, std::vector<std::pair<int, int>>> followers;
     // for keeping track of all tasks waiting for the result
     std::set<int> waiting_task_ids;
     // the main result queue
@@ -406,6 +439,58 @@ struct llama_server_response {
         waiting_task_ids.erase(task_id);
     }
 
+    void add_task_callback(int task_id, callback_result_t callback) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        task_callbacks[task_id] = std::move(callback);
+    }
+
+    void remove_task_callback(int task_id) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        task_callbacks.erase(task_id);
+    }
+
+    // attach a duplicate to the results task_id sends from now on, the earlier ones are the caller's business
+    void add_follower(int task_id, int follower_id, int follower_multitask_id) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        followers[task_id].emplace_back(follower_id, follower_multitask_id);
+    }
+
+    // detach a cancelled duplicate
+    void remove_follower(int follower_id) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (auto it = followers.begin(); it != followers.end(); ++it) {
+            auto & list = it->second;
+            for (auto f = list.begin(); f != list.end(); ++f) {
+                if (f->first == follower_id) {
+                    list.erase(f);
+                    if (list.empty()) {
+                        followers.erase(it);
+                    }
+                    return;
+                }
+            }
+        }
+    }
+
+    // when a task with followers is cancelled, the first follower takes its place and the others follow it
+    bool promote_follower(int task_id, int & new_id, int & new_multitask_id) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        auto it = followers.find(task_id);
+        if (it == followers.end()) {
+            return false;
+        }
+        std::vector<std::pair<int, int>> list = std::move(it->second);
+        followers.erase(it);
+
+        new_id           = list.front().first;
+        new_multitask_id = list.front().second;
+        list.erase(list.begin());
+        if (!list.empty()) {
+            followers[new_id] = std::move(list);
+        }
+        return true;
+    }
+
     // This function blocks the thread until there is a response for this task_id
     task_result recv(int task_id) {
         while (true)
@@ -420,7 +505,7 @@ struct llama_server_response {
                 if (queue_results[i].id == task_id)
                 {
                     assert(queue_results[i].multitask_id == -1);
-                    task_result res = queue_results[i];
+                    task_result res = std::move(queue_results[i]);
                     queue_results.erase(queue_results.begin() + i);
                     return res;
                 }
@@ -439,6 +524,59 @@ struct llama_server_response {
     void send(task_result result) {
         std::unique_lock<std::mutex> lock(mutex_results);
         LOG_VERBOSE("send new result", {{"task_id", result.id}});
+        if (!followers.empty())
+        {
+            auto it = followers.find(result.id);
+            if (it != followers.end())
+            {
+                for (const auto & follower : it->second)
+                {
+                    task_result copy = result;
+                    copy.id           = follower.first;
+                    copy.multitask_id = follower.second;
+                    deliver(std::move(copy));
+                }
+                if (result.stop || result.error)
+                {
+                    followers.erase(it);
+                }
+            }
+        }
+        deliver(std::move(result));
+    }
+
+    // copies of a result for the followers of its task only, when the task itself got it another way
+    void send_followers(const task_result & result) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        if (followers.empty())
+        {
+            return;
+        }
+        auto it = followers.find(result.id);
+        if (it == followers.end())
+        {
+            return;
+        }
+        for (const auto & follower : it->second)
+        {
+            task_result copy = result;
+            copy.id           = follower.first;
+            copy.multitask_id = follower.second;
+            deliver(std::move(copy));
+        }
+    }
+
+    // hand a result to its callback, multitask or recv(), with mutex_results held
+    void deliver(task_result && result) {
+        if (result.multitask_id == -1 && !task_callbacks.empty())
+        {
+            auto it = task_callbacks.find(result.id);
+            if (it != task_callbacks.end())
+            {
+                it->second(std::move(result));
+                return;
+            }
+        }
         for (auto& task_id : waiting_task_ids) {
             // LOG_TEE("waiting task id %i \n", task_id);
             // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
@@ -452,7 +590,7 @@ struct llama_server_response {
             if (result.id == task_id)
             {
                 LOG_VERBOSE("queue_results.push_back", {{"task_id", task_id}});
-                queue_results.push_back(result);
+                queue_results.push_back(std::move(result));
                 condition_results.notify_all();
                 return;
             }
@@ -469,187 +607,1341 @@ static const std::string base64_chars =
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
 
-static inline bool is_base64(uint8_t c)
-{
-    return (isalnum(c) || (c == '+') || (c == '/'));
-}
+// value of every byte in the alphabet, 0xff for '=' and anything else that ends the input
+static const uint8_t base64_table[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
 
-static inline std::vector<uint8_t> base64_decode(const std::string & encoded_string)
+// Decodes the longest prefix of in made of base64 characters into out, which needs room for len / 4 * 3 + 32
+// bytes as the vector paths store whole registers. n leftover characters at the end make n - 1 bytes.
+// Returns the number of bytes decoded.
+static inline size_t base64_decode_into(const char * in, size_t len, uint8_t * out)
 {
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-
-    int in_len = encoded_string.size();
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
-
-    std::vector<uint8_t> ret;
-
-    while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_]))
+    size_t   i = 0;
+    uint8_t *o = out;
+
+    // the vector paths classify characters by nibble: lut_lo and lut_hi share a bit only for bytes outside the
+    // alphabet, lut_roll, indexed by the high nibble ('/' gets its own entry), maps the rest to their values
+#if defined(__AVX2__)
+    const __m256i lut_lo   = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi   = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f  = _mm256_set1_epi8(0x2f);
+    const __m256i pack     = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    for (; i + 32 <= len; i += 32, o += 24)
     {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4)
+        const __m256i str = _mm256_loadu_si256((const __m256i *) (in + i));
+        const __m256i hi  = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo  = _mm256_and_si256(str, mask_2f);
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi)))
         {
-            for (i = 0; i <4; i++)
-            {
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-            }
+            break;
+        }
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f), hi));
+        const __m256i vals = _mm256_add_epi8(str, roll);
 
-            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+        // 4 x 6 bits -> 24 bits per 32 bit lane, then 12 bytes per 128 bit lane and 24 contiguous bytes
+        const __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(vals, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+        const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256((__m256i *) o, packed);
+    }
+#elif defined(__SSSE3__)
+    const __m128i lut_lo   = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi   = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f  = _mm_set1_epi8(0x2f);
+    const __m128i pack     = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    for (; i + 16 <= len; i += 16, o += 12)
+    {
+        const __m128i str = _mm_loadu_si128((const __m128i *) (in + i));
+        const __m128i hi  = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo  = _mm_and_si128(str, mask_2f);
+        const __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff)
+        {
+            break;
+        }
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f), hi));
+        const __m128i vals = _mm_add_epi8(str, roll);
 
-            for (i = 0; (i < 3); i++)
-            {
-                ret.push_back(char_array_3[i]);
-            }
-            i = 0;
+        const __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i *) o, _mm_shuffle_epi8(merged, pack));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t lut_lo_bytes[16]   = { 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a };
+    static const uint8_t lut_hi_bytes[16]   = { 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 };
+    static const uint8_t lut_roll_bytes[16] = { 0, 16, 19, 4, 0xbf, 0xbf, 0xb9, 0xb9, 0, 0, 0, 0, 0, 0, 0, 0 };
+    const uint8x16_t lut_lo   = vld1q_u8(lut_lo_bytes);
+    const uint8x16_t lut_hi   = vld1q_u8(lut_hi_bytes);
+    const uint8x16_t lut_roll = vld1q_u8(lut_roll_bytes);
+    for (; i + 64 <= len; i += 64, o += 48)
+    {
+        // deinterleaved, so that every register holds the same character of 16 quads
+        uint8x16x4_t str = vld4q_u8((const uint8_t *) in + i);
+        uint8x16_t   bad = vdupq_n_u8(0);
+        for (int k = 0; k < 4; ++k)
+        {
+            const uint8x16_t hi = vshrq_n_u8(str.val[k], 4);
+            const uint8x16_t lo = vandq_u8(str.val[k], vdupq_n_u8(0x0f));
+            bad = vorrq_u8(bad, vandq_u8(vqtbl1q_u8(lut_lo, lo), vqtbl1q_u8(lut_hi, hi)));
+            const uint8x16_t roll = vqtbl1q_u8(lut_roll, vaddq_u8(vceqq_u8(str.val[k], vdupq_n_u8(0x2f)), hi));
+            str.val[k] = vaddq_u8(str.val[k], roll);
+        }
+        if (vmaxvq_u8(bad) != 0)
+        {
+            break;
         }
+
+        uint8x16x3_t bytes;
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(str.val[0], 2), vshrq_n_u8(str.val[1], 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(str.val[1], 4), vshrq_n_u8(str.val[2], 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(str.val[2], 6), str.val[3]);
+        vst3q_u8(o, bytes);
     }
+#endif
 
-    if (i)
+    const uint8_t * s = (const uint8_t *) in;
+    for (; i + 4 <= len; i += 4, o += 3)
     {
-        for (j = i; j <4; j++)
+        const uint32_t a = base64_table[s[i]];
+        const uint32_t b = base64_table[s[i + 1]];
+        const uint32_t c = base64_table[s[i + 2]];
+        const uint32_t d = base64_table[s[i + 3]];
+        if ((a | b | c | d) & 0x80)
         {
-            char_array_4[j] = 0;
+            break;
         }
+        const uint32_t v = a << 18 | b << 12 | c << 6 | d;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+    }
 
-        for (j = 0; j <4; j++)
+    uint32_t v = 0;
+    size_t   n = 0;
+    for (; i < len && n < 4 && base64_table[s[i]] != 0xff; ++i, ++n)
+    {
+        v = v << 6 | base64_table[s[i]];
+    }
+    if (n >= 2)
+    {
+        v <<= 6 * (4 - n);
+        o[0] = v >> 16;
+        if (n == 3)
         {
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+            o[1] = v >> 8;
         }
+        o += n - 1;
+    }
 
-        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+    return o - out;
+}
 
-        for (j = 0; (j < i - 1); j++)
-        {
-            ret.push_back(char_array_3[j]);
-        }
+static inline std::vector<uint8_t> base64_decode(const std::string & encoded_string)
+{
+    std::vector<uint8_t> ret(encoded_string.size() / 4 * 3 + 32);
+    ret.resize(base64_decode_into(encoded_string.data(), encoded_string.size(), ret.data()));
+    return ret;
+}
+
+static inline std::string base64_encode(const uint8_t * data, size_t len)
+{
+    std::string ret;
+    ret.reserve((len + 2) / 3 * 4);
+
+    size_t i = 0;
+    for (; i + 2 < len; i += 3)
+    {
+        const uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        ret.push_back(base64_chars[(v >> 18) & 0x3f]);
+        ret.push_back(base64_chars[(v >> 12) & 0x3f]);
+        ret.push_back(base64_chars[(v >>  6) & 0x3f]);
+        ret.push_back(base64_chars[ v        & 0x3f]);
+    }
+
+    if (i < len)
+    {
+        const uint32_t v = (data[i] << 16) | (i + 1 < len ? data[i + 1] << 8 : 0);
+        ret.push_back(base64_chars[(v >> 18) & 0x3f]);
+        ret.push_back(base64_chars[(v >> 12) & 0x3f]);
+        ret.push_back(i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=');
+        ret.push_back('=');
     }
 
     return ret;
 }
 
 //
-// random string / id
+// sha256 utils
 //
 
-static std::string random_string()
+// SHA-256 (FIPS 180-4), keys the caches whose entries a crafted input must not be able to collide with
+struct sha256
 {
-    static const std::string str("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+    typedef std::array<uint8_t, 32> digest_type;
 
-    std::random_device rd;
-    std::mt19937 generator(rd());
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    uint8_t  block[64];
+    size_t   n_block = 0; // bytes waiting in block
+    uint64_t n_bytes = 0;
 
-    std::string result(32, ' ');
+    static uint32_t rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
 
-    for (int i = 0; i < 32; ++i) {
-        result[i] = str[generator() % str.size()];
+    void compress(const uint8_t * p)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], x = h[7];
+        for (int i = 0; i < 64; i++)
+        {
+            const uint32_t t1 = x + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            x = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += x;
     }
 
-    return result;
-}
+    sha256 & update(const void * data, size_t n)
+    {
+        const uint8_t * p = (const uint8_t *) data;
+        n_bytes += n;
+        if (n_block > 0)
+        {
+            const size_t take = std::min(n, sizeof(block) - n_block);
+            memcpy(block + n_block, p, take);
+            n_block += take;
+            p += take;
+            n -= take;
+            if (n_block < sizeof(block))
+            {
+                return *this;
+            }
+            compress(block);
+            n_block = 0;
+        }
+        for (; n >= sizeof(block); p += sizeof(block), n -= sizeof(block))
+        {
+            compress(p);
+        }
+        memcpy(block, p, n);
+        n_block = n;
+        return *this;
+    }
 
-static std::string gen_chatcmplid()
-{
-    std::stringstream chatcmplid;
-    chatcmplid << "chatcmpl-" << random_string();
-    return chatcmplid.str();
-}
+    // the hash of everything passed to update, the object is spent afterwards
+    digest_type digest()
+    {
+        const uint64_t n_bits = n_bytes * 8;
+        uint8_t pad[72] = { 0x80 };
+        const size_t n_pad = (n_block < 56 ? 56 : 120) - n_block;
+        for (int i = 0; i < 8; i++)
+        {
+            pad[n_pad + i] = (uint8_t) (n_bits >> (56 - 8 * i));
+        }
+        update(pad, n_pad + 8);
+
+        digest_type out;
+        for (int i = 0; i < 32; i++)
+        {
+            out[i] = (uint8_t) (h[i / 4] >> (24 - 8 * (i % 4)));
+        }
+        return out;
+    }
+
+    static digest_type of(const void * data, size_t n)
+    {
+        return sha256().update(data, n).digest();
+    }
+};
 
 //
-// other common utils
+// embedding encoding
 //
 
-static size_t common_part(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
+// How /embedding sends a vector back, from the "encoding" request option:
+//   float  - json array of numbers (default)
+//   f32    - base64 of little endian float32 values
+//   f16    - base64 of little endian float16 values
+//   int8   - base64 of int8 values q with a "scale" field, x ~= q * scale
+//   binary - base64 of the sign bits, 1 for x > 0, packed most significant bit first
+// "dimensions" truncates the vector first (Matryoshka models), then "normalize" scales it to unit L2 norm.
+enum embedding_encoding
 {
-    size_t i;
-    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
+    EMBEDDING_FLOAT,
+    EMBEDDING_F32,
+    EMBEDDING_F16,
+    EMBEDDING_INT8,
+    EMBEDDING_BINARY,
+};
+
+struct embedding_format
+{
+    embedding_encoding encoding = EMBEDDING_FLOAT;
+    bool normalize              = false;
+    int32_t dimensions          = 0; // 0 keeps all of them
+};
+
+// unknown encodings and invalid values are ignored, same as other optional fields
+static inline embedding_format embedding_format_from_json(const json &data)
+{
+    embedding_format fmt;
+
+    const std::string encoding = data.contains("encoding") && data.at("encoding").is_string() ? data.at("encoding").get<std::string>() : "";
+    if      (encoding == "f32")    { fmt.encoding = EMBEDDING_F32;    }
+    else if (encoding == "f16")    { fmt.encoding = EMBEDDING_F16;    }
+    else if (encoding == "int8")   { fmt.encoding = EMBEDDING_INT8;   }
+    else if (encoding == "binary") { fmt.encoding = EMBEDDING_BINARY; }
+
+    if (data.contains("normalize") && data.at("normalize").is_boolean())
     {
+        fmt.normalize = data.at("normalize").get<bool>();
+    }
+    if (data.contains("dimensions") && data.at("dimensions").is_number_integer() && data.at("dimensions").get<int64_t>() > 0)
+    {
+        fmt.dimensions = std::min<int64_t>(data.at("dimensions").get<int64_t>(), INT32_MAX);
     }
-    return i;
-}
 
-static bool ends_with(const std::string &str, const std::string &suffix)
-{
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+    return fmt;
 }
 
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
+// the {"embedding": ...} object of a response
+static inline json embedding_to_json(std::vector<float> embd, const embedding_format &fmt)
 {
-    if (!text.empty() && !stop.empty())
+    if (fmt.dimensions > 0 && (size_t) fmt.dimensions < embd.size())
+    {
+        embd.resize(fmt.dimensions);
+    }
+
+    if (fmt.normalize)
+    {
+        double sum = 0.0;
+        for (float x : embd)
+        {
+            sum += (double) x * x;
+        }
+        const float norm = sum > 0.0 ? (float) (1.0 / std::sqrt(sum)) : 0.0f;
+        for (float &x : embd)
+        {
+            x *= norm;
+        }
+    }
+
+    switch (fmt.encoding)
     {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
+        case EMBEDDING_F32:
+        {
+            return json{ {"embedding", base64_encode((const uint8_t *) embd.data(), embd.size() * sizeof(float))} };
+        }
+        case EMBEDDING_F16:
+        {
+            std::vector<ggml_fp16_t> half(embd.size());
+            for (size_t i = 0; i < embd.size(); i++)
+            {
+                half[i] = ggml_fp32_to_fp16(embd[i]);
+            }
+            return json{ {"embedding", base64_encode((const uint8_t *) half.data(), half.size() * sizeof(ggml_fp16_t))} };
+        }
+        case EMBEDDING_INT8:
+        {
+            float amax = 0.0f;
+            for (float x : embd)
+            {
+                amax = std::max(amax, std::fabs(x));
+            }
+            const float scale = amax / 127.0f;
+
+            std::vector<uint8_t> q(embd.size(), 0);
+            if (scale > 0.0f)
+            {
+                for (size_t i = 0; i < embd.size(); i++)
+                {
+                    const long v = std::lround(embd[i] / scale);
+                    q[i] = (uint8_t) (int8_t) std::max(-127L, std::min(127L, v));
+                }
+            }
+            return json{ {"embedding", base64_encode(q.data(), q.size())}, {"scale", scale} };
+        }
+        case EMBEDDING_BINARY:
         {
-            if (stop[char_index] == text_last_char)
+            std::vector<uint8_t> bits((embd.size() + 7) / 8, 0);
+            for (size_t i = 0; i < embd.size(); i++)
             {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
+                if (embd[i] > 0.0f)
                 {
-                    return text.size() - char_index - 1;
+                    bits[i / 8] |= 0x80 >> (i % 8);
                 }
             }
+            return json{ {"embedding", base64_encode(bits.data(), bits.size())} };
         }
+        default:
+            return json{ {"embedding", std::move(embd)} };
     }
-    return std::string::npos;
 }
 
-// TODO: reuse llama_detokenize
-template <class Iter>
-static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
+//
+// request parsing
+//
+
+// The parts of a /completion or /embedding body that are expensive as json, taken out while parsing:
+// a prompt made only of token ids and the decoded image_data images. Everything else stays in data.
+struct server_request
 {
-    std::string ret;
-    for (; begin != end; ++begin)
+    json data;
+
+    bool has_prompt_tokens = false; // "prompt" was an array of token ids, moved out of data
+    std::vector<llama_token> prompt_tokens;
+
+    // image_data[i].data decoded, indexed like image_data; the json keeps an empty string in its place
+    std::vector<std::vector<uint8_t>> images;
+    std::vector<bool> images_decoded;
+
+    // json_schema compiled before the task was queued, or why it could not be
+    std::shared_ptr<const json_schema_automaton> json_schema;
+    std::string json_schema_error;
+};
+
+// SAX handler building the same json as json::parse, except for the fields of server_request.
+// Top level "prompt" is held back until its value shows whether it is a token array, and
+// image_data strings are decoded straight from the parser's buffer instead of being copied.
+struct server_request_sax
+{
+    typedef json::number_integer_t  number_integer_t;
+    typedef json::number_unsigned_t number_unsigned_t;
+    typedef json::number_float_t    number_float_t;
+    typedef json::string_t          string_t;
+    typedef json::binary_t          binary_t;
+
+    server_request &req;
+    nlohmann::detail::json_sax_dom_parser<json> dom;
+
+    int depth = 0;
+    bool images_key    = false; // the last top level key was image_data
+    bool in_images     = false; // inside the top level image_data array
+    int  image_index   = -1;
+    bool image_data    = false; // the next value is image_data[image_index].data
+    bool prompt_key    = false; // the top level "prompt" key hasn't been passed on yet
+    bool prompt_tokens = false; // collecting the prompt as token ids
+
+    std::string prompt_name; // the key holding the prompt, "content" for /embedding
+
+    server_request_sax(server_request &req, const std::string &prompt_name, bool allow_exceptions)
+        : req(req), dom(req.data, allow_exceptions), prompt_name(prompt_name) {}
+
+    // the prompt turned out not to be only token ids: pass on what was held back
+    void flush_prompt()
     {
-        ret += llama_token_to_piece(ctx, *begin);
+        if (prompt_key)
+        {
+            string_t key = prompt_name;
+            dom.key(key);
+            prompt_key = false;
+        }
+        if (prompt_tokens)
+        {
+            dom.start_array(static_cast<std::size_t>(-1));
+            for (llama_token tok : req.prompt_tokens)
+            {
+                dom.number_integer(tok);
+            }
+            req.prompt_tokens.clear();
+            prompt_tokens = false;
+        }
     }
-    return ret;
-}
 
-// format incomplete utf-8 multibyte character for output
-static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
-{
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
-    // if the size is 1 and first bit is 1, meaning it's a partial character
-    //   (size > 1 meaning it's already a known token)
-    if (out.size() == 1 && (out[0] & 0x80) == 0x80)
+    // called before every value not handled specially
+    void value()
     {
-        std::stringstream ss;
-        ss << std::hex << (out[0] & 0xff);
-        std::string res(ss.str());
-        out = "byte: \\x" + res;
+        flush_prompt();
+        image_data = false;
     }
-    return out;
-}
 
-// convert a vector of completion_token_output to json
-static json probs_vector_to_json(const llama_context *ctx, const std::vector<completion_token_output> &probs)
-{
-    json out = json::array();
-    for (const auto &prob : probs)
+    // called first for every value, to index the elements of image_data
+    void element()
     {
-        json probs_for_token = json::array();
-        for (const auto &p : prob.probs)
+        if (in_images && depth == 2)
         {
-            std::string tok_str = tokens_to_output_formatted_string(ctx, p.tok);
-            probs_for_token.push_back(json
-            {
-                {"tok_str", tok_str},
-                {"prob",    p.prob},
-            });
+            image_index++;
         }
-        std::string tok_str = tokens_to_output_formatted_string(ctx, prob.tok);
-        out.push_back(json{
-            {"content", tok_str},
-            {"probs",   probs_for_token},
-        });
+    }
+
+    bool null()                                              { element(); value(); return dom.null(); }
+    bool boolean(bool val)                                   { element(); value(); return dom.boolean(val); }
+    bool number_float(number_float_t val, const string_t &s) { element(); value(); return dom.number_float(val, s); }
+    bool binary(binary_t &val)                               { element(); value(); return dom.binary(val); }
+
+    bool number_integer(number_integer_t val)
+    {
+        if (prompt_tokens && val >= 0 && val <= INT32_MAX)
+        {
+            req.prompt_tokens.push_back((llama_token) val);
+            return true;
+        }
+        element();
+        value();
+        return dom.number_integer(val);
+    }
+
+    bool number_unsigned(number_unsigned_t val)
+    {
+        if (prompt_tokens && val <= INT32_MAX)
+        {
+            req.prompt_tokens.push_back((llama_token) val);
+            return true;
+        }
+        element();
+        value();
+        return dom.number_unsigned(val);
+    }
+
+    bool string(string_t &val)
+    {
+        element();
+        if (image_data)
+        {
+            if ((int) req.images.size() <= image_index)
+            {
+                req.images.resize(image_index + 1);
+                req.images_decoded.resize(image_index + 1, false);
+            }
+            req.images[image_index]         = base64_decode(val);
+            req.images_decoded[image_index] = true;
+            image_data = false;
+            string_t empty;
+            return dom.string(empty);
+        }
+        value();
+        return dom.string(val);
+    }
+
+    bool start_object(std::size_t len)
+    {
+        element();
+        value();
+        depth++;
+        return dom.start_object(len);
+    }
+
+    bool key(string_t &val)
+    {
+        if (depth == 1)
+        {
+            images_key = val == "image_data";
+            if (val == prompt_name)
+            {
+                prompt_key = true;
+                return true;
+            }
+        }
+        image_data = in_images && depth == 3 && val == "data";
+        return dom.key(val);
+    }
+
+    bool end_object()
+    {
+        depth--;
+        return dom.end_object();
+    }
+
+    bool start_array(std::size_t len)
+    {
+        if (prompt_key && depth == 1)
+        {
+            prompt_tokens = true;
+            req.prompt_tokens.clear();
+            depth++;
+            return true;
+        }
+        element();
+        value();
+        depth++;
+        in_images = in_images || (depth == 2 && images_key);
+        return dom.start_array(len);
+    }
+
+    bool end_array()
+    {
+        depth--;
+        if (prompt_tokens)
+        {
+            if (req.prompt_tokens.empty())
+            {
+                // keep an empty prompt array as it is
+                flush_prompt();
+                return dom.end_array();
+            }
+            req.has_prompt_tokens = true;
+            prompt_tokens = false;
+            prompt_key    = false;
+            return true;
+        }
+        if (depth == 1)
+        {
+            in_images = false;
+        }
+        return dom.end_array();
+    }
+
+    // a template like the dom parser's, so it rethrows the concrete exception type
+    template<class Exception>
+    bool parse_error(std::size_t position, const std::string &last_token, const Exception &ex)
+    {
+        return dom.parse_error(position, last_token, ex);
+    }
+};
+
+// parse a request body into req, like json::parse(body) would (throwing the same exceptions unless
+// allow_exceptions is false, in which case invalid bodies return false)
+static inline bool parse_server_request(const std::string &body, server_request &req, const std::string &prompt_name = "prompt", bool allow_exceptions = true)
+{
+    server_request_sax sax(req, prompt_name, allow_exceptions);
+    return json::sax_parse(body, &sax);
+}
+
+//
+// random string / id
+//
+
+static inline std::string random_string()
+{
+    static const std::string str("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+
+    std::random_device rd;
+    std::mt19937 generator(rd());
+
+    std::string result(32, ' ');
+
+    for (int i = 0; i < 32; ++i) {
+        result[i] = str[generator() % str.size()];
+    }
+
+    return result;
+}
+
+static inline std::string gen_chatcmplid()
+{
+    std::stringstream chatcmplid;
+    chatcmplid << "chatcmpl-" << random_string();
+    return chatcmplid.str();
+}
+
+//
+// other common utils
+//
+
+static inline size_t common_part(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
+{
+    size_t i;
+    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
+    {
+    }
+    return i;
+}
+
+//
+// sampling utils
+//
+
+// these work on the raw logits of a single sequence, so that greedy and top-k sampling
+// do not have to build and sort a llama_token_data array of n_vocab entries
+
+// softmax denominator over the whole vocab, used to turn the selected logits into probabilities
+static inline float logits_sum_exp(const float * logits, int32_t n, float max_logit)
+{
+    float sum = 0.0f;
+    for (int32_t i = 0; i < n; ++i)
+    {
+        sum += expf(logits[i] - max_logit);
+    }
+    return sum;
+}
+
+// collect the k largest logits into out, sorted by descending logit
+// a block of logits is only looked at element by element when one of them beats the current k-th largest,
+// which after the first few thousand entries is rare, so the scan runs at memory bandwidth
+static inline void logits_top_k(const float * logits, int32_t n, int32_t k, std::vector<llama_token_data> & out)
+{
+    out.clear();
+    k = std::min(k, n);
+    if (k <= 0)
+    {
+        return;
+    }
+
+    // min-heap on the logit: front() is the smallest value kept so far
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+    for (int32_t i = 0; i < k; ++i)
+    {
+        out.push_back(llama_token_data{i, logits[i], 0.0f});
+    }
+    std::make_heap(out.begin(), out.end(), cmp);
+    float threshold = out.front().logit;
+
+    const auto insert = [&](int32_t id)
+    {
+        if (logits[id] > threshold)
+        {
+            std::pop_heap(out.begin(), out.end(), cmp);
+            out.back() = llama_token_data{id, logits[id], 0.0f};
+            std::push_heap(out.begin(), out.end(), cmp);
+            threshold = out.front().logit;
+        }
+    };
+
+    int32_t i = k;
+#if defined(__AVX__)
+    for (; i + 8 <= n; i += 8)
+    {
+        const int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i), _mm256_set1_ps(threshold), _CMP_GT_OQ));
+        for (int j = 0; mask != 0 && j < 8; ++j)
+        {
+            if (mask & (1 << j))
+            {
+                insert(i + j);
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4)
+    {
+        const int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(logits + i), _mm_set1_ps(threshold)));
+        for (int j = 0; mask != 0 && j < 4; ++j)
+        {
+            if (mask & (1 << j))
+            {
+                insert(i + j);
+            }
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4)
+    {
+        const uint32x4_t gt   = vcgtq_f32(vld1q_f32(logits + i), vdupq_n_f32(threshold));
+        const uint32x2_t any2 = vorr_u32(vget_low_u32(gt), vget_high_u32(gt));
+        if ((vget_lane_u32(any2, 0) | vget_lane_u32(any2, 1)) != 0)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                insert(i + j);
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        insert(i);
+    }
+
+    std::sort_heap(out.begin(), out.end(), cmp);
+}
+
+// greedy sampling: the first of equal maxima, same as llama_sample_token_greedy
+// a plain scan, a register at a time compared with the maximum so far, which rarely changes
+static inline llama_token logits_argmax(const float * logits, int32_t n)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    float       max  = logits[0];
+    llama_token best = 0;
+
+    const auto update = [&](int32_t from, int32_t to)
+    {
+        for (int32_t j = from; j < to; ++j)
+        {
+            if (logits[j] > max)
+            {
+                max  = logits[j];
+                best = j;
+            }
+        }
+    };
+
+    int32_t i = 1;
+#if defined(__AVX__)
+    for (; i + 8 <= n; i += 8)
+    {
+        if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i), _mm256_set1_ps(max), _CMP_GT_OQ)) != 0)
+        {
+            update(i, i + 8);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4)
+    {
+        if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(logits + i), _mm_set1_ps(max))) != 0)
+        {
+            update(i, i + 4);
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4)
+    {
+        const uint32x4_t gt   = vcgtq_f32(vld1q_f32(logits + i), vdupq_n_f32(max));
+        const uint32x2_t any2 = vorr_u32(vget_low_u32(gt), vget_high_u32(gt));
+        if ((vget_lane_u32(any2, 0) | vget_lane_u32(any2, 1)) != 0)
+        {
+            update(i, i + 4);
+        }
+    }
+#endif
+    update(i, n);
+
+    return best;
+}
+
+// occurrence counts of the last n tokens, kept up to date in O(1) per token so that
+// repetition penalties only touch the logits of tokens that are actually in the window
+struct token_window_counts
+{
+    int32_t n_max = 0;
+    int32_t head  = 0;
+    std::vector<llama_token> ring;
+    std::unordered_map<llama_token, int32_t> counts;
+
+    void reset(int32_t n)
+    {
+        n_max = std::max(0, n);
+        head  = 0;
+        ring.clear();
+        counts.clear();
+    }
+
+    void push(llama_token tok)
+    {
+        if (n_max == 0)
+        {
+            return;
+        }
+        if ((int32_t) ring.size() < n_max)
+        {
+            ring.push_back(tok);
+        }
+        else
+        {
+            const auto it = counts.find(ring[head]);
+            if (--it->second == 0)
+            {
+                counts.erase(it);
+            }
+            ring[head] = tok;
+            head = (head + 1) % n_max;
+        }
+        counts[tok]++;
+    }
+
+    // same adjustment as llama_sample_repetition_penalties, skipping tok_skip (the newline when penalize_nl is off)
+    void apply(float * logits, float penalty_repeat, float penalty_freq, float penalty_present, llama_token tok_skip) const
+    {
+        if (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)
+        {
+            return;
+        }
+        for (const auto & it : counts)
+        {
+            if (it.first == tok_skip)
+            {
+                continue;
+            }
+            float & logit = logits[it.first];
+            logit  = logit <= 0 ? logit * penalty_repeat : logit / penalty_repeat;
+            logit -= float(it.second) * penalty_freq + penalty_present;
+        }
+    }
+};
+
+// Aho-Corasick automaton over the stop strings of a request, fed with the generated text one piece at a time
+// each byte is a single table lookup, so the cost per token does not depend on the number of stop strings
+// or on how much text is being held back
+struct stop_string_matcher
+{
+    std::vector<std::string> words;
+
+    std::vector<std::array<int32_t, 256>> next; // goto function with the failure links folded in
+    std::vector<int32_t> depth;                 // length of the prefix spelled by each node
+    std::vector<int32_t> out;                   // longest word ending at each node (via suffix links), or -1
+
+    int32_t state = 0;
+    size_t  n_fed = 0;
+
+    // earliest full match seen so far, as a position in the fed text
+    size_t  match_pos  = std::string::npos;
+    int32_t match_word = -1;
+
+    void build(const std::vector<std::string> &stop_words)
+    {
+        words = stop_words;
+        next.assign(1, std::array<int32_t, 256>());
+        next[0].fill(-1);
+        depth.assign(1, 0);
+        out.assign(1, -1);
+
+        for (size_t w = 0; w < words.size(); ++w)
+        {
+            if (words[w].empty())
+            {
+                continue;
+            }
+            int32_t node = 0;
+            for (const char c : words[w])
+            {
+                int32_t &child = next[node][(uint8_t) c];
+                if (child < 0)
+                {
+                    child = (int32_t) next.size();
+                    next.emplace_back();
+                    next.back().fill(-1);
+                    depth.push_back(depth[node] + 1);
+                    out.push_back(-1);
+                }
+                node = next[node][(uint8_t) c];
+            }
+            if (out[node] < 0)
+            {
+                out[node] = (int32_t) w;
+            }
+        }
+
+        // breadth first, so the failure target of a node is complete before its children are visited
+        std::vector<int32_t> fail(next.size(), 0);
+        std::vector<int32_t> queue;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (next[0][c] < 0)
+            {
+                next[0][c] = 0;
+            }
+            else
+            {
+                queue.push_back(next[0][c]);
+            }
+        }
+        for (size_t i = 0; i < queue.size(); ++i)
+        {
+            const int32_t node = queue[i];
+            if (out[node] < 0)
+            {
+                out[node] = out[fail[node]];
+            }
+            for (int c = 0; c < 256; ++c)
+            {
+                const int32_t child = next[node][c];
+                if (child < 0)
+                {
+                    next[node][c] = next[fail[node]][c];
+                }
+                else
+                {
+                    fail[child] = next[fail[node]][c];
+                    queue.push_back(child);
+                }
+            }
+        }
+
+        state      = 0;
+        n_fed      = 0;
+        match_pos  = std::string::npos;
+        match_word = -1;
+    }
+
+    void feed(const std::string &piece)
+    {
+        if (words.empty())
+        {
+            n_fed += piece.size();
+            return;
+        }
+        for (const char c : piece)
+        {
+            state = next[state][(uint8_t) c];
+            n_fed++;
+            if (out[state] >= 0)
+            {
+                const size_t pos = n_fed - words[out[state]].size();
+                // same tie-break as scanning the words in order: the first listed word wins
+                if (match_pos == std::string::npos || pos < match_pos || (pos == match_pos && out[state] < match_word))
+                {
+                    match_pos  = pos;
+                    match_word = out[state];
+                }
+            }
+        }
+    }
+
+    // start of the longest suffix of the fed text that is a prefix of a stop string, or npos
+    size_t partial_pos() const
+    {
+        return words.empty() || depth[state] == 0 ? std::string::npos : n_fed - depth[state];
+    }
+};
+
+// the same for stop sequences given as token ids, matched on the sampled tokens without detokenizing them
+struct stop_token_matcher
+{
+    std::vector<std::vector<llama_token>> sequences;
+
+    std::vector<std::unordered_map<llama_token, int32_t>> children;
+    std::vector<int32_t> fail;
+    std::vector<int32_t> depth;
+    std::vector<int32_t> out; // longest sequence ending at each node (via suffix links), the first listed of equal ones, or -1
+
+    int32_t state = 0;
+
+    bool empty() const
+    {
+        return sequences.empty();
+    }
+
+    void build(const std::vector<std::vector<llama_token>> &stop_sequences)
+    {
+        sequences = stop_sequences;
+        children.assign(1, std::unordered_map<llama_token, int32_t>());
+        fail.assign(1, 0);
+        depth.assign(1, 0);
+        out.assign(1, -1);
+        state = 0;
+
+        for (size_t s = 0; s < sequences.size(); ++s)
+        {
+            int32_t node = 0;
+            for (const llama_token tok : sequences[s])
+            {
+                const auto it = children[node].find(tok);
+                if (it != children[node].end())
+                {
+                    node = it->second;
+                    continue;
+                }
+                const int32_t child = (int32_t) children.size();
+                children[node][tok] = child;
+                children.emplace_back();
+                fail.push_back(0);
+                depth.push_back(depth[node] + 1);
+                out.push_back(-1);
+                node = child;
+            }
+            if (node != 0 && out[node] < 0)
+            {
+                out[node] = (int32_t) s;
+            }
+        }
+
+        std::vector<int32_t> queue;
+        for (const auto &it : children[0])
+        {
+            queue.push_back(it.second);
+        }
+        for (size_t i = 0; i < queue.size(); ++i)
+        {
+            const int32_t node = queue[i];
+            if (out[node] < 0)
+            {
+                out[node] = out[fail[node]];
+            }
+            for (const auto &it : children[node])
+            {
+                fail[it.second] = step(fail[node], it.first);
+                queue.push_back(it.second);
+            }
+        }
+    }
+
+    int32_t step(int32_t node, llama_token tok) const
+    {
+        while (true)
+        {
+            const auto it = children[node].find(tok);
+            if (it != children[node].end())
+            {
+                return it->second;
+            }
+            if (node == 0)
+            {
+                return 0;
+            }
+            node = fail[node];
+        }
+    }
+
+    // returns the index of the sequence completed by tok, or -1
+    int32_t feed(llama_token tok)
+    {
+        state = step(state, tok);
+        return out[state];
+    }
+
+    // number of trailing tokens that may still turn into a stop sequence
+    size_t n_partial() const
+    {
+        return depth[state];
+    }
+};
+
+// TODO: reuse llama_detokenize
+template <class Iter>
+static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
+{
+    std::string ret;
+    for (; begin != end; ++begin)
+    {
+        // negative ids are image positions in a multimodal prompt, they have no text
+        if (*begin >= 0)
+        {
+            ret += llama_token_to_piece(ctx, *begin);
+        }
+    }
+    return ret;
+}
+
+// format incomplete utf-8 multibyte character for output
+static inline std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
+{
+    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
+    // if the size is 1 and first bit is 1, meaning it's a partial character
+    //   (size > 1 meaning it's already a known token)
+    if (out.size() == 1 && (out[0] & 0x80) == 0x80)
+    {
+        std::stringstream ss;
+        ss << std::hex << (out[0] & 0xff);
+        std::string res(ss.str());
+        out = "byte: \\x" + res;
     }
     return out;
 }
+
+// convert a vector of completion_token_output to json
+static inline json probs_vector_to_json(const llama_context *ctx, const std::vector<completion_token_output> &probs)
+{
+    json out = json::array();
+    for (const auto &prob : probs)
+    {
+        json probs_for_token = json::array();
+        for (const auto &p : prob.probs)
+        {
+            std::string tok_str = tokens_to_output_formatted_string(ctx, p.tok);
+            probs_for_token.push_back(json
+            {
+                {"tok_str", tok_str},
+                {"prob",    p.prob},
+            });
+        }
+        std::string tok_str = tokens_to_output_formatted_string(ctx, prob.tok);
+        out.push_back(json{
+            {"content", tok_str},
+            {"probs",   probs_for_token},
+        });
+    }
+    return out;
+}
+
+//
+// streaming utils
+//
+
+// escapes of the control characters, same spelling as json::dump
+static const char * const json_control_escapes[0x20] = {
+    "\\u0000", "\\u0001", "\\u0002", "\\u0003", "\\u0004", "\\u0005", "\\u0006", "\\u0007",
+    "\\b",     "\\t",     "\\n",     "\\u000b", "\\f",     "\\r",     "\\u000e", "\\u000f",
+    "\\u0010", "\\u0011", "\\u0012", "\\u0013", "\\u0014", "\\u0015", "\\u0016", "\\u0017",
+    "\\u0018", "\\u0019", "\\u001a", "\\u001b", "\\u001c", "\\u001d", "\\u001e", "\\u001f",
+};
+
+// length of the UTF-8 sequence starting at s[i]; if it is invalid or truncated, valid is cleared and the
+// length covers the bytes up to the first one that cannot continue it (the ones json::dump replaces with U+FFFD)
+static inline size_t utf8_sequence_length(const std::string &s, size_t i, bool &valid)
+{
+    const uint8_t c = s[i];
+    size_t len;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+
+    valid = true;
+    if (c < 0x80)                               { return 1; }
+    else if (c >= 0xC2 && c <= 0xDF)            { len = 2; }
+    else if (c == 0xE0)                         { len = 3; lo = 0xA0; }
+    else if (c == 0xED)                         { len = 3; hi = 0x9F; }
+    else if (c >= 0xE1 && c <= 0xEF)            { len = 3; }
+    else if (c == 0xF0)                         { len = 4; lo = 0x90; }
+    else if (c == 0xF4)                         { len = 4; hi = 0x8F; }
+    else if (c >= 0xF1 && c <= 0xF3)            { len = 4; }
+    else                                        { valid = false; return 1; }
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        const uint8_t cc = i + k < s.size() ? (uint8_t) s[i + k] : 0;
+        if (cc < lo || cc > hi)
+        {
+            valid = false;
+            return k;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return len;
+}
+
+// append str as the body of a JSON string, escaped like json::dump with error_handler_t::replace
+// runs of plain characters are copied in one go, invalid UTF-8 bytes become U+FFFD
+static inline void json_escape_append(std::string &out, const std::string &str)
+{
+    size_t run = 0;
+    for (size_t i = 0; i < str.size();)
+    {
+        const uint8_t c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        out.append(str, run, i - run);
+        if (c < 0x20)
+        {
+            out += json_control_escapes[c];
+            i++;
+        }
+        else if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char) c;
+            i++;
+        }
+        else
+        {
+            bool valid;
+            const size_t len = utf8_sequence_length(str, i, valid);
+            if (valid)
+            {
+                out.append(str, i, len);
+            }
+            else
+            {
+                out += "\xEF\xBF\xBD";
+            }
+            i += len;
+        }
+        run = i;
+    }
+    out.append(str, run, std::string::npos);
+}
+
+// append the SSE frame of a streamed text result, the same bytes as dumping the equivalent result_json
+static inline void sse_append_text(std::string &out, const task_result &res, bool multimodal)
+{
+    out += "data: {\"content\":\"";
+    json_escape_append(out, res.text);
+    out += multimodal ? "\",\"multimodal\":true,\"slot_id\":" : "\",\"multimodal\":false,\"slot_id\":";
+    out += std::to_string(res.slot_id);
+    out += ",\"stop\":false}\n\n";
+}
+
+// binary framing of the Unix socket transport (--unix-socket), all integers little endian:
+//   frame   := u32 size, u8 type, payload[size - 1]
+//   REQUEST := completion request json, client to server
+//   TOKEN   := i32 tok, u8 flags, [u32 n_tokens, n_tokens x (i32 tok, u32 n_probs, n_probs x (i32 tok, f32 prob))], piece
+//              the probabilities are only there with BINARY_TOKEN_PROBS, the piece takes the rest of the frame
+//   JSON    := any other result, the same object as an SSE data line (the final one has "stop": true)
+//   ERROR   := error json
+enum binary_frame_type {
+    BINARY_FRAME_REQUEST = 1,
+    BINARY_FRAME_TOKEN   = 2,
+    BINARY_FRAME_JSON    = 3,
+    BINARY_FRAME_ERROR   = 4,
+};
+
+static const uint8_t BINARY_TOKEN_PROBS = 1;
+
+static inline void binary_append_u32(std::string &out, uint32_t v)
+{
+    out += (char) (v & 0xFF);
+    out += (char) ((v >> 8) & 0xFF);
+    out += (char) ((v >> 16) & 0xFF);
+    out += (char) (v >> 24);
+}
+
+static inline void binary_append_frame(std::string &out, binary_frame_type type, const std::string &payload)
+{
+    binary_append_u32(out, (uint32_t) payload.size() + 1);
+    out += (char) type;
+    out += payload;
+}
+
+static inline void binary_append_token(std::string &out, const task_result &res)
+{
+    const size_t start = out.size();
+    binary_append_u32(out, 0); // size, patched below
+    out += (char) BINARY_FRAME_TOKEN;
+    binary_append_u32(out, (uint32_t) res.tok);
+    out += (char) (res.with_probs ? BINARY_TOKEN_PROBS : 0);
+    if (res.with_probs)
+    {
+        binary_append_u32(out, (uint32_t) res.probs.size());
+        for (const completion_token_output &cto : res.probs)
+        {
+            binary_append_u32(out, (uint32_t) cto.tok);
+            binary_append_u32(out, (uint32_t) cto.probs.size());
+            for (const auto &p : cto.probs)
+            {
+                uint32_t bits;
+                memcpy(&bits, &p.prob, sizeof(bits));
+                binary_append_u32(out, (uint32_t) p.tok);
+                binary_append_u32(out, bits);
+            }
+        }
+    }
+    out += res.text;
+
+    const uint32_t size = (uint32_t) (out.size() - start - 4);
+    for (int i = 0; i < 4; ++i)
+    {
+        out[start + i] = (char) ((size >> (8 * i)) & 0xFF);
+    }
+}
@@ -4,13 +4,17 @@ import (
 	"bufio"
 	"bytes"
 	"context"
+	"encoding/binary"
 	"encoding/json"
 	"errors"
 	"fmt"
 	"io"
 	"log"
 	"log/slog"
+	"maps"
+	"math"
 	"math/rand"
+	"mime/multipart"
 	"net"
 	"net/http"
 	"os"
@@ -29,6 +33,8 @@ import (
 // LlamaServer is an instance of the llama.cpp server
 type LlamaServer struct {
 	port    int
+	socket  string    // Unix socket for completions, empty to use HTTP
+	shm     *shmRings // shared memory token delivery over the socket, nil when off
 	cmd     *exec.Cmd
 	done    chan error // Channel to signal when the process exits
 	status  *StatusWriter
@@ -269,6 +275,24 @@ func NewLlamaServer(model string, adapters, projectors []string, opts api.Option
 		}
 		finalParams := append(params, "--port", strconv.Itoa(port))
 
+		// stream completions over a Unix socket where available, it skips HTTP and SSE framing per token
+		socket := ""
+		if runtime.GOOS != "windows" {
+			socket = filepath.Join(os.TempDir(), fmt.Sprintf("ollama-runner-%d-%d.sock", os.Getpid(), port))
+			finalParams = append(finalParams, "--unix-socket", socket)
+		}
+
+		// opt in to streaming tokens through shared memory, for runners serving many concurrent streams
+		var shm *shmRings
+		if socket != "" && os.Getenv("OLLAMA_SHM_RINGS") != "" {
+			if r, err := newShmRings(port); err != nil {
+				slog.Warn("shared memory rings unavailable", "error", err)
+			} else {
+				shm = r
+				finalParams = append(finalParams, shm.args()...)
+			}
+		}
+
 		pathEnv := "LD_LIBRARY_PATH"
 		if runtime.GOOS == "windows" {
 			pathEnv = "PATH"
@@ -288,6 +312,8 @@ func NewLlamaServer(model string, adapters, projectors []string, opts api.Option
 
 		s := &LlamaServer{
 			port:    port,
+			socket:  socket,
+			shm:     shm,
 			cmd:     exec.Command(server, finalParams...),
 			status:  NewStatusWriter(os.Stderr),
 			options: opts,
@@ -297,6 +323,9 @@ func NewLlamaServer(model string, adapters, projectors []string, opts api.Option
 		s.cmd.Env = append(os.Environ(), libEnv)
 		s.cmd.Stdout = os.Stdout
 		s.cmd.Stderr = s.status
+		if shm != nil {
+			s.cmd.ExtraFiles = shm.files()
+		}
 
 		slog.Info("starting llama server", "cmd", s.cmd.String())
 
@@ -307,8 +336,14 @@ func NewLlamaServer(model string, adapters, projectors []string, opts api.Option
 			}
 			err = fmt.Errorf("error starting the external llama server: %v %s", err, msg)
 			finalErr = err
+			if shm != nil {
+				shm.Close()
+			}
 			continue
 		}
+		if shm != nil {
+			shm.started()
+		}
 
 		// reap subprocess when it exits
 		go func() {
@@ -522,6 +557,54 @@ type completion struct {
 	}
 }
 
+// completionBody encodes a completion request as json, or with images as
+// multipart/form-data: the json in a part named "json" and each image's raw
+// bytes in a part named img-<id>, which spares base64 on both sides.
+func completionBody(request map[string]any, images []ImageData) (*bytes.Buffer, string, error) {
+	buffer := &bytes.Buffer{}
+	var mw *multipart.Writer
+	var w io.Writer = buffer
+	if len(images) > 0 {
+		mw = multipart.NewWriter(buffer)
+		part, err := mw.CreateFormField("json")
+		if err != nil {
+			return nil, "", err
+		}
+		w = part
+
+		request = maps.Clone(request)
+		delete(request, "image_data")
+	}
+
+	// Handling JSON marshaling with special characters unescaped.
+	enc := json.NewEncoder(w)
+	enc.SetEscapeHTML(false)
+
+	if err := enc.Encode(request); err != nil {
+		return nil, "", fmt.Errorf("failed to marshal data: %v", err)
+	}
+
+	if mw == nil {
+		return buffer, "application/json", nil
+	}
+
+	for _, image := range images {
+		name := fmt.Sprintf("img-%d", image.ID)
+		part, err := mw.CreateFormFile(name, name)
+		if err != nil {
+			return nil, "", err
+		}
+		if _, err := part.Write(image.Data); err != nil {
+			return nil, "", err
+		}
+	}
+	if err := mw.Close(); err != nil {
+		return nil, "", err
+	}
+
+	return buffer, mw.FormDataContentType(), nil
+}
+
 type CompletionRequest struct {
 	Prompt  string
 	Format  string
@@ -562,6 +645,8 @@ func (s *LlamaServer) Completion(ctx context.Context, req CompletionRequest, fn
 		"stop":              req.Options.Stop,
 		"image_data":        req.Images,
 		"cache_prompt":      true,
+		// only what completion reads, the runner skips echoing the prompt and settings back
+		"response_fields": []string{"content", "timings"},
 	}
 
 	// Make sure the server is ready
@@ -579,11 +664,10 @@ func (s *LlamaServer) Completion(ctx context.Context, req CompletionRequest, fn
 		}
 	}
 
-	retryDelay := 100 * time.Microsecond
-	for retries := 0; retries < maxRetries; retries++ {
-		if retries > 0 {
-			time.Sleep(retryDelay) // wait before retrying
-			retryDelay *= 2        // exponential backoff
+	// images go over HTTP as raw multipart parts instead of base64 json, the socket only carries json
+	if s.socket != "" && len(req.Images) == 0 {
+		if s.shm != nil {
+			request["shm_ring"] = true
 		}
 
 		// Handling JSON marshaling with special characters unescaped.
@@ -595,12 +679,27 @@ func (s *LlamaServer) Completion(ctx context.Context, req CompletionRequest, fn
 			return fmt.Errorf("failed to marshal data: %v", err)
 		}
 
+		return s.completionSocketRetry(ctx, buffer.Bytes(), fn)
+	}
+
+	retryDelay := 100 * time.Microsecond
+	for retries := 0; retries < maxRetries; retries++ {
+		if retries > 0 {
+			time.Sleep(retryDelay) // wait before retrying
+			retryDelay *= 2        // exponential backoff
+		}
+
+		buffer, contentType, err := completionBody(request, req.Images)
+		if err != nil {
+			return err
+		}
+
 		endpoint := fmt.Sprintf("http://127.0.0.1:%d/completion", s.port)
 		req, err := http.NewRequestWithContext(ctx, http.MethodPost, endpoint, buffer)
 		if err != nil {
 			return fmt.Errorf("error creating POST request: %v", err)
 		}
-		req.Header.Set("Content-Type", "application/json")
+		req.Header.Set("Content-Type", contentType)
 
 		resp, err := http.DefaultClient.Do(req)
 		if err != nil {
@@ -709,11 +808,14 @@ func (s *LlamaServer) Completion(ctx context.Context, req CompletionRequest, fn
 }
 
 type EmbeddingRequest struct {
-	Content string `json:"content"`
+	Content  string `json:"content"`
+	Encoding string `json:"encoding,omitempty"`
 }
 
+// EmbeddingResponse holds the vector as little endian float32 values, requested with "encoding": "f32"
+// instead of a json array of numbers
 type EmbeddingResponse struct {
-	Embedding []float64 `json:"embedding"`
+	Embedding []byte `json:"embedding"`
 }
 
 func (s *LlamaServer) Embedding(ctx context.Context, prompt string) ([]float64, error) {
@@ -725,7 +827,7 @@ func (s *LlamaServer) Embedding(ctx context.Context, prompt string) ([]float64,
 		return nil, fmt.Errorf("unexpected server status: %d", status)
 	}
 
-	data, err := json.Marshal(TokenizeRequest{Content: prompt})
+	data, err := json.Marshal(EmbeddingRequest{Content: prompt, Encoding: "f32"})
 	if err != nil {
 		return nil, fmt.Errorf("error marshaling embed data: %w", err)
 	}
@@ -757,7 +859,16 @@ func (s *LlamaServer) Embedding(ctx context.Context, prompt string) ([]float64,
 		return nil, fmt.Errorf("unmarshal tokenize response: %w", err)
 	}
 
-	return embedding.Embedding, nil
+	if len(embedding.Embedding)%4 != 0 {
+		return nil, fmt.Errorf("invalid embedding size %d", len(embedding.Embedding))
+	}
+
+	values := make([]float64, len(embedding.Embedding)/4)
+	for i := range values {
+		values[i] = float64(math.Float32frombits(binary.LittleEndian.Uint32(embedding.Embedding[4*i:])))
+	}
+
+	return values, nil
 }
 
 type TokenizeRequest struct {
@@ -865,6 +976,12 @@ func (s *LlamaServer) Detokenize(ctx context.Context, tokens []int) (string, err
 }
 
 func (s *LlamaServer) Close() error {
+	if s.socket != "" {
+		os.Remove(s.socket)
+	}
+	if s.shm != nil {
+		s.shm.Close()
+	}
 	if s.cmd != nil {
 		slog.Debug("stopping llama server")
 		return s.cmd.Process.Kill()
@@ -0,0 +1,231 @@
+//go:build linux
+
+package llm
+
+import (
+	"encoding/binary"
+	"fmt"
+	"log/slog"
+	"os"
+	"path/filepath"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+// Layout of the runner's shared memory file, see shm_token_rings in ext_server/server.cpp
+const (
+	shmMagic       = 0x52534c4f // "OLSR"
+	shmVersion     = 1
+	shmHeaderSize  = 64
+	shmControlSize = 128
+)
+
+// shmRings reads the tokens the runner streams through shared memory rings.
+// Each Unix socket connection gets its own ring; the runner signals one
+// eventfd for all of them, which wakes every subscribed connection.
+type shmRings struct {
+	path    string
+	fd      int
+	eventfd *os.File
+	runner  *os.File // the runner's copy of eventfd, closed once it started
+	closed  atomic.Bool
+
+	// mu guards the mapping, which drain reads under the read lock
+	mu       sync.RWMutex
+	mem      []byte
+	ringSize int
+	waiters  map[int]chan struct{}
+}
+
+func newShmRings(port int) (*shmRings, error) {
+	fd, _, errno := syscall.RawSyscall(syscall.SYS_EVENTFD2, 0, syscall.O_CLOEXEC|syscall.O_NONBLOCK, 0)
+	if errno != 0 {
+		return nil, fmt.Errorf("eventfd: %v", errno)
+	}
+	runner, _, errno := syscall.RawSyscall(syscall.SYS_FCNTL, fd, syscall.F_DUPFD_CLOEXEC, 0)
+	if errno != 0 {
+		syscall.Close(int(fd))
+		return nil, fmt.Errorf("eventfd: %v", errno)
+	}
+
+	dir := "/dev/shm"
+	if _, err := os.Stat(dir); err != nil {
+		dir = os.TempDir()
+	}
+
+	r := &shmRings{
+		path:    filepath.Join(dir, fmt.Sprintf("ollama-runner-%d-%d.shm", os.Getpid(), port)),
+		fd:      int(fd),
+		eventfd: os.NewFile(fd, "eventfd"),
+		runner:  os.NewFile(runner, "eventfd"),
+		waiters: make(map[int]chan struct{}),
+	}
+	go r.dispatch()
+	return r, nil
+}
+
+// args for the runner, which inherits the eventfd as its first extra file (fd 3)
+func (r *shmRings) args() []string {
+	return []string{"--shm", r.path, "--shm-eventfd", "3"}
+}
+
+// files are the extra files of the runner's command: a copy of the eventfd,
+// which shares its blocking mode. os.File.Fd may switch a file to blocking
+// mode for exec, started switches it back; a read dispatch blocks in
+// meanwhile isn't interrupted by closing the file, Close wakes it.
+func (r *shmRings) files() []*os.File {
+	return []*os.File{r.runner}
+}
+
+// started is called once the runner started with files
+func (r *shmRings) started() {
+	r.runner.Close()
+	if err := syscall.SetNonblock(r.fd, true); err != nil {
+		slog.Debug("failed to restore non-blocking eventfd", "error", err)
+	}
+}
+
+func (r *shmRings) dispatch() {
+	var buf [8]byte
+	for {
+		if _, err := r.eventfd.Read(buf[:]); err != nil || r.closed.Load() {
+			return
+		}
+
+		r.mu.Lock()
+		for _, ch := range r.waiters {
+			select {
+			case ch <- struct{}{}:
+			default:
+			}
+		}
+		r.mu.Unlock()
+	}
+}
+
+// open maps the file the runner created, with r.mu held
+func (r *shmRings) open() error {
+	f, err := os.OpenFile(r.path, os.O_RDWR, 0)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+
+	fi, err := f.Stat()
+	if err != nil {
+		return err
+	}
+	if fi.Size() < shmHeaderSize {
+		return fmt.Errorf("shared memory file too small: %d", fi.Size())
+	}
+
+	mem, err := syscall.Mmap(int(f.Fd()), 0, int(fi.Size()), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return err
+	}
+
+	if binary.LittleEndian.Uint32(mem[0:]) != shmMagic || binary.LittleEndian.Uint32(mem[4:]) != shmVersion {
+		syscall.Munmap(mem)
+		return fmt.Errorf("unexpected shared memory header")
+	}
+
+	nRings := int(binary.LittleEndian.Uint32(mem[8:]))
+	ringSize := int(binary.LittleEndian.Uint32(mem[12:]))
+	if ringSize == 0 || ringSize&(ringSize-1) != 0 || shmHeaderSize+nRings*(shmControlSize+ringSize) > len(mem) {
+		syscall.Munmap(mem)
+		return fmt.Errorf("invalid shared memory layout")
+	}
+
+	r.mem = mem
+	r.ringSize = ringSize
+	return nil
+}
+
+// subscribe returns a channel that receives after the runner wrote to the rings
+func (r *shmRings) subscribe(ring int) (<-chan struct{}, error) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	if r.mem == nil {
+		if err := r.open(); err != nil {
+			return nil, err
+		}
+	}
+	if ring < 0 || shmHeaderSize+(ring+1)*(shmControlSize+r.ringSize) > len(r.mem) {
+		return nil, fmt.Errorf("invalid shared memory ring %d", ring)
+	}
+
+	ch := make(chan struct{}, 1)
+	r.waiters[ring] = ch
+	return ch, nil
+}
+
+func (r *shmRings) unsubscribe(ring int) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	delete(r.waiters, ring)
+}
+
+func (r *shmRings) copyOut(data []byte, pos uint64, dst []byte) {
+	off := int(pos & uint64(r.ringSize-1))
+	n := copy(dst, data[off:])
+	copy(dst[n:], data)
+}
+
+// drain passes the text of every record written to the ring since the last call to fn
+func (r *shmRings) drain(ring int, fn func(string) error) error {
+	r.mu.RLock()
+	defer r.mu.RUnlock()
+	if r.mem == nil {
+		return fmt.Errorf("shared memory rings closed")
+	}
+
+	base := shmHeaderSize + ring*(shmControlSize+r.ringSize)
+	tail := (*uint64)(unsafe.Pointer(&r.mem[base]))
+	head := (*uint64)(unsafe.Pointer(&r.mem[base+64]))
+	data := r.mem[base+shmControlSize : base+shmControlSize+r.ringSize]
+
+	pos, end := atomic.LoadUint64(head), atomic.LoadUint64(tail)
+	var hdr [8]byte
+	for pos < end {
+		r.copyOut(data, pos, hdr[:])
+		size := binary.LittleEndian.Uint32(hdr[:4])
+		if size < 4 || uint64(size)+4 > end-pos {
+			return fmt.Errorf("corrupt shared memory ring %d", ring)
+		}
+
+		text := make([]byte, size-4)
+		r.copyOut(data, pos+8, text)
+		pos += 4 + uint64(size)
+		atomic.StoreUint64(head, pos)
+
+		if err := fn(string(text)); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (r *shmRings) Close() error {
+	// a blocking read in dispatch isn't interrupted by closing the file, and
+	// closing waits for it
+	r.closed.Store(true)
+	var one [8]byte
+	binary.LittleEndian.PutUint64(one[:], 1)
+	r.eventfd.Write(one[:])
+	r.runner.Close()
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	if r.mem != nil {
+		syscall.Munmap(r.mem)
+		r.mem = nil
+	}
+	if err := os.Remove(r.path); err != nil && !os.IsNotExist(err) {
+		slog.Debug("failed to remove shared memory file", "error", err)
+	}
+	return r.eventfd.Close()
+}
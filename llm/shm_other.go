@@ -0,0 +1,40 @@
+//go:build !linux
+
+package llm
+
+import (
+	"errors"
+	"os"
+)
+
+var errShmUnsupported = errors.New("shared memory rings are only supported on linux")
+
+type shmRings struct{}
+
+func newShmRings(port int) (*shmRings, error) {
+	return nil, errShmUnsupported
+}
+
+func (r *shmRings) args() []string {
+	return nil
+}
+
+func (r *shmRings) files() []*os.File {
+	return nil
+}
+
+func (r *shmRings) started() {}
+
+func (r *shmRings) subscribe(ring int) (<-chan struct{}, error) {
+	return nil, errShmUnsupported
+}
+
+func (r *shmRings) unsubscribe(ring int) {}
+
+func (r *shmRings) drain(ring int, fn func(string) error) error {
+	return nil
+}
+
+func (r *shmRings) Close() error {
+	return nil
+}
@@ -0,0 +1,281 @@
+package llm
+
+import (
+	"bufio"
+	"bytes"
+	"context"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io"
+	"log/slog"
+	"net"
+	"strings"
+	"time"
+)
+
+// Frame types of the llama server's Unix socket transport (--unix-socket).
+// Every frame is a little endian uint32 size, a type byte and size-1 bytes of payload.
+const (
+	frameRequest byte = 1 // completion request json, sent by us
+	frameToken   byte = 2 // int32 token, flags byte, optional probabilities, then the token text
+	frameJSON    byte = 3 // same object as an SSE data line, the final one has "stop": true
+	frameError   byte = 4 // error json
+)
+
+const frameTokenProbs byte = 1
+
+// errSlotUnavailable asks completionSocket's caller to retry the request
+var errSlotUnavailable = fmt.Errorf("slot unavailable")
+
+func writeFrame(w io.Writer, typ byte, payload []byte) error {
+	header := make([]byte, 5, 5+len(payload))
+	binary.LittleEndian.PutUint32(header, uint32(len(payload)+1))
+	header[4] = typ
+	_, err := w.Write(append(header, payload...))
+	return err
+}
+
+func readFrame(r io.Reader, buf []byte) (byte, []byte, error) {
+	var header [5]byte
+	if _, err := io.ReadFull(r, header[:]); err != nil {
+		return 0, nil, err
+	}
+
+	size := binary.LittleEndian.Uint32(header[:4])
+	if size == 0 || size > maxBufferSize {
+		return 0, nil, fmt.Errorf("invalid frame size %d", size)
+	}
+
+	if cap(buf) < int(size-1) {
+		buf = make([]byte, size-1)
+	}
+	buf = buf[:size-1]
+	if _, err := io.ReadFull(r, buf); err != nil {
+		return 0, nil, err
+	}
+
+	return header[4], buf, nil
+}
+
+// tokenFrameText returns the text of a token frame, skipping the token id and probabilities
+func tokenFrameText(payload []byte) (string, error) {
+	if len(payload) < 5 {
+		return "", fmt.Errorf("short token frame")
+	}
+
+	flags := payload[4]
+	payload = payload[5:]
+	if flags&frameTokenProbs != 0 {
+		if len(payload) < 4 {
+			return "", fmt.Errorf("short token frame")
+		}
+		n := uint64(binary.LittleEndian.Uint32(payload))
+		payload = payload[4:]
+		for i := uint64(0); i < n; i++ {
+			if len(payload) < 8 {
+				return "", fmt.Errorf("short token frame")
+			}
+			probs := uint64(binary.LittleEndian.Uint32(payload[4:]))
+			if uint64(len(payload)-8) < 8*probs {
+				return "", fmt.Errorf("short token frame")
+			}
+			payload = payload[8+8*probs:]
+		}
+	}
+
+	return string(payload), nil
+}
+
+type socketFrame struct {
+	typ     byte
+	payload []byte
+	err     error
+}
+
+// errTokenRepeat aborts a prediction that keeps repeating the same token
+var errTokenRepeat = fmt.Errorf("token repeat limit reached")
+
+// completionSocket runs one completion over the Unix socket. Closing the
+// connection, which happens when ctx is done, cancels the task in the server.
+// With shared memory rings the tokens arrive through the ring the server
+// announces first; the ring is drained before every frame to keep the order.
+func (s *LlamaServer) completionSocket(ctx context.Context, request []byte, fn func(CompletionResponse)) error {
+	var d net.Dialer
+	conn, err := d.DialContext(ctx, "unix", s.socket)
+	if err != nil {
+		return fmt.Errorf("dial llama server socket: %v", err)
+	}
+	defer conn.Close()
+
+	if err := writeFrame(conn, frameRequest, request); err != nil {
+		return fmt.Errorf("POST predict: %v", err)
+	}
+
+	stop := make(chan struct{})
+	defer close(stop)
+
+	frames := make(chan socketFrame)
+	go func() {
+		r := bufio.NewReader(conn)
+		for {
+			typ, payload, err := readFrame(r, nil)
+			select {
+			case frames <- socketFrame{typ, payload, err}:
+			case <-stop:
+				return
+			}
+			if err != nil {
+				return
+			}
+		}
+	}()
+
+	// keep track of the last token generated, this is used to abort if the model starts looping
+	var lastToken string
+	var tokenRepeat int
+
+	emit := func(content string) error {
+		switch {
+		case strings.TrimSpace(content) == lastToken:
+			tokenRepeat++
+		default:
+			lastToken = strings.TrimSpace(content)
+			tokenRepeat = 0
+		}
+
+		// 30 picked as an arbitrary max token repeat limit, modify as needed
+		if tokenRepeat > 30 {
+			slog.Debug("prediction aborted, token repeat limit reached")
+			return errTokenRepeat
+		}
+
+		if content != "" {
+			fn(CompletionResponse{
+				Content: content,
+			})
+		}
+		return nil
+	}
+
+	ring := -1
+	var wake <-chan struct{}
+	defer func() {
+		if ring >= 0 {
+			s.shm.unsubscribe(ring)
+		}
+	}()
+
+	drain := func() error {
+		if ring < 0 {
+			return nil
+		}
+		return s.shm.drain(ring, emit)
+	}
+
+	for {
+		var f socketFrame
+		select {
+		case <-ctx.Done():
+			// This handles the request cancellation
+			return ctx.Err()
+		case <-wake:
+			if err := drain(); err == errTokenRepeat {
+				return ctx.Err()
+			} else if err != nil {
+				return fmt.Errorf("error reading llm response: %v", err)
+			}
+			continue
+		case f = <-frames:
+		}
+
+		if f.err != nil {
+			if ctx.Err() != nil {
+				return ctx.Err()
+			}
+			if f.err == io.EOF || f.err == io.ErrUnexpectedEOF {
+				s.Close()
+				msg := ""
+				if s.status != nil && s.status.LastErrMsg != "" {
+					msg = s.status.LastErrMsg
+				}
+
+				return fmt.Errorf("an unknown error was encountered while running the model %s", msg)
+			}
+			return fmt.Errorf("error reading llm response: %v", f.err)
+		}
+
+		// everything in the ring was written before this frame: the runner stops writing
+		// to the ring for the rest of a request once a token had to go out as a frame
+		if err := drain(); err == errTokenRepeat {
+			return ctx.Err()
+		} else if err != nil {
+			return fmt.Errorf("error reading llm response: %v", err)
+		}
+
+		var c struct {
+			completion
+			ShmRing *int `json:"shm_ring"`
+		}
+		switch f.typ {
+		case frameToken:
+			if c.Content, err = tokenFrameText(f.payload); err != nil {
+				return fmt.Errorf("error parsing llm response stream: %v", err)
+			}
+		case frameJSON:
+			if err := json.Unmarshal(f.payload, &c); err != nil {
+				return fmt.Errorf("error unmarshaling llm prediction response: %v", err)
+			}
+			if c.ShmRing != nil {
+				if wake, err = s.shm.subscribe(*c.ShmRing); err != nil {
+					return fmt.Errorf("error opening llm shared memory: %v", err)
+				}
+				ring = *c.ShmRing
+				continue
+			}
+		case frameError:
+			// try again on slot unavailable
+			if bytes.Contains(f.payload, []byte("slot unavailable")) {
+				return errSlotUnavailable
+			}
+			slog.Error("llm predict error", "error", string(f.payload))
+			return fmt.Errorf("%s", f.payload)
+		default:
+			return fmt.Errorf("error parsing llm response stream: unexpected frame type %d", f.typ)
+		}
+
+		if err := emit(c.Content); err != nil {
+			return ctx.Err()
+		}
+
+		if c.Stop {
+			fn(CompletionResponse{
+				Done:               true,
+				PromptEvalCount:    c.Timings.PromptN,
+				PromptEvalDuration: parseDurationMs(c.Timings.PromptMS),
+				EvalCount:          c.Timings.PredictedN,
+				EvalDuration:       parseDurationMs(c.Timings.PredictedMS),
+			})
+			return nil
+		}
+	}
+}
+
+// retry the socket completion the same way as the HTTP one on slot unavailable
+func (s *LlamaServer) completionSocketRetry(ctx context.Context, request []byte, fn func(CompletionResponse)) error {
+	retryDelay := 100 * time.Microsecond
+	for retries := 0; retries < maxRetries; retries++ {
+		if retries > 0 {
+			time.Sleep(retryDelay) // wait before retrying
+			retryDelay *= 2        // exponential backoff
+		}
+
+		err := s.completionSocket(ctx, request, fn)
+		if err != errSlotUnavailable {
+			return err
+		}
+	}
+
+	// should never reach here ideally
+	return fmt.Errorf("max retries exceeded")
+}